@@ -0,0 +1,62 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * draw_list.h: Recorded mesh draws submitted in sorted order
+ */
+
+#ifndef __DRAW_LIST_H__
+#define __DRAW_LIST_H__
+
+
+#include <SoftGfx/types.h>
+#include <SoftGfx/mesh.h>
+#include <SoftGfx/texture.h>
+
+
+/*Size in pixels of the tiles redrawn by incremental lists*/
+#define GFX_DRAW_LIST_TILE		32
+
+/*A recorded mesh draw*/
+typedef struct DrawItem_t {
+	Mesh*	msh;
+	Tex*	tex;
+	mat4	model;	//used instead of msh->model
+} DrawItem;
+
+/*What a draw looked like on the display*/
+typedef struct DrawStamp_t {
+	u64		hash;		//mesh, material, texture and model matrix
+	u32		rect[4];	//screen rect [x0, x1) x [y0, y1), empty if off screen
+} DrawStamp;
+
+/*List of draws, reused from frame to frame*/
+typedef struct DrawList_t {
+	DrawItem*	item;
+	u32			count;
+	u32			size;		//allocated items
+	u64*		key;		//sort keys and order, 2 * size each
+	u32*		order;
+
+	/*Incremental lists own the display and only redraw what changed*/
+	bint		incremental;
+	bint		drawn;		//the last submit is still on the display
+	u32			serial;		//renderer state after the last submit
+	mat4		proj;		//matrices of the last submit
+	mat4		view;
+	DrawStamp*	stamp;		//stamps of the draws and of the last submit, size each
+	DrawStamp*	prev;
+	u32			prev_count;
+	u8*			tile;		//dirty tiles of the display
+	u32*		rect;		//dirty rects, 4 values each
+	u32			tile_size;
+} DrawList;
+
+
+void gfxDrawListInit(DrawList *dl);
+void gfxDrawListFree(DrawList *dl);
+void gfxDrawListClear(DrawList *dl);
+void gfxDrawListAdd(DrawList *dl, Mesh *msh, mat4 model, Tex *tex);
+void gfxDrawListSubmit(DrawList *dl, mat4 proj, mat4 view);
+void gfxDrawListInvalidate(DrawList *dl);
+
+
+#endif /*__DRAW_LIST_H__*/
@@ -0,0 +1,47 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * frame_stats.h: Frame time percentiles, histogram and overlay
+ */
+
+#ifndef __FRAME_STATS_H__
+#define __FRAME_STATS_H__
+
+
+#include <stdio.h>
+#include <SoftGfx/types.h>
+
+
+/*Frames kept for the rolling percentiles*/
+#define GFX_STATS_FRAMES		512
+/*Quarter octave histogram buckets of the frame time, from 0.5 ms*/
+#define GFX_STATS_BUCKETS		36
+
+/*Timed phases of a frame, the total is their sum*/
+enum {
+	GFX_STAT_UPDATE,
+	GFX_STAT_DRAW,
+	GFX_STAT_COPY,		//present of the display and copy to the window texture
+	GFX_STAT_PRESENT,	//window present, with the vsync wait
+	GFX_STAT_TOTAL,
+	GFX_STAT_COUNT,
+};
+
+typedef struct FrameStats_t {
+	f32		ms[GFX_STAT_COUNT][GFX_STATS_FRAMES];	//last frames of each phase
+	u32		frame;									//frames added
+	u32		hist[GFX_STATS_BUCKETS];				//total time of all the frames
+	f32		worst;									//slowest frame
+	f32		pct[GFX_STAT_COUNT][3];					//p50, p95 and p99 of the last frames
+	FILE*	csv;									//per frame times, NULL if not dumped
+} FrameStats;
+
+
+void gfxFrameStatsInit(FrameStats *fs, const char *csv_path);
+void gfxFrameStatsFree(FrameStats *fs);
+void gfxFrameStatsAdd(FrameStats *fs, const f32 ms[GFX_STAT_COUNT]);
+void gfxFrameStatsUpdate(FrameStats *fs);
+void gfxFrameStatsPrint(FrameStats *fs, FILE *out);
+void gfxFrameStatsOverlay(const FrameStats *fs, u32 *pix, u32 pitch, u32 width, u32 height);
+
+
+#endif /*__FRAME_STATS_H__*/
@@ -11,6 +11,10 @@
 #include <SoftGfx/light.h>
 #include <SoftGfx/mesh.h>
 #include <SoftGfx/texture.h>
+#include <SoftGfx/draw_list.h>
+#include <SoftGfx/scene.h>
+#include <SoftGfx/frame_stats.h>
+#include <SoftGfx/post.h>
 
 /*Primitive types*/
 #define GFX_POINT					1
@@ -21,20 +25,46 @@
 #define GFX_LIGHT_NONE				0
 #define GFX_LIGHT_GOURAUD			1
 #define GFX_LIGHT_PHONG				2
+#define GFX_LIGHT_DEFERRED			3	//G-buffer lit by gfxDeferredResolve
+
+/*Defines for wireframe mode*/
+#define GFX_WIRE_OFF				0
+#define GFX_WIRE_ONLY				1	//Unique mesh edges instead of the triangles
+#define GFX_WIRE_OVERLAY			2	//Unique mesh edges over the triangles
 
 /*Defines for state settings*/
 #define GFX_DEPTH_TEST				0x00
 #define GFX_LIGHTING_MODE			0x01
+#define GFX_LOD_ERROR				0x02	//Max LOD error in pixels (0 = always full detail)
+#define GFX_CULLING					0x03	//Mesh frustum and cluster culling in gfxDrawMesh
+#define GFX_SHADING_RATE			0x04	//Max Phong lighting block (1, 2 or 4 pixels)
+#define GFX_SHADING_QUALITY			0x05	//Coarse shading threshold in [0, 100] (default 50)
+#define GFX_FRAME_BUDGET			0x06	//Dynamic resolution frame time in microseconds (0 = off)
+#define GFX_MIN_RES_SCALE			0x07	//Lowest dynamic resolution in percent (default 50)
+#define GFX_FRAMEBUFFER_TILE		0x08	//Color and depth in 8x8 or 16x16 tiles (0 = rows, the default)
+#define GFX_MSAA					0x09	//Samples per pixel, 4 or 1 (the default)
+#define GFX_LINE_SMOOTH				0x0A	//Wu anti-aliased lines (not with MSAA or deferred lighting)
+#define GFX_WIREFRAME				0x0B	//GFX_WIRE_* mode of the mesh draws
+#define GFX_POINT_SIZE				0x0C	//Point splat size in pixels, 1 (the default) to 16
+#define GFX_TRANSPARENCY			0x0D	//Triangles blended in any order, composited by gfxTransparentResolve
 
 
 void gfxClearColor(u8 r, u8 g, u8 b);
+void gfxWireColor(u8 r, u8 g, u8 b);
 void gfxClear(void);
 void gfxSet(u32 var, u32 value);
 void gfxDisplayRect(u32 x, u32 y, u32 width, u32 height);
+void gfxFrameTime(f32 ms);
 
 /* Drawing Functions */
 //void gfxLineTest(f32 x1, f32 y1, f32 x2, f32 y2);
 void gfxDraw(u32 prim_type, Vert *v_arr, u32 count, mat4 proj, mat4 view, mat4 model, Tex* tex);
 void gfxDrawMesh(Mesh *msh, mat4 proj, mat4 view, Tex* tex);
+void gfxDrawPoints(const f32 *x, const f32 *y, const f32 *z, const u32 *color, u32 count,
+				   mat4 proj, mat4 view, mat4 model);
+void gfxDrawMeshInstanced(Mesh *msh, mat4 proj, mat4 view, Tex* tex, const mat4 *models, u32 count);
+void gfxDeferredResolve(void);
+void gfxTransparentResolve(void);
+void gfxDrawShadowMap(ShadowMap *sm, Mesh *msh);
 
 #endif /*__GFX_H__*/
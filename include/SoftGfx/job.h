@@ -0,0 +1,29 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * job.h: Worker thread pool
+ */
+
+#ifndef __JOB_H__
+#define __JOB_H__
+
+
+#include <SoftGfx/types.h>
+
+
+/*Function run for each index of a job*/
+typedef void (*JobFunc)(void *data, u32 index);
+
+/*Handle of a background job*/
+typedef struct Job_tag Job;
+
+
+void gfxJobInit(u32 threads);
+void gfxJobQuit(void);
+u32 gfxJobThreads(void);
+void gfxJobParallel(JobFunc fn, void *data, u32 count);
+Job* gfxJobAsync(JobFunc fn, void *data);
+bint gfxJobDone(Job *job);
+void gfxJobWait(Job *job);
+
+
+#endif /*__JOB_H__*/
@@ -12,6 +12,9 @@
 
 #define GFX_MAX_LIGHTS		8
 
+/*Size in pixels of the screen tiles point lights are binned in*/
+#define GFX_LIGHT_TILE		16
+
 
 /*Struct that specifies a light*/
 typedef struct Light_t {
@@ -27,11 +30,33 @@ typedef struct Material_t {
 	f32		Se;		//Shininess
 } Material;
 
+/*Local light that fades out at its radius*/
+typedef struct PointLight_t {
+	vec3	pos;
+	vec3	color;
+	f32		radius;
+} PointLight;
+
+/*Depth of the scene seen from a light, drawn with gfxDrawShadowMap*/
+typedef struct ShadowMap_t {
+	f32*	depth;
+	u32		size;	//width and height in texels
+	mat4	proj;	//light projection and view
+	mat4	view;
+	f32		bias;	//depth bias of the lookups
+	u32		pcf;	//PCF filter radius in texels (0 = one sample)
+} ShadowMap;
+
 
 void gfxMaterialSet(Material *m);
 void gfxLightActive(u32 active_bit);
 void gfxLightViewUpdate(mat4 view);
 void gfxLightSet(u8 light_id, Light *l);
+void gfxPointLightSet(const PointLight *l, u32 count);
+void gfxShadowMapInit(ShadowMap *sm, u32 size, mat4 proj, mat4 view);
+void gfxShadowMapFree(ShadowMap *sm);
+void gfxShadowMapClear(ShadowMap *sm);
+void gfxShadowMapSet(u8 light_id, ShadowMap *sm);
 
 
 #endif /*__LIGHT_H__*/
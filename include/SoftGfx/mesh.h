@@ -9,6 +9,45 @@
 
 #include <SoftGfx/types.h>
 #include <SoftGfx/light.h>
+#include <SoftGfx/job.h>
+
+
+/*Extension appended to the OBJ filename for its binary cache*/
+#define GFX_MESH_CACHE_EXT		".sgm"
+
+/*Flags for gfxMeshLoadEx (processing is baked into the cache)*/
+#define GFX_MESH_OPTIMIZE		0x01	//Reorder for vertex cache, overdraw and fetch
+#define GFX_MESH_LOD			0x02	//Build simplified levels of detail
+#define GFX_MESH_PACK			0x04	//Quantize vertices (and 16 bit indices if possible)
+
+/*Flags for gfxMeshNormals*/
+#define GFX_NORMALS_AREA		0x00	//Weight face normals by triangle area
+#define GFX_NORMALS_ANGLE		0x01	//Weight face normals by corner angle
+
+/*Max number of simplified levels of detail per mesh*/
+#define GFX_MESH_MAX_LODS		8
+
+/*Number of triangles per culling cluster*/
+#define GFX_MESH_CLUSTER_TRIS	64
+
+
+//structure for a simplified level of detail (shares the mesh Verts)
+typedef struct MeshLod_t {
+	u32*		indx;		//pointer to indices
+	u32			indx_count;	//number of indices
+	f32			error;		//object space error of the simplification
+} MeshLod;
+
+
+//structure for a cluster of triangles with its bounds and normal cone
+typedef struct MeshCluster_t {
+	u32			indx_ofs;	//first index of the cluster
+	u32			indx_count;	//number of indices
+	vec3		center;		//bounding sphere center
+	f32			radius;		//bounding sphere radius
+	vec3		cone_axis;	//average normal of the triangles
+	f32			cone_cutoff;//sine of the normal cone spread (1 = never culled)
+} MeshCluster;
 
 
 //structure for mesh
@@ -20,9 +59,39 @@ typedef struct Mesh_t {
 	/* Mesh info for rendering */
 	Material	mtrl;		//Mesh material
 	mat4 		model;		//mesh matrix
+	vec3		bmin;		//bounding box min
+	vec3		bmax;		//bounding box max
+	vec3		bcenter;	//bounding sphere center
+	f32			bradius;	//bounding sphere radius
+	/* Quantized data, replaces vrtx (and indx if pindx is used) */
+	PackedVert*	pvrtx;		//pointer to packed Verts
+	u32*		pcolor;		//RGBA8 vertex colors (NULL if all white)
+	u16*		pindx;		//16 bit indices (NULL if indx is used)
+	/* Culling clusters over the full detail indices */
+	MeshCluster* clst;
+	u32			clst_count;
+	/* Levels of detail, from finest to coarsest */
+	MeshLod		lod[GFX_MESH_MAX_LODS];
+	u32			lod_count;
+	/* Unique edges as vertex pairs, full detail then each LOD (for the wireframe) */
+	u32*		edge[GFX_MESH_MAX_LODS + 1];
+	u32			edge_count[GFX_MESH_MAX_LODS + 1];
+	u32*		edge_vert[GFX_MESH_MAX_LODS + 1];	//vertices of the edges in order, NULL if all
+	u32			edge_vert_count[GFX_MESH_MAX_LODS + 1];
+	/* Binary cache mapping (NULL if arrays are heap allocated) */
+	void*		map;
+	u64			map_size;
 } Mesh;
 
 void gfxMeshLoad(Mesh *msh, const char *filename);
+void gfxMeshLoadEx(Mesh *msh, const char *filename, u32 flags);
+Job* gfxMeshLoadAsync(Mesh *msh, const char *filename, u32 flags);
 void gfxMeshFree(Mesh *msh);
+void gfxMeshOptimize(Mesh *msh);
+void gfxMeshLodBuild(Mesh *msh);
+void gfxMeshBoundsUpdate(Mesh *msh);
+void gfxMeshPack(Mesh *msh);
+void gfxMeshNormals(Mesh *msh, u32 flags, vec4 *tangents);
+void gfxMeshEdgesBuild(Mesh *msh);
 
 #endif /*__MESH_H__*/
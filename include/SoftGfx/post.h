@@ -0,0 +1,29 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * post.h: Image space passes run on the display before it is read
+ */
+
+#ifndef __POST_H__
+#define __POST_H__
+
+
+#include <SoftGfx/vm_math.h>
+
+
+/*Passes in a chain*/
+#define GFX_POST_MAX			8
+
+/*Pass types*/
+#define GFX_POST_FXAA			1
+#define GFX_POST_TONEMAP		2
+#define GFX_POST_FOG			3
+
+
+void gfxPostClear(void);
+void gfxPostFxaa(f32 threshold);
+void gfxPostTonemap(f32 exposure, f32 gamma);
+void gfxPostFog(const vec3 color, f32 start, f32 end, mat4 proj);
+u32 gfxPostCount(void);
+
+
+#endif /*__POST_H__*/
@@ -0,0 +1,61 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * scene.h: Mesh container with a bounding volume hierarchy for culling
+ */
+
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+
+#include <SoftGfx/types.h>
+#include <SoftGfx/mesh.h>
+#include <SoftGfx/texture.h>
+#include <SoftGfx/draw_list.h>
+
+
+/*Max objects in a BVH leaf*/
+#define GFX_SCENE_LEAF_SIZE		4
+
+/*A mesh placed in the scene (with its own msh->model)*/
+typedef struct SceneObj_t {
+	Mesh*	msh;
+	Tex*	tex;
+	vec3	bmin;	//world bounding box
+	vec3	bmax;
+	u32		leaf;	//BVH leaf holding the object
+} SceneObj;
+
+/*BVH node, inner nodes have their children at first and first + 1*/
+typedef struct SceneNode_t {
+	vec3	bmin;
+	vec3	bmax;
+	u32		first;	//first child or first entry in obj_indx for leaves
+	u32		count;	//number of objects, 0 for inner nodes
+	u32		parent;
+} SceneNode;
+
+typedef struct Scene_t {
+	SceneObj*	obj;
+	u32			obj_count;
+	u32			obj_size;
+	SceneNode*	node;
+	u32			node_count;
+	u32*		obj_indx;	//objects in leaf order
+	u32*		visible;	//ids of the objects passing the last cull
+	u32			visible_count;
+	bint		dirty;		//objects were added since the last build
+	DrawList	draws;
+} Scene;
+
+
+void gfxSceneInit(Scene *scn);
+void gfxSceneFree(Scene *scn);
+u32 gfxSceneAdd(Scene *scn, Mesh *msh, Tex *tex);
+void gfxSceneBuild(Scene *scn);
+void gfxSceneUpdate(Scene *scn, u32 id);
+void gfxSceneRefit(Scene *scn);
+u32 gfxSceneCull(Scene *scn, mat4 proj, mat4 view, const u32 **ids);
+void gfxSceneDraw(Scene *scn, mat4 proj, mat4 view);
+
+
+#endif /*__SCENE_H__*/
@@ -8,6 +8,7 @@
 
 
 #include <SoftGfx/types.h>
+#include <SoftGfx/job.h>
 
 
 //an RBG texture
@@ -21,6 +22,7 @@ typedef struct Tex_t {
 
 
 Tex* gfxTexLoadBMP(const char *filename);
+Job* gfxTexLoadBMPAsync(Tex **tex, const char *filename);
 void gfxTexFree(Tex *tex);
 //void gfxMeshFree(Mesh *o);
 
@@ -47,9 +47,18 @@ typedef float     mat3[9];
 typedef struct Vert_t {
 	vec3	pos;
 	vec3	norm;
-	vec3	color;
+	vec4	color;	//RGB and alpha (only read by transparent draws)
 	vec2 	tex;
 } Vert;
 
 
+/* Quantized vertex, decoded on the fly when drawing */
+typedef struct PackedVert_t {
+	u16		pos[3];		//position in the mesh bounds (unorm16)
+	u16		pad;
+	s16		norm[2];	//octahedral encoded normal (snorm16)
+	u16		tex[2];		//texture coordinates (half float)
+} PackedVert;
+
+
 #endif /*__TYPES_H__*/
@@ -35,12 +35,22 @@ void vec4_matMul(vec4 dest, const mat4 m, vec4 p);
 void mat4_identity(mat4 m);
 void mat4_mul(mat4 dest, const mat4 m1, const mat4 m2);
 void mat4_normalMatrix(mat3 dest, const mat4 m);
+void mat4_inverse(mat4 dest, const mat4 m);
 
 /* Transformations */
 void mat4_translate(mat4 m, vec3 v);
 void mat4_rotate(mat4 m, vec3 v, f32 angle);
 void mat4_scale(mat4 m, vec3 v);
 
+/* Batch functions (SoA or arrays of vec4) */
+void vec3_mat4MulSoA(f32 *dx, f32 *dy, f32 *dz, const mat4 m, const f32 *x, const f32 *y, const f32 *z, u32 count);
+void vec3_matMulSoA(f32 *dx, f32 *dy, f32 *dz, const mat3 m, const f32 *x, const f32 *y, const f32 *z, u32 count);
+void vec3_normalizeSoA(f32 *x, f32 *y, f32 *z, u32 count);
+void vec3_dotSoA(f32 *dest, const f32 *ax, const f32 *ay, const f32 *az, const f32 *bx, const f32 *by, const f32 *bz, u32 count);
+void vec3_projectSoA(f32 *dx, f32 *dy, f32 *dz, f32 *dw, const mat4 m, const f32 *x, const f32 *y, const f32 *z, u32 count);
+void vec4_mat4MulArr(vec4 *dest, const mat4 m, const vec4 *src, u32 count);
+void vec4_projectArr(vec4 *dest, const mat4 m, const vec4 *src, u32 count);
+
 /* Projections */
 void mat4_ortho(mat4 m, f32 left, f32 right, f32 bottom, f32 top, f32 near, f32 far);
 void mat4_perspective(mat4 m, f32 fovy, f32 aspect, f32 znear, f32 zfar);
@@ -0,0 +1,353 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * draw_list.c : Recorded mesh draws submitted in sorted order
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <SoftGfx/gfx.h>
+#include <SoftGfx/draw_list.h>
+
+
+#define DRAW_LIST_MIN_SIZE	64
+
+/*Pointer hash used to group draws with the same state*/
+#define PTR_HASH(p)			((u32) ((((u64) (uintptr_t) (p)) * 0x9E3779B97F4A7C15ull) >> 40))
+
+
+extern u32 _gfxSerial(void);
+extern void _gfxViewport(u32 rect[4]);
+extern void _gfxScissor(const u32 rect[4]);
+extern void _gfxClearRect(const u32 rect[4]);
+extern bint _gfxMeshRect(Mesh *msh, mat4 proj, mat4 view, mat4 model, u32 rect[4]);
+
+
+/*Sets up an empty list*/
+void
+gfxDrawListInit(DrawList *dl)
+{
+	memset(dl, 0, sizeof(*dl));
+}
+
+
+/*Frees the memory of the list*/
+void
+gfxDrawListFree(DrawList *dl)
+{
+	free(dl->item);
+	free(dl->key);
+	free(dl->order);
+	free(dl->stamp);
+	free(dl->prev);
+	free(dl->tile);
+	free(dl->rect);
+	memset(dl, 0, sizeof(*dl));
+}
+
+
+/*Removes all the draws, keeping the memory for the next frame*/
+void
+gfxDrawListClear(DrawList *dl)
+{
+	dl->count = 0;
+}
+
+
+/*Records a draw of the mesh with the given model matrix*/
+void
+gfxDrawListAdd(DrawList *dl, Mesh *msh, mat4 model, Tex *tex)
+{
+	if (dl->count == dl->size) {
+		dl->size = (dl->size ? dl->size << 1 : DRAW_LIST_MIN_SIZE);
+		dl->item = (DrawItem*) realloc(dl->item, dl->size * sizeof(DrawItem));
+		dl->key = (u64*) realloc(dl->key, 2 * dl->size * sizeof(u64));
+		dl->order = (u32*) realloc(dl->order, 2 * dl->size * sizeof(u32));
+		dl->stamp = (DrawStamp*) realloc(dl->stamp, dl->size * sizeof(DrawStamp));
+		dl->prev = (DrawStamp*) realloc(dl->prev, dl->size * sizeof(DrawStamp));
+	}
+	DrawItem *it = dl->item + dl->count++;
+	it->msh = msh;
+	it->tex = tex;
+	memcpy(it->model, model, sizeof(mat4));
+}
+
+
+/*
+ * LSD radix sort of the keys (and their order) 8 bits at a time, digits that
+ * are the same for every key are skipped. The result ends in key and order.
+ */
+static void
+_drawListSort(u64 *key, u32 *order, u64 *key_tmp, u32 *order_tmp, u32 n)
+{
+	u32 hist[8][256];
+	u64 *key_out = key;
+	u32 *order_out = order;
+
+	memset(hist, 0, sizeof(hist));
+	for (u32 i = 0; i < n; ++i) {
+		for (u32 d = 0; d < 8; ++d) {
+			hist[d][(key[i] >> (d * 8)) & 0xFF]++;
+		}
+	}
+	for (u32 d = 0; d < 8; ++d) {
+		u32 *h = hist[d];
+		u32 sum = 0;
+		if (h[(key[0] >> (d * 8)) & 0xFF] == n) {
+			continue;
+		}
+		for (u32 b = 0; b < 256; ++b) {
+			u32 c = h[b];
+			h[b] = sum;
+			sum += c;
+		}
+		for (u32 i = 0; i < n; ++i) {
+			u32 dst = h[(key[i] >> (d * 8)) & 0xFF]++;
+			key_tmp[dst] = key[i];
+			order_tmp[dst] = order[i];
+		}
+		u64 *ks = key; key = key_tmp; key_tmp = ks;
+		u32 *os = order; order = order_tmp; order_tmp = os;
+	}
+	/*An odd number of passes leaves the result in the temporary arrays*/
+	if (key != key_out) {
+		memcpy(key_out, key, n * sizeof(u64));
+		memcpy(order_out, order, n * sizeof(u32));
+	}
+}
+
+
+/*
+ * Sorts the recorded meshes front to back by their view depth, draws in the
+ * same depth slice (about 1% of the depth) are grouped by texture and mesh.
+ */
+static void
+_drawListOrder(DrawList *dl, mat4 view)
+{
+	u64 *key = dl->key, *key_tmp = dl->key + dl->size;
+	u32 *order = dl->order, *order_tmp = dl->order + dl->size;
+
+	for (u32 i = 0; i < dl->count; ++i) {
+		DrawItem *it = dl->item + i;
+		vec3 wc, vc;
+		union { f32 f; u32 u; } depth;
+		vec3_mat4Mul(wc, it->model, it->msh->bcenter);
+		vec3_mat4Mul(vc, view, wc);
+		/*Positive floats sort as integers, the top 16 bits give the depth slice*/
+		depth.f = -vc[2];
+		depth.u = (depth.f > 0.0f ? depth.u : 0);
+		key[i] = ((u64) (depth.u >> 16) << 48) |
+				 ((u64) (PTR_HASH(it->tex) & 0xFFFFFF) << 24) |
+				 (u64) (PTR_HASH(it->msh) & 0xFFFFFF);
+		order[i] = i;
+	}
+	_drawListSort(key, order, key_tmp, order_tmp, dl->count);
+}
+
+
+/*
+ * Draws the sorted meshes, consecutive draws of the same mesh and texture are
+ * drawn as instances. With a clip rect only the draws whose stamp touches it
+ * are drawn.
+ */
+static void
+_drawListDraw(DrawList *dl, mat4 proj, mat4 view, const u32 *clip)
+{
+	const u32 *order = dl->order;
+	mat4 *models = (mat4*) malloc(dl->count * sizeof(mat4));
+	u32 i = 0;
+	while (i < dl->count) {
+		DrawItem *first = dl->item + order[i];
+		u32 n = 0;
+		while (i < dl->count && dl->item[order[i]].msh == first->msh &&
+			   dl->item[order[i]].tex == first->tex) {
+			const u32 *r = dl->stamp[order[i]].rect;
+			if (clip == NULL || (r[0] < clip[2] && clip[0] < r[2] && r[1] < clip[3] && clip[1] < r[3])) {
+				memcpy(models[n++], dl->item[order[i]].model, sizeof(mat4));
+			}
+			++i;
+		}
+		if (n) {
+			gfxDrawMeshInstanced(first->msh, proj, view, first->tex, (const mat4*) models, n);
+		}
+	}
+	free(models);
+}
+
+
+/*FNV-1a hash of the mesh, its material, the texture and the model matrix of a draw*/
+static u64
+_drawListHash(const DrawItem *it)
+{
+	const u8 *p[4] = {(const u8*) &it->msh, (const u8*) &it->msh->mtrl, (const u8*) &it->tex, (const u8*) it->model};
+	const u32 len[4] = {sizeof(it->msh), sizeof(Material), sizeof(it->tex), sizeof(mat4)};
+	u64 h = 0xCBF29CE484222325ull;
+	for (u32 k = 0; k < 4; ++k) {
+		for (u32 i = 0; i < len[k]; ++i) {
+			h = (h ^ p[k][i]) * 0x100000001B3ull;
+		}
+	}
+	return h;
+}
+
+
+/*Marks the display tiles under the rect as dirty*/
+static void
+_drawListMark(DrawList *dl, const u32 vp[4], const u32 rect[4])
+{
+	if (rect[0] >= rect[2] || rect[1] >= rect[3]) {
+		return;
+	}
+	const u32 tiles_w = (vp[2] - vp[0] + GFX_DRAW_LIST_TILE - 1) / GFX_DRAW_LIST_TILE;
+	for (u32 ty = (rect[1] - vp[1]) / GFX_DRAW_LIST_TILE; ty <= (rect[3] - 1 - vp[1]) / GFX_DRAW_LIST_TILE; ++ty) {
+		u8 *row = dl->tile + (ty * tiles_w);
+		for (u32 tx = (rect[0] - vp[0]) / GFX_DRAW_LIST_TILE; tx <= (rect[2] - 1 - vp[0]) / GFX_DRAW_LIST_TILE; ++tx) {
+			row[tx] = 1;
+		}
+	}
+}
+
+
+/*
+ * Joins the dirty tiles in rects: runs of tiles in a row, merged with the run
+ * of the same columns in the row above. Returns the number of rects.
+ */
+static u32
+_drawListRects(DrawList *dl, const u32 vp[4], u32 tiles_w, u32 tiles_h)
+{
+	u32 count = 0;
+	for (u32 ty = 0; ty < tiles_h; ++ty) {
+		const u8 *row = dl->tile + (ty * tiles_w);
+		const u32 y0 = vp[1] + (ty * GFX_DRAW_LIST_TILE);
+		const u32 y1 = (y0 + GFX_DRAW_LIST_TILE < vp[3] ? y0 + GFX_DRAW_LIST_TILE : vp[3]);
+		u32 tx = 0;
+		while (tx < tiles_w) {
+			if (!row[tx]) {
+				++tx;
+				continue;
+			}
+			u32 begin = tx;
+			while (tx < tiles_w && row[tx]) {
+				++tx;
+			}
+			const u32 x0 = vp[0] + (begin * GFX_DRAW_LIST_TILE);
+			const u32 x1 = (vp[0] + (tx * GFX_DRAW_LIST_TILE) < vp[2] ? vp[0] + (tx * GFX_DRAW_LIST_TILE) : vp[2]);
+			u32 *r = dl->rect;
+			u32 k = 0;
+			while (k < count && !(r[4 * k] == x0 && r[(4 * k) + 2] == x1 && r[(4 * k) + 3] == y0)) {
+				++k;
+			}
+			if (k == count) {
+				r[4 * k] = x0, r[(4 * k) + 1] = y0, r[(4 * k) + 2] = x1;
+				++count;
+			}
+			r[(4 * k) + 3] = y1;
+		}
+	}
+	return count;
+}
+
+
+/*
+ * Incremental submit: the draws are matched by their position in the list
+ * with the ones of the last submit, and the tiles under the old and the new
+ * rects of the draws that changed are cleared and redrawn, with every draw
+ * touching them. Everything is redrawn when the camera, the display or the
+ * render state changed, or after anything else was drawn.
+ */
+static void
+_drawListSubmitIncremental(DrawList *dl, mat4 proj, mat4 view)
+{
+	u32 vp[4];
+	_gfxViewport(vp);
+	const u32 tiles_w = (vp[2] - vp[0] + GFX_DRAW_LIST_TILE - 1) / GFX_DRAW_LIST_TILE;
+	const u32 tiles_h = (vp[3] - vp[1] + GFX_DRAW_LIST_TILE - 1) / GFX_DRAW_LIST_TILE;
+	if (tiles_w * tiles_h > dl->tile_size) {
+		dl->tile_size = tiles_w * tiles_h;
+		dl->tile = (u8*) realloc(dl->tile, dl->tile_size);
+		dl->rect = (u32*) realloc(dl->rect, 4 * dl->tile_size * sizeof(u32));
+	}
+
+	for (u32 i = 0; i < dl->count; ++i) {
+		DrawItem *it = dl->item + i;
+		DrawStamp *st = dl->stamp + i;
+		st->hash = _drawListHash(it);
+		if (!_gfxMeshRect(it->msh, proj, view, it->model, st->rect)) {
+			st->rect[2] = st->rect[0];
+		}
+	}
+	bint full = (!dl->drawn || dl->serial != _gfxSerial() ||
+				 memcmp(dl->proj, proj, sizeof(mat4)) != 0 ||
+				 memcmp(dl->view, view, sizeof(mat4)) != 0);
+	u32 rects = 0;
+	if (!full) {
+		memset(dl->tile, 0, tiles_w * tiles_h);
+		u32 n = (dl->count > dl->prev_count ? dl->count : dl->prev_count);
+		for (u32 i = 0; i < n; ++i) {
+			const DrawStamp *a = (i < dl->count ? dl->stamp + i : NULL);
+			const DrawStamp *b = (i < dl->prev_count ? dl->prev + i : NULL);
+			if (a && b && a->hash == b->hash && memcmp(a->rect, b->rect, sizeof(a->rect)) == 0) {
+				continue;
+			}
+			if (a) {
+				_drawListMark(dl, vp, a->rect);
+			}
+			if (b) {
+				_drawListMark(dl, vp, b->rect);
+			}
+		}
+		rects = _drawListRects(dl, vp, tiles_w, tiles_h);
+	}
+
+	if (full || rects) {
+		_drawListOrder(dl, view);
+	}
+	if (full) {
+		gfxClear();
+		_drawListDraw(dl, proj, view, NULL);
+	}
+	for (u32 k = 0; k < rects; ++k) {
+		const u32 *r = dl->rect + (4 * k);
+		_gfxClearRect(r);
+		_gfxScissor(r);
+		_drawListDraw(dl, proj, view, r);
+	}
+	_gfxScissor(NULL);
+
+	DrawStamp *tmp = dl->prev;
+	dl->prev = dl->stamp;
+	dl->stamp = tmp;
+	dl->prev_count = dl->count;
+	dl->serial = _gfxSerial();
+	dl->drawn = TRUE;
+	memcpy(dl->proj, proj, sizeof(mat4));
+	memcpy(dl->view, view, sizeof(mat4));
+}
+
+
+/*
+ * Draws the recorded meshes front to back by their view depth, draws in the
+ * same depth slice (about 1% of the depth) are grouped by texture and mesh.
+ * Consecutive draws of the same mesh and texture are drawn as instances.
+ * Incremental lists also clear the display, only where the draws changed.
+ */
+void
+gfxDrawListSubmit(DrawList *dl, mat4 proj, mat4 view)
+{
+	if (dl->incremental) {
+		_drawListSubmitIncremental(dl, proj, view);
+		return;
+	}
+	if (dl->count == 0) {
+		return;
+	}
+	_drawListOrder(dl, view);
+	_drawListDraw(dl, proj, view, NULL);
+}
+
+
+/*Makes the next submit of an incremental list redraw everything (after editing its meshes or textures)*/
+void
+gfxDrawListInvalidate(DrawList *dl)
+{
+	dl->drawn = FALSE;
+}
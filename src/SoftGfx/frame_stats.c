@@ -0,0 +1,224 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * frame_stats.c : Frame time percentiles, histogram and overlay
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SoftGfx/frame_stats.h>
+
+
+/*Frames between percentile updates*/
+#define STATS_REFRESH		32
+
+/*Overlay graph: frames shown, pixels per frame and height for 1000 / 30 ms*/
+#define GRAPH_FRAMES		128
+#define GRAPH_BAR_W			2
+#define GRAPH_H				64
+
+/*Pixel color as the display stores it*/
+#define PIX_RGB(r, g, b)	((u32) (r) | ((u32) (g) << 8) | ((u32) (b) << 16))
+
+static const char *phase_name[GFX_STAT_COUNT] = {"update", "draw", "copy", "present", "total"};
+
+static const u32 phase_color[GFX_STAT_TOTAL] = {
+	PIX_RGB(80, 140, 255),		//update
+	PIX_RGB(80, 220, 80),		//draw
+	PIX_RGB(240, 200, 60),		//copy
+	PIX_RGB(230, 70, 70),		//present
+};
+
+/*3x5 glyphs of "0123456789.p", rows from the top in the high bits*/
+static const u16 font_glyph[12] = {
+	0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF,
+	0x79EF, 0x7249, 0x7BEF, 0x7BCF, 0x0002, 0x6BA4,
+};
+
+
+/*Sets up the stats, with a CSV dump of every frame if the path is not NULL*/
+void
+gfxFrameStatsInit(FrameStats *fs, const char *csv_path)
+{
+	memset(fs, 0, sizeof(*fs));
+	if (csv_path != NULL) {
+		fs->csv = fopen(csv_path, "w");
+		if (fs->csv == NULL) {
+			printf("ERROR: Could not open the frame times file %s\n", csv_path);
+		} else {
+			fprintf(fs->csv, "frame,update_ms,draw_ms,copy_ms,present_ms,total_ms\n");
+		}
+	}
+}
+
+
+void
+gfxFrameStatsFree(FrameStats *fs)
+{
+	if (fs->csv != NULL) {
+		fclose(fs->csv);
+		fs->csv = NULL;
+	}
+}
+
+
+/*Adds the times of a frame (the total is their sum)*/
+void
+gfxFrameStatsAdd(FrameStats *fs, const f32 ms[GFX_STAT_COUNT])
+{
+	const u32 slot = fs->frame % GFX_STATS_FRAMES;
+	f32 total = 0.0f;
+	for (u32 p = 0; p < GFX_STAT_TOTAL; ++p) {
+		fs->ms[p][slot] = ms[p];
+		total += ms[p];
+	}
+	fs->ms[GFX_STAT_TOTAL][slot] = total;
+	fs->worst = (total > fs->worst ? total : fs->worst);
+
+	s32 b = (total < 0.5f ? 0 : (s32) (4.0f * log2f(total * 2.0f)) + 1);
+	fs->hist[(b < GFX_STATS_BUCKETS ? b : GFX_STATS_BUCKETS - 1)]++;
+
+	if (fs->csv != NULL) {
+		fprintf(fs->csv, "%u,%.4f,%.4f,%.4f,%.4f,%.4f\n", fs->frame,
+				ms[GFX_STAT_UPDATE], ms[GFX_STAT_DRAW], ms[GFX_STAT_COPY], ms[GFX_STAT_PRESENT], total);
+	}
+	fs->frame++;
+	if (fs->frame % STATS_REFRESH == 0) {
+		gfxFrameStatsUpdate(fs);
+	}
+}
+
+
+static int
+_statsCompare(const void *a, const void *b)
+{
+	f32 fa = *(const f32*) a, fb = *(const f32*) b;
+	return (fa > fb) - (fa < fb);
+}
+
+
+/*Recomputes the percentiles of the frames in the window (done every few frames by gfxFrameStatsAdd)*/
+void
+gfxFrameStatsUpdate(FrameStats *fs)
+{
+	static const f32 rank[3] = {0.50f, 0.95f, 0.99f};
+	f32 sorted[GFX_STATS_FRAMES];
+	const u32 n = (fs->frame < GFX_STATS_FRAMES ? fs->frame : GFX_STATS_FRAMES);
+	if (n == 0) {
+		return;
+	}
+	for (u32 p = 0; p < GFX_STAT_COUNT; ++p) {
+		memcpy(sorted, fs->ms[p], n * sizeof(f32));
+		qsort(sorted, n, sizeof(f32), _statsCompare);
+		for (u32 k = 0; k < 3; ++k) {
+			/*Nearest rank*/
+			u32 i = (u32) ceilf(rank[k] * (f32) n);
+			fs->pct[p][k] = sorted[(i > 0 ? i - 1 : 0)];
+		}
+	}
+}
+
+
+/*Prints the percentiles of each phase and the histogram of the frame times*/
+void
+gfxFrameStatsPrint(FrameStats *fs, FILE *out)
+{
+	u32 peak = 1;
+	gfxFrameStatsUpdate(fs);
+	fprintf(out, "FRAMES: %u, worst %.2f ms, last %u frames (ms):\n", fs->frame, fs->worst,
+			(fs->frame < GFX_STATS_FRAMES ? fs->frame : GFX_STATS_FRAMES));
+	fprintf(out, "%10s %8s %8s %8s\n", "", "p50", "p95", "p99");
+	for (u32 p = 0; p < GFX_STAT_COUNT; ++p) {
+		fprintf(out, "%10s %8.2f %8.2f %8.2f\n", phase_name[p], fs->pct[p][0], fs->pct[p][1], fs->pct[p][2]);
+	}
+	for (u32 b = 0; b < GFX_STATS_BUCKETS; ++b) {
+		peak = (fs->hist[b] > peak ? fs->hist[b] : peak);
+	}
+	fprintf(out, "Frame time histogram:\n");
+	for (u32 b = 0; b < GFX_STATS_BUCKETS; ++b) {
+		if (fs->hist[b] == 0) {
+			continue;
+		}
+		f32 lo = (b == 0 ? 0.0f : 0.5f * exp2f((f32) (b - 1) * 0.25f));
+		u32 bar = (u32) ((40ull * fs->hist[b] + peak - 1) / peak);
+		fprintf(out, "%8.2f ms %8u ", lo, fs->hist[b]);
+		for (u32 i = 0; i < bar; ++i) {
+			fputc('#', out);
+		}
+		fputc('\n', out);
+	}
+}
+
+
+/*Draws a string of the glyph font scaled by 2, clipped to the buffer*/
+static void
+_statsText(u32 *pix, u32 pitch, u32 width, u32 height, u32 x, u32 y, const char *str, u32 color)
+{
+	for (; *str; ++str, x += 8) {
+		const char c = *str;
+		s32 g = (c >= '0' && c <= '9' ? c - '0' : (c == '.' ? 10 : (c == 'p' ? 11 : -1)));
+		if (g < 0) {
+			continue;
+		}
+		for (u32 gy = 0; gy < 10; ++gy) {
+			for (u32 gx = 0; gx < 6; ++gx) {
+				u32 bit = 14 - (((gy >> 1) * 3) + (gx >> 1));
+				if (((font_glyph[g] >> bit) & 1) && x + gx < width && y + gy < height) {
+					pix[((y + gy) * pitch) + x + gx] = color;
+				}
+			}
+		}
+	}
+}
+
+
+/*
+ * Draws the last frame times as stacked bars of their phases, with lines at
+ * 60 and 30 Hz, and the percentiles of the total time over them. Pitch is in
+ * pixels.
+ */
+void
+gfxFrameStatsOverlay(const FrameStats *fs, u32 *pix, u32 pitch, u32 width, u32 height)
+{
+	const u32 graph_w = GRAPH_FRAMES * GRAPH_BAR_W;
+	const f32 px_ms = (f32) GRAPH_H * 0.03f;
+	if (width < graph_w || height < GRAPH_H + 40) {
+		return;
+	}
+	const u32 y_base = height - 1;
+	/*Darken the graph background*/
+	for (u32 y = height - GRAPH_H; y < height; ++y) {
+		u32 *ln = pix + (y * pitch);
+		for (u32 x = 0; x < graph_w; ++x) {
+			ln[x] = (ln[x] >> 2) & 0x3F3F3F3Fu;
+		}
+	}
+	const u32 shown = (fs->frame < GRAPH_FRAMES ? fs->frame : GRAPH_FRAMES);
+	for (u32 i = 0; i < shown; ++i) {
+		u32 slot = (fs->frame - shown + i) % GFX_STATS_FRAMES;
+		u32 x0 = (GRAPH_FRAMES - shown + i) * GRAPH_BAR_W, h = 0;
+		for (u32 p = 0; p < GFX_STAT_TOTAL && h < GRAPH_H; ++p) {
+			u32 ph = (u32) (fs->ms[p][slot] * px_ms + 0.5f);
+			ph = (h + ph > GRAPH_H ? GRAPH_H - h : ph);
+			for (u32 y = h; y < h + ph; ++y) {
+				for (u32 x = x0; x < x0 + GRAPH_BAR_W; ++x) {
+					pix[((y_base - y) * pitch) + x] = phase_color[p];
+				}
+			}
+			h += ph;
+		}
+	}
+	/*Frame time of 60 Hz and 30 Hz*/
+	const u32 y60 = y_base - (u32) (px_ms * (1000.0f / 60.0f));
+	for (u32 x = 0; x < graph_w; x += 2) {
+		pix[(y60 * pitch) + x] = PIX_RGB(255, 255, 255);
+		pix[((height - GRAPH_H) * pitch) + x] = PIX_RGB(160, 160, 160);
+	}
+	/*p50, p95 and p99 of the total*/
+	static const char *label[3] = {"p50", "p95", "p99"};
+	for (u32 k = 0; k < 3; ++k) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%s %.1f", label[k], fs->pct[GFX_STAT_TOTAL][k]);
+		_statsText(pix, pitch, width, height, 4 + (k * 84), height - GRAPH_H - 14, buf, PIX_RGB(255, 255, 255));
+	}
+}
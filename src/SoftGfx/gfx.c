@@ -6,7 +6,11 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SoftGfx/gfx.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 
 /* Triangle spans for triangle drawing */
@@ -17,6 +21,20 @@ typedef struct span_t {
 	s32 x[2];
 } span;
 
+/*Projected point of a batch, x and y packed in 16 bits each (see POINT_XY)*/
+typedef struct PointRec_t {
+	u32 xy;
+	f32 z;
+	u32 color;
+} PointRec;
+
+/*Mesh vertex projected for the wireframe, with the outcode of the scissor tests*/
+typedef struct WireVert_t {
+	vec4 clip;				// clip space position
+	f32 s[3];				// x and y in pixels and depth, if not behind the near plane
+	u32 code;				// WIRE_* bits of the failed tests
+} WireVert;
+
 /* Struct for storing renderer information */
 static struct gfx_renderer_t {
 	u32 *pix;				// CPU Screen pixels
@@ -25,22 +43,146 @@ static struct gfx_renderer_t {
 	u32 max_w;				// screen width
 	u32 max_h;				// screen height
 
+	/*Framebuffer layout, rows or tiles holding their color and then their depth*/
+	u32 tile_shift;			// log2 of the tile size, 0 for rows
+	u32 tile_mask;
+	u32 tile_stride;		// log2 of the values per tile (color and depth)
+	u32 row_stride;			// values per row of pixels or tiles
+	u32 pix_size;			// values addressed by the pixel offsets
+	void *fb_mem;			// allocation of the tiles, NULL for rows
+	u32 *linear;			// tiles resolved to rows
+	u32 linear_serial;		// display key of the last resolve
+
+	/*4x MSAA, pixels fully covered by a triangle keep their color in ren.pix*/
+	bint msaa;
+	f32 *msaa_z;			// depth of the 4 samples of each pixel offset
+	u32 *msaa_col;			// color of the 4 samples of each listed pixel, in list order
+	u32 *msaa_state;		// MSAA_* bits of each pixel and its place in the list
+	u32 *msaa_list;			// offsets of the pixels that were expanded
+	u32 msaa_count;
+	u32 msaa_size;			// listed pixels that fit in msaa_list and msaa_col
+	u32 msaa_serial;		// serial of the last resolve
+
 	/*DisplayRect dimensions*/
 	u32 vp_x;
 	u32 vp_y;
 	u32 vp_w;
 	u32 vp_h;
 
+	/*Dynamic resolution, the DisplayRect is the user one scaled down*/
+	u32 base_x;
+	u32 base_y;
+	u32 base_w;
+	u32 base_h;
+	u32 frame_budget;		// target frame time in microseconds, 0 = off
+	f32 res_scale;			// current scale of the DisplayRect
+	f32 res_min;			// lowest scale
+	f32 frame_avg;			// smoothed frame time in ms
+	u32 *present;			// display upscaled to the user rect
+	u32 *present_x;			// source column and weight of each upscaled column
+	u32 *present_row;		// vertical pass scratch row of each band of the upscale
+
+	/*Scissor inside the DisplayRect, [x0, x1) x [y0, y1)*/
+	u32 sc_x0;
+	u32 sc_y0;
+	u32 sc_x1;
+	u32 sc_y1;
+	u32 serial;				// changes with every draw or state change
+
 	span *spans;			// Triangle spans
 	u32 lighting_mode;
 	bint depth_test;
+	u32 lod_error;			// max LOD error in pixels
+	bint culling;			// mesh and cluster culling
+	u32 shading_rate;		// max Phong block size (1, 2 or 4)
+	u32 shading_quality;	// [0, 100], higher shades more triangles per pixel
+	vec3 *lattice;			// coarse shading lighting, 3 lines of max_w + 2
+
+	/*G-buffer of the deferred lighting mode*/
+	u32 *gnorm;				// octahedral view space normal (2 x snorm16)
+	u32 *galbedo;			// RGB and the material id in the top byte (0 = empty)
+	f32 *gdepth;			// screen depth
+	mat4 gproj;				// projection of the deferred draws, set by the first one after a clear
+	bint gproj_set;
+	u32 gmtrl;				// material id of the current draw
+	bint gforward;			// the current deferred draw is lit forward, see _gfxLightingBegin
+
+	/*Lines and wireframe*/
+	bint line_smooth;		// Wu anti-aliased lines
+	u32 wireframe;			// GFX_WIRE_* mode of the mesh draws
+	u32 wire_color;
+	WireVert *wire_vert;	// projected vertices of the mesh drawn as edges
+	u32 wire_size;
+
+	/*Point clouds*/
+	u32 point_size;			// splat size in pixels
+	PointRec *point_rec;	// projected points of a batch
+	u32 point_rec_size;
+	PointRec *point_bin;	// points of the batch by screen tile
+	u32 point_bin_size;
+	u32 *point_hist;		// points per chunk and tile, then their bin offsets
+	u32 point_hist_size;
+	u32 *point_ofs;			// first point of each tile in point_bin
+
+	/*Weighted blended transparency, composited by gfxTransparentResolve*/
+	bint transparency;		// triangles are accumulated instead of drawn
+	f32 *oit_accum;			// RGB and alpha weighted by alpha and depth, 4 per pixel offset
+	f32 *oit_reveal;		// product of 1 - alpha of the fragments of each pixel
+	u32 oit_rect[4];		// bounds of the accumulated pixels, [x0, x1) x [y0, y1)
 } ren = {0x0};
 
 //=============================================================================
 
 /*Defines for converting from screen space to display space*/
-#define PIXW(x)		((u32) (((x + 1.0f) * 0.5f * (ren.vp_w - 1)) + ren.vp_x))
-#define PIXH(y)		((u32) (((1.0f - y) * 0.5f * (ren.vp_h - 1)) + ren.vp_y))
+/*Off screen positions keep their sign and are limited so they fit in an s32*/
+#define PIX_LIMIT	16777216.0f
+
+/*MSAA pixel state, edge pixels are expanded to one color per sample*/
+#define MSAA_EXPANDED	0x01
+#define MSAA_LISTED		0x02
+#define MSAA_SLOT_SHIFT	2		//the state bits above are the place of a listed pixel in the list
+
+/*Sample colors of a listed pixel from its state*/
+#define MSAA_COL(state)	(ren.msaa_col + (((state) >> MSAA_SLOT_SHIFT) << 2))
+
+/*Outcode of a wireframe vertex*/
+#define WIRE_NEAR		0x01
+#define WIRE_LEFT		0x02
+#define WIRE_RIGHT		0x04
+#define WIRE_TOP		0x08
+#define WIRE_BOTTOM		0x10
+
+/*Pixel of a line that was not clipped to the scissor*/
+#define LINE_IN_SCISSOR(x, y)	((u32) (x) >= ren.sc_x0 && (u32) (x) < ren.sc_x1 && (u32) (y) >= ren.sc_y0 && (u32) (y) < ren.sc_y1)
+
+/*Point splats are binned in screen tiles, a batch is projected and binned by chunks*/
+#define POINT_TILE_SHIFT	6
+#define POINT_TILE		(1u << POINT_TILE_SHIFT)
+#define POINT_BATCH		(1u << 20)
+#define POINT_CHUNK		(1u << 16)
+#define POINT_BLOCK		256
+#define POINT_CULLED	0xFFFFFFFFu
+
+/*Splat centers are packed shifted by the largest radius, as a splat is kept while it overlaps the viewport*/
+#define POINT_PAD		(POINT_TILE / 4)
+#define POINT_XY(x, y)	((u32) ((x) + (s32) POINT_PAD) | ((u32) ((y) + (s32) POINT_PAD) << 16))
+#define POINT_X(xy)		((s32) ((xy) & 0xFFFF) - (s32) POINT_PAD)
+#define POINT_Y(xy)		((s32) ((xy) >> 16) - (s32) POINT_PAD)
+
+/*Rows of the transparency composite done by each job*/
+#define OIT_ROWS		16
+
+/*Rows of the upscale done by each job*/
+#define UPSCALE_ROWS	16
+
+/*Depth bias of the wireframe overlay, so the edges pass over their own triangles*/
+#define WIRE_BIAS		2e-4f
+
+/*Offset of a pixel in ren.pix and ren.zbuff, from its row and column parts*/
+#define PIX_ROW(y)	((((y) >> ren.tile_shift) * ren.row_stride) + (((y) & ren.tile_mask) << ren.tile_shift))
+#define PIX_COL(x)	((((x) >> ren.tile_shift) << ren.tile_stride) + ((x) & ren.tile_mask))
+#define PIXW(x)		((f32) (s32) clamp(((x + 1.0f) * 0.5f * (ren.vp_w - 1)) + ren.vp_x, -PIX_LIMIT, PIX_LIMIT))
+#define PIXH(y)		((f32) (s32) clamp(((1.0f - y) * 0.5f * (ren.vp_h - 1)) + ren.vp_y, -PIX_LIMIT, PIX_LIMIT))
 
 #define COORDX(fx)	(((f32) (2.0f * (fx - ren.vp_x)) / (ren.vp_w - 1)) - 1.0f)
 #define COORDY(fy)	(-(((f32) (2.0f * (fy - ren.vp_y)) / (ren.vp_h - 1)) - 1.0f))
@@ -99,26 +241,385 @@ vec2_lerpAttr(vec2 out, f32 w0, const vec2 v0,
 }
 
 
-extern void _gfxComputeLighting(vec3 out, vec3 pos, vec3 norm);
-void _gfxSampleTex(vec3 sample, Tex *tex, vec2 uv);
+extern void _gfxComputeLighting(vec3 out, vec3 pos, vec3 norm, u32 tile);
+extern void _gfxComputeLightingN(f32 *out_r, f32 *out_g, f32 *out_b,
+								 const f32 *px, const f32 *py, const f32 *pz,
+								 const f32 *nx, const f32 *ny, const f32 *nz, u32 count, u32 tile);
+extern void _gfxLightTilesUpdate(mat4 proj, u32 vp_x, u32 vp_y, u32 vp_w, u32 vp_h);
+extern u32 _gfxLightTile(s32 x, s32 y);
+extern u32 _gfxLightSerial(void);
+extern u32 _gfxPostSerial(void);
+extern void _gfxPostRun(u32 *dst, u32 width, u32 height, const u32 vp[4]);
+extern u32 _gfxDeferredMaterial(void);
+extern void _gfxDeferredReset(void);
+extern void _gfxDeferredLightingN(u32 mtrl, f32 *out_r, f32 *out_g, f32 *out_b,
+								  const f32 *px, const f32 *py, const f32 *pz,
+								  const f32 *nx, const f32 *ny, const f32 *nz, u32 count, u32 tile);
+void _gfxSampleTex(vec4 sample, Tex *tex, vec2 uv);
+
+
+/*Fragments waiting for Phong lighting, shaded together*/
+#define PHONG_BATCH		8
+
+typedef struct PhongBatch_t {
+	u32		count;
+	u32		tile;				//light tile of all the fragments
+	u32		mtrl;				//G-buffer material (0 for the current material)
+	bint	blend;				//transparent fragments, accumulated
+	u32		off[PHONG_BATCH];	//pixel offset
+	u8		mask[PHONG_BATCH];	//MSAA samples to write
+	f32		z[PHONG_BATCH];		//depth, or view w of the transparent fragments
+	f32		alpha[PHONG_BATCH];
+	f32		col[3][PHONG_BATCH];
+	f32		pos[3][PHONG_BATCH];
+	f32		norm[3][PHONG_BATCH];
+} PhongBatch;
+
+
+/*
+ * Writes a color to the MSAA samples in the mask, the sample depths are
+ * written by the coverage test. Full masks keep the pixel in ren.pix, other
+ * masks expand it to a color per sample and list it for the resolve. Only
+ * listed pixels have sample colors, stored in list order.
+ */
+static inline void
+_gfxMsaaWrite(u32 off, u32 mask, u32 color)
+{
+	u32 *state = ren.msaa_state + off;
+	if (mask == 0xF) {
+		ren.pix[off] = color;
+		*state &= ~(u32) MSAA_EXPANDED;
+		return;
+	}
+	if (!(*state & MSAA_EXPANDED)) {
+		if (!(*state & MSAA_LISTED)) {
+			if (ren.msaa_count == ren.msaa_size) {
+				ren.msaa_size = (ren.msaa_size ? ren.msaa_size << 1 : 1024);
+				ren.msaa_list = (u32*) realloc(ren.msaa_list, ren.msaa_size * sizeof(u32));
+				ren.msaa_col = (u32*) realloc(ren.msaa_col, 4 * ren.msaa_size * sizeof(u32));
+			}
+			*state = (ren.msaa_count << MSAA_SLOT_SHIFT) | MSAA_LISTED;
+			ren.msaa_list[ren.msaa_count++] = off;
+		}
+		u32 *sc = MSAA_COL(*state);
+		sc[0] = sc[1] = sc[2] = sc[3] = ren.pix[off];
+		*state |= MSAA_EXPANDED;
+	}
+	u32 *sc = MSAA_COL(*state);
+	for (u32 k = 0; k < 4; ++k) {
+		if ((mask >> k) & 1) {
+			sc[k] = color;
+		}
+	}
+}
+
+
+/*
+ * Adds a transparent fragment to its pixel: the sums of its color and alpha
+ * weighted by alpha and by the view depth, so near fragments dominate, and
+ * the product of 1 - alpha. Neither depends on the order of the fragments.
+ */
+static inline void
+_gfxOitAdd(u32 off, const vec3 col, f32 alpha, f32 depth)
+{
+	const f32 a = depth * 0.2f, b = depth * (1.0f / 200.0f);
+	const f32 b3 = b * b * b;
+	const f32 aw = alpha * clamp(10.0f / (1e-5f + (a * a) + (b3 * b3)), 1e-2f, 3e3f);
+	f32 *acc = ren.oit_accum + (off << 2);
+	acc[0] += col[0] * aw;
+	acc[1] += col[1] * aw;
+	acc[2] += col[2] * aw;
+	acc[3] += aw;
+	ren.oit_reveal[off] *= 1.0f - alpha;
+}
+
+
+/*Lights the batched fragments and writes them*/
+static void
+_gfxPhongFlush(PhongBatch *b)
+{
+	f32 light[3][PHONG_BATCH];
+	if (b->mtrl) {
+		_gfxDeferredLightingN(b->mtrl, light[0], light[1], light[2],
+							  b->pos[0], b->pos[1], b->pos[2],
+							  b->norm[0], b->norm[1], b->norm[2], b->count, b->tile);
+	} else {
+		_gfxComputeLightingN(light[0], light[1], light[2],
+							 b->pos[0], b->pos[1], b->pos[2],
+							 b->norm[0], b->norm[1], b->norm[2], b->count, b->tile);
+	}
+	for (u32 i = 0; i < b->count; ++i) {
+		vec3 col = {b->col[0][i] * light[0][i], b->col[1][i] * light[1][i], b->col[2][i] * light[2][i]};
+		vec3_clamp(col, 0.0f, 1.0f);
+		if (b->blend) {
+			_gfxOitAdd(b->off[i], col, b->alpha[i], b->z[i]);
+			continue;
+		}
+		if (b->mask[i]) {
+			_gfxMsaaWrite(b->off[i], b->mask[i], vec3_toRGB(col));
+			continue;
+		}
+		if (ren.depth_test && !b->mtrl) {
+			ren.zbuff[b->off[i]] = b->z[i];
+		}
+		ren.pix[b->off[i]] = vec3_toRGB(col);
+		/*Left as drawn by the deferred resolve*/
+		if (ren.gforward && !b->mtrl) {
+			ren.galbedo[b->off[i]] = 0;
+		}
+	}
+	b->count = 0;
+}
+
+
+/*
+ * Lighting setup of a draw: bins the point lights in tiles when the
+ * projection, viewport or lights changed and, for deferred lighting,
+ * allocates the G-buffer and registers the current material. A deferred
+ * draw is lit forward with Phong when the material table is full or its
+ * projection is not the one of the G-buffer, which is resolved with one.
+ */
+static void
+_gfxLightingBegin(mat4 proj)
+{
+	ren.gforward = 0;
+	if (!ren.lighting_mode) {
+		return;
+	}
+	_gfxLightTilesUpdate(proj, ren.vp_x, ren.vp_y, ren.vp_w, ren.vp_h);
+	if (ren.lighting_mode == GFX_LIGHT_DEFERRED) {
+		if (ren.galbedo == NULL) {
+			/*Indexed with the pixel offsets, tiled layouts leave the depth part unused*/
+			ren.gnorm = (u32*) calloc(ren.pix_size, sizeof(*ren.gnorm));
+			ren.galbedo = (u32*) calloc(ren.pix_size, sizeof(*ren.galbedo));
+			ren.gdepth = (f32*) calloc(ren.pix_size, sizeof(*ren.gdepth));
+		}
+		if (ren.gproj_set && memcmp(ren.gproj, proj, sizeof(mat4))) {
+			ren.gforward = 1;
+			return;
+		}
+		ren.gmtrl = _gfxDeferredMaterial();
+		ren.gforward = (ren.gmtrl == 0);
+		if (!ren.gforward) {
+			memcpy(ren.gproj, proj, sizeof(mat4));
+			ren.gproj_set = 1;
+		}
+	}
+}
+
+
+/*Lighting mode of the current draw, Phong for the deferred ones lit forward*/
+static inline u32
+_gfxDrawLighting(void)
+{
+	return (ren.gforward ? GFX_LIGHT_PHONG : ren.lighting_mode);
+}
+
+
+/*Packs a normal in octahedral encoding, 16 bits per component*/
+static inline u32
+_gfxOctPack(const vec3 n)
+{
+	f32 l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	if (l1 == 0.0f) {
+		return 0;
+	}
+	f32 x = n[0] / l1, y = n[1] / l1;
+	if (n[2] < 0.0f) {
+		f32 ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return ((u32) (u16) (s16) lrintf(x * 32767.0f)) | ((u32) (u16) (s16) lrintf(y * 32767.0f) << 16);
+}
+
+/*Unpacks an octahedral normal (not normalized)*/
+static inline void
+_gfxOctUnpack(vec3 n, u32 p)
+{
+	f32 x = (s16) (p & 0xFFFF) * (1.0f / 32767.0f);
+	f32 y = (s16) (p >> 16) * (1.0f / 32767.0f);
+	f32 z = 1.0f - fabsf(x) - fabsf(y);
+	if (z < 0.0f) {
+		f32 ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	n[0] = x, n[1] = y, n[2] = z;
+}
+
+
+/*Stores an unlit fragment in the G-buffer*/
+static inline void
+_gfxGBufferWrite(u32 offset, f32 z, vec3 col, const vec3 norm)
+{
+	vec3_clamp(col, 0.0f, 1.0f);
+	if (ren.depth_test) {
+		ren.zbuff[offset] = z;
+	}
+	ren.gdepth[offset] = z;
+	ren.gnorm[offset] = _gfxOctPack(norm);
+	ren.galbedo[offset] = vec3_toRGB(col) | (ren.gmtrl << 24);
+}
 
 //=============================================================================
 
 
+/*Changes when the drawing or the post-process chain changed*/
+static inline u32
+_gfxDisplayKey(void)
+{
+	return ren.serial + _gfxPostSerial();
+}
+
+
+/*Frees the MSAA samples*/
+static void
+_gfxMsaaFree(void)
+{
+	free(ren.msaa_z);
+	free(ren.msaa_col);
+	free(ren.msaa_state);
+	free(ren.msaa_list);
+	ren.msaa_z = NULL;
+	ren.msaa_col = ren.msaa_list = NULL;
+	ren.msaa_state = NULL;
+	ren.msaa_count = ren.msaa_size = 0;
+}
+
+
+/*
+ * Allocates 4 depths and a state per pixel offset, the depths cleared to the
+ * far plane and all the pixels fully covered by their ren.pix color. The
+ * sample colors grow with the list of expanded pixels. The depths stay dense:
+ * fully covered pixels of sloped triangles have 4 different sample depths.
+ */
+static void
+_gfxMsaaAlloc(void)
+{
+	_gfxMsaaFree();
+	ren.msaa_z = (f32*) malloc(4 * ren.pix_size * sizeof(*ren.msaa_z));
+	ren.msaa_state = (u32*) calloc(ren.pix_size, sizeof(*ren.msaa_state));
+	for (u32 i = 0; i < 4 * ren.pix_size; ++i) {
+		ren.msaa_z[i] = 1.0f;
+	}
+}
+
+
+/*Frees the transparency buffers*/
+static void
+_gfxOitFree(void)
+{
+	free(ren.oit_accum);
+	free(ren.oit_reveal);
+	ren.oit_accum = ren.oit_reveal = NULL;
+}
+
+
+/*Allocates the transparency sums cleared to nothing accumulated, indexed with the pixel offsets*/
+static void
+_gfxOitAlloc(void)
+{
+	_gfxOitFree();
+	ren.oit_accum = (f32*) calloc(4 * ren.pix_size, sizeof(*ren.oit_accum));
+	ren.oit_reveal = (f32*) malloc(ren.pix_size * sizeof(*ren.oit_reveal));
+	for (u32 i = 0; i < ren.pix_size; ++i) {
+		ren.oit_reveal[i] = 1.0f;
+	}
+	ren.oit_rect[0] = ren.oit_rect[1] = 0xFFFFFFFFu;
+	ren.oit_rect[2] = ren.oit_rect[3] = 0;
+}
+
+
+/*Frees the color, depth and G-buffers*/
+static void
+_gfxFramebufferFree(void)
+{
+	if (ren.fb_mem != NULL) {
+		free(ren.fb_mem);
+	} else {
+		free(ren.pix);
+		free(ren.zbuff);
+	}
+	free(ren.gnorm);
+	free(ren.galbedo);
+	free(ren.gdepth);
+	ren.fb_mem = NULL;
+	ren.pix = ren.gnorm = ren.galbedo = NULL;
+	ren.zbuff = ren.gdepth = NULL;
+	_gfxMsaaFree();
+	_gfxOitFree();
+}
+
+
+/*
+ * Allocates the color and depth buffers in rows (tile 0) or in 8x8 or 16x16
+ * tiles, 64 byte aligned, each with its color followed by its depth so the
+ * same offset indexes both buffers. The G-buffer is allocated again when used.
+ */
+static void
+_gfxFramebufferAlloc(u32 tile)
+{
+	_gfxFramebufferFree();
+	if (tile == 0) {
+		ren.tile_shift = ren.tile_mask = ren.tile_stride = 0;
+		ren.row_stride = ren.max_w;
+		ren.pix_size = ren.max_w * ren.max_h;
+		ren.pix = (u32*) calloc(ren.pix_size, sizeof(*ren.pix));
+		ren.zbuff = (f32*) calloc(ren.pix_size, sizeof(*ren.zbuff));
+	} else {
+		ren.tile_shift = (tile >= 16 ? 4 : 3);
+		ren.tile_mask = (1u << ren.tile_shift) - 1;
+		ren.tile_stride = (2 * ren.tile_shift) + 1;
+		const u32 tiles_w = (ren.max_w + ren.tile_mask) >> ren.tile_shift;
+		const u32 tiles_h = (ren.max_h + ren.tile_mask) >> ren.tile_shift;
+		ren.row_stride = tiles_w << ren.tile_stride;
+		ren.pix_size = (tiles_w * tiles_h) << ren.tile_stride;
+		ren.fb_mem = calloc((ren.pix_size * sizeof(u32)) + 64, 1);
+		ren.pix = (u32*) (((uintptr_t) ren.fb_mem + 63) & ~(uintptr_t) 63);
+		ren.zbuff = (f32*) (ren.pix + (1u << (2 * ren.tile_shift)));
+	}
+	if (ren.msaa) {
+		_gfxMsaaAlloc();
+	}
+	if (ren.transparency) {
+		_gfxOitAlloc();
+	}
+	ren.linear_serial = _gfxDisplayKey() - 1;
+	ren.serial++;
+}
+
+
 /* Initialize display pixels */
 void
 gfxDisplayInit(u32 width, u32 height, u32 win_width, u32 win_height)
 {
-	if (ren.pix != NULL) {
-		free(ren.pix);
-	}
-	ren.pix = (u32*) calloc(width * height, sizeof(*ren.pix));
-	ren.zbuff = (f32*) calloc(width * height, sizeof(*ren.zbuff));
 	ren.max_w = width;
 	ren.max_h = height;
+	_gfxFramebufferAlloc(ren.tile_shift ? 1u << ren.tile_shift : 0);
+	free(ren.linear);
+	ren.linear = (u32*) calloc(width * height, sizeof(*ren.linear));
 	ren.spans = (span*) calloc(height, sizeof(*ren.spans));
+	free(ren.lattice);
+	ren.lattice = (vec3*) malloc(3 * (width + 2) * sizeof(vec3));
+	ren.shading_rate = 1;
+	ren.shading_quality = 50;
 	ren.lighting_mode = 0;
 	ren.depth_test = 1;
+	ren.lod_error = 1;
+	ren.culling = 1;
+	ren.wire_color = 0xFFFFFF;
+	ren.point_size = 1;
+	free(ren.present);
+	free(ren.present_x);
+	free(ren.present_row);
+	ren.present = (u32*) calloc(width * height, sizeof(*ren.present));
+	ren.present_x = (u32*) malloc(width * sizeof(*ren.present_x));
+	ren.present_row = (u32*) malloc(((height + UPSCALE_ROWS - 1) / UPSCALE_ROWS) * (width + 1) * sizeof(*ren.present_row));
+	ren.frame_budget = 0;
+	ren.res_scale = 1.0f;
+	ren.res_min = 0.5f;
+	ren.frame_avg = 0.0f;
 	gfxDisplayRect(0, 0, win_width, win_height);
 	if (!ren.pix) {
 		printf("ERROR: Could not create display\n");
@@ -127,11 +628,231 @@ gfxDisplayInit(u32 width, u32 height, u32 win_width, u32 win_height)
 }
 
 
+/*Copies the rows of pixels of a row of tiles to the linear display*/
+static void
+_gfxResolveRows(void *data, u32 tile_y)
+{
+	const u32 size = 1u << ren.tile_shift;
+	const u32 y0 = tile_y << ren.tile_shift;
+	const u32 y1 = (y0 + size < ren.max_h ? y0 + size : ren.max_h);
+	(void) data;
+	for (u32 y = y0; y < y1; ++y) {
+		const u32 *src = ren.pix + PIX_ROW(y);
+		u32 *dst = ren.linear + (y * ren.max_w);
+		u32 x = 0;
+		/*Whole tile rows, aligned to 16 bytes in the tiles*/
+		for (; x + size <= ren.max_w; x += size) {
+			const u32 *s = src + PIX_COL(x);
+#ifdef __SSE__
+			for (u32 i = 0; i < size; i += 4) {
+				_mm_storeu_ps((f32*) (dst + x + i), _mm_load_ps((const f32*) (s + i)));
+			}
+#else
+			memcpy(dst + x, s, size * sizeof(u32));
+#endif
+		}
+		for (; x < ren.max_w; ++x) {
+			dst[x] = src[PIX_COL(x)];
+		}
+	}
+}
+
+
+/*
+ * Averages the samples of the expanded pixels into ren.pix, pixels fully
+ * covered by a triangle since they were listed already hold their color and
+ * leave the list. The sample colors of the others move down with them.
+ */
+static void
+_gfxMsaaResolve(void)
+{
+	u32 n = 0;
+	for (u32 i = 0; i < ren.msaa_count; ++i) {
+		const u32 off = ren.msaa_list[i];
+		if (!(ren.msaa_state[off] & MSAA_EXPANDED)) {
+			ren.msaa_state[off] = 0;
+			continue;
+		}
+		u32 *sc = ren.msaa_col + (i << 2);
+		u32 rb = 0x00020002u, ag = 0x00020002u;
+		for (u32 k = 0; k < 4; ++k) {
+			rb += sc[k] & 0x00FF00FFu;
+			ag += (sc[k] >> 8) & 0x00FF00FFu;
+		}
+		ren.pix[off] = ((rb >> 2) & 0x00FF00FFu) | ((ag << 6) & 0xFF00FF00u);
+		if (n != i) {
+			memcpy(ren.msaa_col + (n << 2), sc, 4 * sizeof(u32));
+		}
+		ren.msaa_state[off] = (n << MSAA_SLOT_SHIFT) | MSAA_EXPANDED | MSAA_LISTED;
+		ren.msaa_list[n++] = off;
+	}
+	ren.msaa_count = n;
+}
+
+
+/*
+ * The display in rows. Tiled framebuffers are resolved, and the post-process
+ * chain run, into the linear copy when they changed.
+ */
+static const u32*
+_gfxDisplayLinear(void)
+{
+	if (ren.msaa && ren.msaa_count && ren.msaa_serial != ren.serial) {
+		_gfxMsaaResolve();
+		ren.msaa_serial = ren.serial;
+	}
+	if (gfxPostCount()) {
+		if (ren.linear_serial != _gfxDisplayKey()) {
+			const u32 vp[4] = {ren.vp_x, ren.vp_y, ren.vp_x + ren.vp_w, ren.vp_y + ren.vp_h};
+			_gfxPostRun(ren.linear, ren.max_w, ren.max_h, vp);
+			ren.linear_serial = _gfxDisplayKey();
+		}
+		return ren.linear;
+	}
+	if (ren.tile_shift == 0) {
+		return ren.pix;
+	}
+	if (ren.linear_serial != _gfxDisplayKey()) {
+		gfxJobParallel(_gfxResolveRows, NULL, (ren.max_h + ren.tile_mask) >> ren.tile_shift);
+		ren.linear_serial = _gfxDisplayKey();
+	}
+	return ren.linear;
+}
+
+
+/*
+ * Copies the pixels [x0, x1) of a display row and, if depth is not NULL,
+ * their depth (the nearest sample with MSAA), for the post-process passes.
+ */
+void
+_gfxRowGet(u32 y, u32 x0, u32 x1, u32 *pix, f32 *depth)
+{
+	const u32 ln = PIX_ROW(y);
+	if (ren.tile_shift == 0) {
+		memcpy(pix, ren.pix + ln + x0, (x1 - x0) * sizeof(u32));
+	} else {
+		/*Runs of pixels to the end of each tile*/
+		for (u32 x = x0; x < x1;) {
+			u32 end = (x | ren.tile_mask) + 1;
+			end = (end < x1 ? end : x1);
+			memcpy(pix + (x - x0), ren.pix + ln + PIX_COL(x), (end - x) * sizeof(u32));
+			x = end;
+		}
+	}
+	if (depth == NULL) {
+		return;
+	}
+	const bint msaa = ren.msaa_z != NULL && ren.lighting_mode != GFX_LIGHT_DEFERRED;
+	for (u32 x = x0; x < x1;) {
+		u32 end = (ren.tile_shift ? (x | ren.tile_mask) + 1 : x1);
+		end = (end < x1 ? end : x1);
+		if (!msaa) {
+			memcpy(depth + (x - x0), ren.zbuff + ln + PIX_COL(x), (end - x) * sizeof(f32));
+			x = end;
+			continue;
+		}
+		/*Nearest of the 4 samples, stored together for each pixel*/
+		const f32 *sz = ren.msaa_z + ((ln + PIX_COL(x)) << 2);
+		f32 *d = depth + (x - x0);
+		u32 i = 0, n = end - x;
+#ifdef __SSE__
+		for (; i + 4 <= n; i += 4) {
+			__m128 s0 = _mm_loadu_ps(sz + (4 * i)), s1 = _mm_loadu_ps(sz + (4 * i) + 4);
+			__m128 s2 = _mm_loadu_ps(sz + (4 * i) + 8), s3 = _mm_loadu_ps(sz + (4 * i) + 12);
+			_MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+			_mm_storeu_ps(d + i, _mm_min_ps(_mm_min_ps(s0, s1), _mm_min_ps(s2, s3)));
+		}
+#endif
+		for (; i < n; ++i) {
+			d[i] = fminf(fminf(sz[4 * i], sz[(4 * i) + 1]), fminf(sz[(4 * i) + 2], sz[(4 * i) + 3]));
+		}
+		x = end;
+	}
+}
+
+
 /* Frees all display dinamic memory used */
 u32*
 gfxDisplayGet(void)
 {
-	return ren.pix;
+	return (u32*) _gfxDisplayLinear();
+}
+
+
+/*Lerp of two pixels, all the channels at once with an 8 bit weight in [0, 256]*/
+static inline u32
+_gfxPixLerp(u32 a, u32 b, u32 w)
+{
+	u32 rb = ((((a & 0x00FF00FFu) * (256 - w)) + ((b & 0x00FF00FFu) * w)) >> 8) & 0x00FF00FFu;
+	u32 ag = ((((a >> 8) & 0x00FF00FFu) * (256 - w)) + (((b >> 8) & 0x00FF00FFu) * w)) & 0xFF00FF00u;
+	return rb | ag;
+}
+
+
+/*Bilinear upscale of the drawn rect to the user rect, for a band of rows*/
+static void
+_gfxUpscaleRows(void *data, u32 band)
+{
+	const u32 *src = (const u32*) data;
+	const u32 *col = ren.present_x;
+	const u32 src_w = ren.vp_w, src_h = ren.vp_h, dst_w = ren.base_w;
+	const u32 y_begin = band * UPSCALE_ROWS;
+	const u32 y_end = (y_begin + UPSCALE_ROWS < ren.base_h ? y_begin + UPSCALE_ROWS : ren.base_h);
+	const f32 sy_step = (f32) src_h / (f32) ren.base_h;
+	u32 *row = ren.present_row + (band * (ren.max_w + 1));
+	for (u32 y = y_begin; y < y_end; ++y) {
+		f32 sy = clamp(((y + 0.5f) * sy_step) - 0.5f, 0.0f, (f32) (src_h - 1));
+		u32 y0 = (u32) sy, wy = (u32) ((sy - (f32) y0) * 256.0f);
+		u32 y1 = (y0 + 1 < src_h ? y0 + 1 : y0);
+		const u32 *r0 = src + ((ren.vp_y + y0) * ren.max_w) + ren.vp_x;
+		const u32 *r1 = src + ((ren.vp_y + y1) * ren.max_w) + ren.vp_x;
+		u32 *out = ren.present + ((ren.base_y + y) * ren.max_w) + ren.base_x;
+		/*Vertical pass over the smaller source row, then horizontal*/
+		for (u32 x = 0; x < src_w; ++x) {
+			row[x] = _gfxPixLerp(r0[x], r1[x], wy);
+		}
+		row[src_w] = row[src_w - 1];
+		for (u32 x = 0; x < dst_w; ++x) {
+			u32 sx = col[x] >> 9;
+			out[x] = _gfxPixLerp(row[sx], row[sx + 1], col[x] & 0x1FF);
+		}
+	}
+}
+
+
+/*
+ * Display to show, the same as gfxDisplayGet unless the dynamic resolution
+ * drew it smaller, then the drawn rect is upscaled to the user display rect.
+ */
+u32*
+gfxDisplayPresent(void)
+{
+	const u32 *src = _gfxDisplayLinear();
+	if (ren.vp_w == ren.base_w && ren.vp_h == ren.base_h) {
+		return (u32*) src;
+	}
+	/*Pixels outside the user rect are kept as they are*/
+	for (u32 y = 0; y < ren.max_h; ++y) {
+		u32 ln = y * ren.max_w;
+		if (y < ren.base_y || y >= ren.base_y + ren.base_h) {
+			memcpy(ren.present + ln, src + ln, ren.max_w * sizeof(u32));
+		} else {
+			memcpy(ren.present + ln, src + ln, ren.base_x * sizeof(u32));
+			memcpy(ren.present + ln + ren.base_x + ren.base_w, src + ln + ren.base_x + ren.base_w,
+				   (ren.max_w - ren.base_x - ren.base_w) * sizeof(u32));
+		}
+	}
+	if (ren.vp_w == 0 || ren.vp_h == 0) {
+		return ren.present;
+	}
+	const f32 sx_step = (f32) ren.vp_w / (f32) ren.base_w;
+	for (u32 x = 0; x < ren.base_w; ++x) {
+		f32 sx = clamp(((x + 0.5f) * sx_step) - 0.5f, 0.0f, (f32) (ren.vp_w - 1));
+		u32 x0 = (u32) sx;
+		ren.present_x[x] = (x0 << 9) | (u32) ((sx - (f32) x0) * 256.0f);
+	}
+	gfxJobParallel(_gfxUpscaleRows, (void*) src, (ren.base_h + UPSCALE_ROWS - 1) / UPSCALE_ROWS);
+	return ren.present;
 }
 
 
@@ -140,15 +861,32 @@ void
 gfxDisplayQuit(void)
 {
 	if (ren.pix != NULL) {
-		free(ren.pix);
+		_gfxFramebufferFree();
 		free(ren.spans);
-		ren.pix = NULL;
+		free(ren.lattice);
+		free(ren.present);
+		free(ren.present_x);
+		free(ren.present_row);
+		free(ren.linear);
+		free(ren.wire_vert);
+		free(ren.point_rec);
+		free(ren.point_bin);
+		free(ren.point_hist);
+		ren.wire_vert = NULL;
+		ren.point_rec = ren.point_bin = NULL;
+		ren.point_hist = NULL;
+		ren.wire_size = ren.point_rec_size = ren.point_bin_size = ren.point_hist_size = 0;
+		ren.lattice = NULL;
+		ren.present = ren.present_x = ren.present_row = ren.linear = NULL;
 	}
 }
 
+static void _gfxResolutionScale(f32 scale);
+
 void
 gfxSet(u32 var, u32 value)
 {
+	ren.serial++;
 	switch (var) {
 	case GFX_DEPTH_TEST: {
 		ren.depth_test = value;
@@ -156,31 +894,129 @@ gfxSet(u32 var, u32 value)
 	case GFX_LIGHTING_MODE: {
 		ren.lighting_mode = value;
 	} break;
+	case GFX_LOD_ERROR: {
+		ren.lod_error = value;
+	} break;
+	case GFX_CULLING: {
+		ren.culling = value;
+	} break;
+	case GFX_SHADING_RATE: {
+		ren.shading_rate = (value >= 4 ? 4 : (value >= 2 ? 2 : 1));
+	} break;
+	case GFX_SHADING_QUALITY: {
+		ren.shading_quality = (value > 100 ? 100 : value);
+	} break;
+	case GFX_FRAME_BUDGET: {
+		ren.frame_budget = value;
+		ren.frame_avg = 0.0f;
+		if (value == 0) {
+			_gfxResolutionScale(1.0f);
+		}
+	} break;
+	case GFX_FRAMEBUFFER_TILE: {
+		u32 tile = (value == 0 ? 0 : (value >= 16 ? 16 : 8));
+		if (tile != (ren.tile_shift ? 1u << ren.tile_shift : 0)) {
+			/*Before gfxDisplayInit only the layout is kept*/
+			if (ren.max_w) {
+				_gfxFramebufferAlloc(tile);
+			} else {
+				ren.tile_shift = (tile == 16 ? 4 : (tile == 8 ? 3 : 0));
+			}
+		}
+	} break;
+	case GFX_MSAA: {
+		bint msaa = (value >= 4);
+		if (msaa != ren.msaa) {
+			ren.msaa = msaa;
+			if (msaa && ren.max_w) {
+				_gfxMsaaAlloc();
+			} else {
+				_gfxMsaaFree();
+			}
+		}
+	} break;
+	case GFX_LINE_SMOOTH: {
+		ren.line_smooth = value;
+	} break;
+	case GFX_POINT_SIZE: {
+		ren.point_size = (value < 1 ? 1 : (value > POINT_TILE / 4 ? POINT_TILE / 4 : value));
+	} break;
+	case GFX_TRANSPARENCY: {
+		/*The buffers stay after it is turned off, until the accumulation is resolved*/
+		ren.transparency = value;
+		if (value && ren.max_w && ren.oit_accum == NULL) {
+			_gfxOitAlloc();
+		}
+	} break;
+	case GFX_WIREFRAME: {
+		ren.wireframe = (value > GFX_WIRE_OVERLAY ? GFX_WIRE_OVERLAY : value);
+	} break;
+	case GFX_MIN_RES_SCALE: {
+		ren.res_min = (f32) (value < 10 ? 10 : (value > 100 ? 100 : value)) / 100.0f;
+		if (ren.res_scale < ren.res_min) {
+			_gfxResolutionScale(ren.res_min);
+		}
+	} break;
 	}
 }
 
 
 
 /*============================================================================*/
+/*Clears the pixels, depth, G-buffer and transparency of the rect [x0, x1) x [y0, y1)*/
+void
+_gfxClearRect(const u32 rect[4])
+{
+	for (u32 y = rect[1]; y < rect[3]; ++y) {
+		const u32 ln = PIX_ROW(y);
+		for (u32 x = rect[0]; x < rect[2]; ++x) {
+			ren.pix[ln + PIX_COL(x)] = ren.clear_color;
+			ren.zbuff[ln + PIX_COL(x)] = 1.0f;
+		}
+		if (ren.galbedo != NULL) {
+			for (u32 x = rect[0]; x < rect[2]; ++x) {
+				ren.galbedo[ln + PIX_COL(x)] = 0;
+			}
+		}
+		if (ren.msaa_z != NULL) {
+			for (u32 x = rect[0]; x < rect[2]; ++x) {
+				f32 *sz = ren.msaa_z + ((ln + PIX_COL(x)) << 2);
+				sz[0] = sz[1] = sz[2] = sz[3] = 1.0f;
+				ren.msaa_state[ln + PIX_COL(x)] &= ~(u32) MSAA_EXPANDED;
+			}
+		}
+	}
+	/*Transparency accumulated in the rect*/
+	if (ren.oit_accum != NULL) {
+		const u32 *r = ren.oit_rect;
+		const u32 x0 = (rect[0] > r[0] ? rect[0] : r[0]), x1 = (rect[2] < r[2] ? rect[2] : r[2]);
+		for (u32 y = (rect[1] > r[1] ? rect[1] : r[1]); y < rect[3] && y < r[3]; ++y) {
+			const u32 ln = PIX_ROW(y);
+			for (u32 x = x0; x < x1; ++x) {
+				memset(ren.oit_accum + ((ln + PIX_COL(x)) << 2), 0, 4 * sizeof(f32));
+				ren.oit_reveal[ln + PIX_COL(x)] = 1.0f;
+			}
+		}
+		if (rect[0] <= r[0] && rect[1] <= r[1] && rect[2] >= r[2] && rect[3] >= r[3]) {
+			ren.oit_rect[0] = ren.oit_rect[1] = 0xFFFFFFFFu;
+			ren.oit_rect[2] = ren.oit_rect[3] = 0;
+		}
+	}
+	ren.linear_serial = _gfxDisplayKey() - 1;
+}
+
+
 /* Clears the display with the clear color over the Display Rect */
 void
 gfxClear(void)
 {
 	if (ren.pix != NULL) {
-		u32 *p = ren.pix + (ren.vp_y * ren.max_w) + ren.vp_x;
-		u32 *pend = ren.pix + (ren.vp_h * ren.max_w) + ren.vp_w;
-		/* Also Clear Z-Buffer */
-		f32 *z = ren.zbuff + (ren.vp_y * ren.max_w) + ren.vp_x;
-		while (p < pend) {
-			u32 *pln = p + ren.vp_w;
-			while (p < pln) {
-				*p++ = ren.clear_color;
-				*z++ = 1.0f;
-			}
-			z += ren.max_w - ren.vp_h;
-			p += ren.max_w - ren.vp_h;
-		}
+		const u32 rect[4] = {ren.vp_x, ren.vp_y, ren.vp_x + ren.vp_w, ren.vp_y + ren.vp_h};
+		_gfxClearRect(rect);
 	}
+	_gfxDeferredReset();
+	ren.gproj_set = 0;
+	ren.serial++;
 }
 
 
@@ -189,33 +1025,140 @@ void
 gfxClearColor(u8 r, u8 g, u8 b)
 {
 	ren.clear_color = ((u32) r << 16u) | ((u32) g << 8u) | ((u32) b);
+	ren.serial++;
 }
 
-/*Set the current display rect */
+
+/* Sets the color of the mesh edges in wireframe mode */
 void
-gfxDisplayRect(u32 x, u32 y, u32 width, u32 height)
+gfxWireColor(u8 r, u8 g, u8 b)
 {
-	ren.vp_x = (ren.max_w < x ? ren.max_w : x);
-	ren.vp_y = (ren.max_h < y ? ren.max_h : y);
-	ren.vp_w = (ren.max_w < (ren.vp_x + width) ? ren.max_w - ren.vp_x : width);
-	ren.vp_h = (ren.max_h < (ren.vp_y + height) ? ren.max_h - ren.vp_y : height);
+	ren.wire_color = ((u32) b << 16u) | ((u32) g << 8u) | ((u32) r);
+	ren.serial++;
 }
 
 
-
+/*Limits the drawing to the rect [x0, x1) x [y0, y1) of the DisplayRect (NULL for all of it)*/
+void
+_gfxScissor(const u32 rect[4])
+{
+	ren.sc_x0 = ren.vp_x;
+	ren.sc_y0 = ren.vp_y;
+	ren.sc_x1 = ren.vp_x + ren.vp_w;
+	ren.sc_y1 = ren.vp_y + ren.vp_h;
+	if (rect != NULL) {
+		ren.sc_x0 = (rect[0] > ren.sc_x0 ? rect[0] : ren.sc_x0);
+		ren.sc_y0 = (rect[1] > ren.sc_y0 ? rect[1] : ren.sc_y0);
+		ren.sc_x1 = (rect[2] < ren.sc_x1 ? rect[2] : ren.sc_x1);
+		ren.sc_y1 = (rect[3] < ren.sc_y1 ? rect[3] : ren.sc_y1);
+		ren.sc_x1 = (ren.sc_x1 > ren.sc_x0 ? ren.sc_x1 : ren.sc_x0);
+		ren.sc_y1 = (ren.sc_y1 > ren.sc_y0 ? ren.sc_y1 : ren.sc_y0);
+	}
+}
+
+
+/*Draws in the top left part of the user display rect, scaled by the dynamic resolution*/
+static void
+_gfxResolutionScale(f32 scale)
+{
+	ren.res_scale = scale;
+	ren.vp_x = ren.base_x;
+	ren.vp_y = ren.base_y;
+	ren.vp_w = (u32) ((f32) ren.base_w * scale + 0.5f);
+	ren.vp_h = (u32) ((f32) ren.base_h * scale + 0.5f);
+	ren.vp_w = (ren.vp_w || !ren.base_w ? ren.vp_w : 1);
+	ren.vp_h = (ren.vp_h || !ren.base_h ? ren.vp_h : 1);
+	_gfxScissor(NULL);
+	ren.serial++;
+}
+
+
+/*Set the current display rect */
+void
+gfxDisplayRect(u32 x, u32 y, u32 width, u32 height)
+{
+	ren.base_x = (ren.max_w < x ? ren.max_w : x);
+	ren.base_y = (ren.max_h < y ? ren.max_h : y);
+	ren.base_w = (ren.max_w < (ren.base_x + width) ? ren.max_w - ren.base_x : width);
+	ren.base_h = (ren.max_h < (ren.base_y + height) ? ren.max_h - ren.base_y : height);
+	_gfxResolutionScale(ren.res_scale);
+}
+
+
+/*
+ * Reports the time of the last frame. With a frame budget the resolution of
+ * the next frames follows it, assuming the time grows with the pixel count:
+ * it drops at once on slow frames and grows back slowly on the average.
+ */
+void
+gfxFrameTime(f32 ms)
+{
+	if (ren.frame_budget == 0 || ms <= 0.0f) {
+		return;
+	}
+	const f32 target = (f32) ren.frame_budget * 0.001f;
+	ren.frame_avg = (ren.frame_avg > 0.0f ? ren.frame_avg + 0.25f * (ms - ren.frame_avg) : ms);
+	f32 t = (ms > target ? fmaxf(ms, ren.frame_avg) : ren.frame_avg);
+	/*Aim a bit under the budget, with small changes ignored so the pixels can be reused*/
+	f32 scale = ren.res_scale * sqrtf(0.9f * target / t);
+	scale = fminf(scale, ren.res_scale * 1.05f);
+	scale = clamp(scale, ren.res_min, 1.0f);
+	if (fabsf(scale - ren.res_scale) < 0.02f && scale != 1.0f && scale != ren.res_min) {
+		return;
+	}
+	if (scale != ren.res_scale) {
+		ren.frame_avg *= (scale * scale) / (ren.res_scale * ren.res_scale);
+		_gfxResolutionScale(scale);
+	}
+}
+
+
+/*DisplayRect as [x0, x1) x [y0, y1)*/
+void
+_gfxViewport(u32 rect[4])
+{
+	rect[0] = ren.vp_x;
+	rect[1] = ren.vp_y;
+	rect[2] = ren.vp_x + ren.vp_w;
+	rect[3] = ren.vp_y + ren.vp_h;
+}
+
+
+/*Changes whenever the display, the render state, the lights or the pixels may have changed*/
+u32
+_gfxSerial(void)
+{
+	return ren.serial + _gfxLightSerial();
+}
+
+
+
 /*STATIC FUNCTION FOR COMPUTING SPAN OF TRIANGLE*/
 static void
 _gfxSpanCompute(f32 x1, f32 y1, f32 x2, f32 y2, u32 side)
 {
 	f32 x = x1;
-	u32 y = y1, dy = abs(y2 - y1);
+	s32 y = (s32) y1, dy = abs((s32) y2 - (s32) y1);
 	s32 sy = (y1 < y2 ? 1 : -1);
-	f32 dx = (x2 - x1) / (f32) (dy > 0.0 ? dy : 1.0f);
-	u32 i = 1;
+	s32 top = (s32) ren.sc_y0, bottom = (s32) ren.sc_y1;
+	/*The last column of the DisplayRect is left out, as it always was*/
+	const u32 right = (ren.sc_x1 < ren.vp_x + ren.vp_w ? ren.sc_x1 : ren.vp_x + ren.vp_w - 1);
+	f32 dx = (x2 - x1) / (f32) (dy > 0 ? dy : 1);
+	s32 i = 1;
+	/*Skip the rows before the viewport, edges may start far outside of it*/
+	s32 skip = (sy > 0 ? top - y : y - (bottom - 1));
+	if (skip > 0) {
+		skip = (skip < dy ? skip : dy);
+		i += skip;
+		y += sy * skip;
+		x += dx * (f32) skip;
+	}
 	while (i <= dy) {
 		/*Terrible clipping method*/
-		if (y >= ren.vp_y && y < (ren.vp_y + ren.vp_h)) {
-			ren.spans[y].x[side] = (u32) clamp(ceilf(x), ren.vp_x, ren.vp_x + ren.vp_w - 1);
+		if (y >= top && y < bottom) {
+			ren.spans[y].x[side] = (u32) clamp(ceilf(x), ren.sc_x0, right);
+		} else {
+			break;
 		}
 		x += dx;
 		y += sy;
@@ -287,248 +1230,1518 @@ _point(Vert *p, mat4 proj)
 	vec3_smul(sp, sp[3], sp);
 	x = PIXW(sp[0]), y = PIXH(sp[1]), z = sp[2];
 	if (sp[0] < -1.0f || sp[0] > 1.0f ||
-		sp[1] < -1.0f || sp[1] > 1.0f) {
+		sp[1] < -1.0f || sp[1] > 1.0f ||
+		x < ren.sc_x0 || x >= ren.sc_x1 || y < ren.sc_y0 || y >= ren.sc_y1) {
 		return;
 	}
 	/*Shading*/
-	if (ren.lighting_mode) {
-		_gfxComputeLighting(tmp, p->pos, p->norm);
+	const u32 lighting = _gfxDrawLighting();
+	if (lighting && lighting != GFX_LIGHT_DEFERRED) {
+		_gfxComputeLighting(tmp, p->pos, p->norm, _gfxLightTile((s32) x, (s32) y));
 		vec3_mul(p->color, tmp, p->color);
 		vec3_clamp(p->color, 0.0f, 1.0f);
 	}
 	/*clip z in [0, 1]*/
-	u32 offset = (u32)(y * ren.max_w) + (u32) x;
+	u32 offset = PIX_ROW((u32) y) + PIX_COL((u32) x);
+	if (ren.msaa && ren.lighting_mode != GFX_LIGHT_DEFERRED) {
+		/*Covers the whole pixel, depth tested per sample*/
+		f32 *sz = ren.msaa_z + (offset << 2);
+		u32 mask = 0;
+		for (u32 k = 0; k < 4; ++k) {
+			if (!ren.depth_test || (z >= 0.0f && z <= sz[k])) {
+				sz[k] = (ren.depth_test ? z : sz[k]);
+				mask |= 1u << k;
+			}
+		}
+		if (mask) {
+			_gfxMsaaWrite(offset, mask, vec3_toRGB(p->color));
+		}
+		return;
+	}
 	f32 curr_z = ren.zbuff[offset];
 	if (ren.depth_test) {
 		if ((z < 0.0f || curr_z < z)) {
 			return;
 		}
 	}
+	if (lighting == GFX_LIGHT_DEFERRED) {
+		_gfxGBufferWrite(offset, z, p->color, p->norm);
+		return;
+	}
 	/*Draw pixel and update z-buffer*/
 	ren.zbuff[offset] = (ren.depth_test ? z : curr_z);
 	ren.pix[offset] = vec3_toRGB(p->color);
+	if (ren.gforward) {
+		ren.galbedo[offset] = 0;
+	}
 }
 
 
-/*Draws a triangle*/
-void
-_triangle(Vert *p0, Vert *p1, Vert *p2, mat4 proj, Tex *tex)
-{
-	Vert *tmp_swap;
-	vec4 spv0, spv1, spv2;
-	f32 *sp0 = spv0, *sp1 = spv1, *sp2 = spv2, *tmp_v;
+/*Endpoint attributes of a line, interpolated along it*/
+typedef struct LineAttr_t {
+	vec3 color[2];
+	vec3 norm[2];
+} LineAttr;
 
-	/*Screen space transform */
-	sp0[3] = 1.0f / vec3_mat4MulStandard(sp0, proj, p0->pos);
-	sp1[3] = 1.0f / vec3_mat4MulStandard(sp1, proj, p1->pos);
-	sp2[3] = 1.0f / vec3_mat4MulStandard(sp2, proj, p2->pos);
-	vec3_smul(sp0, sp0[3], sp0);
-	vec3_smul(sp1, sp1[3], sp1);
-	vec3_smul(sp2, sp2[3], sp2);
-	/*Check if its front facing*/
-	f32 area = edge_func(sp0[0], sp0[1], sp1[0], sp1[1], sp2[0], sp2[1]);
-	if (!(area > 0.0f)) {
-		return;
-	}
 
-	/* Order p from highest to lowest y value (p0=highest)*/
-	if (sp0[1] < sp1[1]) {
-		tmp_swap = p0;
-		p0 = p1;
-		p1 = tmp_swap;
-		tmp_v = sp0;
-		sp0 = sp1;
-		sp1 = tmp_v;
+/*Depth tests and writes a pixel of a line or point splat, covering all its samples with MSAA*/
+static inline void
+_gfxLinePixel(u32 offset, f32 z, u32 color)
+{
+	if (ren.msaa && ren.lighting_mode != GFX_LIGHT_DEFERRED) {
+		f32 *sz = ren.msaa_z + (offset << 2);
+		u32 mask = 0;
+		for (u32 k = 0; k < 4; ++k) {
+			if (!ren.depth_test || (z >= 0.0f && z <= sz[k])) {
+				sz[k] = (ren.depth_test ? z : sz[k]);
+				mask |= 1u << k;
+			}
+		}
+		if (mask) {
+			_gfxMsaaWrite(offset, mask, color);
+		}
+		return;
 	}
-	if (sp1[1] < sp2[1]) {
-		tmp_swap = p1;
-		p1 = p2;
-		p2 = tmp_swap;
-		tmp_v = sp1;
-		sp1 = sp2;
-		sp2 = tmp_v;
+	if (ren.depth_test) {
+		if (z < 0.0f || ren.zbuff[offset] < z) {
+			return;
+		}
+		ren.zbuff[offset] = z;
 	}
-	if (sp0[1] < sp1[1]) {
-		tmp_swap = p0;
-		p0 = p1;
-		p1 = tmp_swap;
-		tmp_v = sp0;
-		sp0 = sp1;
-		sp1 = tmp_v;
+	ren.pix[offset] = color;
+	/*Left as drawn by the deferred resolve*/
+	if (ren.lighting_mode == GFX_LIGHT_DEFERRED) {
+		ren.galbedo[offset] = 0;
 	}
-	/*Display space transform*/
-	sp0[0] = PIXW(sp0[0]), sp0[1] = PIXH(sp0[1]);
-	sp1[0] = PIXW(sp1[0]), sp1[1] = PIXH(sp1[1]);
-	sp2[0] = PIXW(sp2[0]), sp2[1] = PIXH(sp2[1]);
-	/*Compute spans of triangle depending on midle point location*/
-	bint cmp = edge_func(sp0[0], sp0[1], sp2[0], sp2[1], sp1[0], sp1[1]) > 0.0;
-	_gfxSpanCompute(sp0[0], sp0[1], sp1[0], sp1[1], !cmp);
-	_gfxSpanCompute(sp0[0], sp0[1], sp2[0], sp2[1], cmp);
-	_gfxSpanCompute(sp1[0], sp1[1], sp2[0], sp2[1], !cmp);
+}
 
-	/*Precompute perspective correction*/
-	const f32 d = 1.0f / ((sp0[0] - sp2[0])*(sp1[1] - sp0[1]) - (sp0[0] - sp1[0])*(sp2[1] - sp0[1]));
-	const vec3 bar_d0 = {(sp1[1] - sp2[1])*d, (sp2[1] - sp0[1])*d, (sp0[1] - sp1[1])*d};
-	const vec3 bar_d1 = {(sp2[0] - sp1[0])*d, (sp0[0] - sp2[0])*d, (sp1[0] - sp0[0])*d};
-	const vec3 bar_0  = {(sp1[0]*sp2[1] - sp2[0]*sp1[1]) * d, (sp2[0]*sp0[1] - sp0[0]*sp2[1]) * d, (sp0[0]*sp1[1] - sp1[0]*sp0[1]) * d};
-	const vec3 vpos_z = {sp0[2], sp1[2], sp2[2]};
-	const vec3 vpos_w = {sp0[3], sp1[3], sp2[3]};
-	/*GOURAUD SHADING if active*/
-	if (ren.lighting_mode == GFX_LIGHT_GOURAUD) {
-		vec3 tmp;
-		_gfxComputeLighting(tmp, p0->pos, p0->norm);
-		vec3_mul(p0->color, tmp, p0->color);
-		vec3_clamp(p0->color, 0.0f, 1.0f);
-		_gfxComputeLighting(tmp, p1->pos, p1->norm);
-		vec3_mul(p1->color, tmp, p1->color);
-		vec3_clamp(p1->color, 0.0f, 1.0f);
-		_gfxComputeLighting(tmp, p2->pos, p2->norm);
-		vec3_mul(p2->color, tmp, p2->color);
-		vec3_clamp(p2->color, 0.0f, 1.0f);
+
+/*Depth tests and blends color over a pixel with weight w in [0, 256]*/
+static inline void
+_gfxLineBlend(u32 offset, f32 z, u32 color, u32 w)
+{
+	if (ren.depth_test) {
+		if (z < 0.0f || ren.zbuff[offset] < z) {
+			return;
+		}
+		/*Only the stronger half of the line occludes*/
+		if (w >= 128) {
+			ren.zbuff[offset] = z;
+		}
 	}
+	const u32 dst = ren.pix[offset];
+	const u32 rb = ((((color & 0xFF00FFu) * w) + ((dst & 0xFF00FFu) * (256 - w))) >> 8) & 0xFF00FFu;
+	const u32 g = ((((color & 0x00FF00u) * w) + ((dst & 0x00FF00u) * (256 - w))) >> 8) & 0x00FF00u;
+	ren.pix[offset] = rb | g;
+}
 
-	/*Iterate spans to render inside triangle*/
-	const u32 y_begin = clamp(sp0[1], ren.vp_y, ren.vp_y + ren.vp_h - 1);
-	const u32 y_end = clamp(sp2[1], ren.vp_y, ren.vp_y + ren.vp_h - 1);
-	//#pragma omp parallel for
-	//printf("tri: %d %d\n", y_begin, y_end);
-	for (u32 y = y_begin; y < y_end; ++y) {
-		vec3 pos_attr, col_attr, norm_attr, tmp;
-		vec2 tex_attr;
-		u32 x = ren.spans[y].x[0];
-		u32 xend = ren.spans[y].x[1];
-		u32 ln = (y * ren.max_w);
-		for (; x < xend; ++x) {
-			vec3 bar;
-			f32 fx = x + 0.5f, fy = y + 0.5f;
-			/*Get barycentric coordinates*/
-			vec3_add(bar, vec3_smul(tmp, fx, bar_d0), bar_0);
-			vec3_add(bar, bar, vec3_smul(tmp, fy, bar_d1));
-			vec3_clamp(bar, 0.0f, 1.0f);
-			bar[2] = 1.0f - bar[0] - bar[1];
 
-			/*clip z in [0, 1]*/
-			f32 z = vec3_dot(bar, vpos_z);
-			f32 curr_z = ren.zbuff[ln + x];
-			if (ren.depth_test) {
-				if (z < 0.0f || curr_z < z) {
-					continue;
-				}
+/*
+ * Rasterizes the screen segment a-b (x and y in pixels inside the DisplayRect,
+ * z depth) with integer Bresenham steps, one pixel per step of the major axis.
+ * Pixels are tested against the scissor if test is TRUE. Colors (and normals
+ * for the G-buffer) are interpolated when attr is not NULL, else every pixel
+ * takes color.
+ */
+static void
+_gfxLineRaster(const f32 *a, const f32 *b, u32 color, const LineAttr *attr, bint test)
+{
+	s32 x = (s32) a[0], y = (s32) a[1];
+	const s32 x1 = (s32) b[0], y1 = (s32) b[1];
+	const s32 dx = abs(x1 - x), dy = -abs(y1 - y);
+	const s32 sx = (x < x1 ? 1 : -1), sy = (y < y1 ? 1 : -1);
+	const s32 n = (dx > -dy ? dx : -dy);
+	const f32 inv_n = (n ? 1.0f / (f32) n : 0.0f);
+	const f32 dz = (b[2] - a[2]) * inv_n;
+	s32 err = dx + dy;
+	f32 z = a[2];
+
+	if (attr == NULL) {
+		for (s32 i = 0; i <= n; ++i) {
+			if (!test || LINE_IN_SCISSOR(x, y)) {
+				_gfxLinePixel(PIX_ROW((u32) y) + PIX_COL((u32) x), z, color);
 			}
-			/*Precompute perspective correction for interpolation*/
-			f32 w0 = bar[0] * vpos_w[0];
-			f32 w1 = bar[1] * vpos_w[1];
-			f32 w2 = bar[2] * vpos_w[2];
-			f32 inv_p = 1.0f / (w0 + w1 + w2);
+			s32 e2 = 2 * err;
+			if (e2 >= dy) {
+				err += dy;
+				x += sx;
+			}
+			if (e2 <= dx) {
+				err += dx;
+				y += sy;
+			}
+			z += dz;
+		}
+		return;
+	}
+	const bint deferred = (_gfxDrawLighting() == GFX_LIGHT_DEFERRED);
+	for (s32 i = 0; i <= n; ++i) {
+		u32 offset = PIX_ROW((u32) y) + PIX_COL((u32) x);
+		vec3 col;
+		vec3_lerp(col, attr->color[0], attr->color[1], (f32) i * inv_n);
+		if (test && !LINE_IN_SCISSOR(x, y)) {
+			/*Out of the scissor*/
+		} else if (!deferred) {
+			_gfxLinePixel(offset, z, vec3_toRGB(col));
+		} else if (!ren.depth_test || (z >= 0.0f && ren.zbuff[offset] >= z)) {
+			vec3 norm;
+			vec3_lerp(norm, attr->norm[0], attr->norm[1], (f32) i * inv_n);
+			_gfxGBufferWrite(offset, z, col, norm);
+		}
+		s32 e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y += sy;
+		}
+		z += dz;
+	}
+}
 
-			/*interpolate face color*/
-			vec3_lerpAttr(col_attr, w0, p0->color, w1, p1->color, w2, p2->color, inv_p);
-			/*Apply texture to face*/
-			vec2_lerpAttr(tex_attr,  w0, p0->tex, w1, p1->tex, w2, p2->tex, inv_p);
-			_gfxSampleTex(tmp, tex, tex_attr);
-			vec3_mul(col_attr, tmp, col_attr);
 
-			/*PHONG SHADING if active*/
-			if (ren.lighting_mode == GFX_LIGHT_PHONG) {
-				vec3_lerpAttr(pos_attr, w0, p0->pos, w1, p1->pos, w2, p2->pos, inv_p);
-				vec3_lerpAttr(norm_attr, w0, p0->norm, w1, p1->norm, w2, p2->norm, inv_p);
-				_gfxComputeLighting(tmp, pos_attr, norm_attr);
-				vec3_mul(col_attr, tmp, col_attr);
-			}
-			vec3_clamp(col_attr, 0.0f, 1.0f);
+/*
+ * Rasterizes the screen segment a-b with Xiaolin Wu's algorithm: each step of
+ * the major axis blends the two pixels across the line by their distance to
+ * it. Colors are interpolated when attr is not NULL.
+ */
+static void
+_gfxLineSmooth(const f32 *a, const f32 *b, u32 color, const LineAttr *attr, bint test)
+{
+	/*Major axis, walked from its lower end*/
+	const u32 mj = (fabsf(b[1] - a[1]) > fabsf(b[0] - a[0]) ? 1 : 0), mn = 1 - mj;
+	const bint flip = (a[mj] > b[mj]);
+	const f32 *p = (flip ? b : a), *q = (flip ? a : b);
+	const f32 len = q[mj] - p[mj];
+	const f32 inv_len = (len > 0.0f ? 1.0f / len : 0.0f);
+	const f32 grad = (q[mn] - p[mn]) * inv_len, dz = (q[2] - p[2]) * inv_len;
+	/*Pixels across the line are always tested against the scissor*/
+	const s32 lo = (s32) (mj ? ren.sc_x0 : ren.sc_y0), hi = (s32) (mj ? ren.sc_x1 : ren.sc_y1);
+	const s32 m_lo = (s32) (mj ? ren.sc_y0 : ren.sc_x0), m_hi = (s32) (mj ? ren.sc_y1 : ren.sc_x1);
 
-			/*Draw pixel and update z-buffer*/
-			ren.zbuff[ln + x] = (ren.depth_test ? z : curr_z);
-			ren.pix[ln + x] = vec3_toRGB(col_attr);
+	for (s32 m = (s32) p[mj]; m <= (s32) q[mj]; ++m) {
+		if (test && (m < m_lo || m >= m_hi)) {
+			continue;
+		}
+		f32 d = ((f32) m + 0.5f) - p[mj];
+		f32 c = p[mn] + (grad * d) - 0.5f;
+		f32 z = p[2] + (dz * d);
+		s32 k = (s32) floorf(c);
+		u32 w = (u32) ((c - (f32) k) * 256.0f);
+		if (attr) {
+			vec3 col;
+			f32 t = clamp(d * inv_len, 0.0f, 1.0f);
+			vec3_lerp(col, attr->color[flip], attr->color[!flip], t);
+			color = vec3_toRGB(col);
+		}
+		if (k >= lo && k < hi) {
+			_gfxLineBlend((mj ? PIX_ROW((u32) m) + PIX_COL((u32) k) : PIX_ROW((u32) k) + PIX_COL((u32) m)),
+						  z, color, 256 - w);
+		}
+		if (k + 1 >= lo && k + 1 < hi && w) {
+			_gfxLineBlend((mj ? PIX_ROW((u32) m) + PIX_COL((u32) k + 1) : PIX_ROW((u32) k + 1) + PIX_COL((u32) m)),
+						  z, color, w);
 		}
 	}
 }
 
 
-void
-gfxDraw(u32 prim_type, Vert *v_arr, u32 count, mat4 proj, mat4 view, mat4 model, Tex *tex)
+/*TRUE if both screen endpoints are in the scissor, so the pixels of the line are*/
+static inline bint
+_gfxLineInScissor(const f32 *a, const f32 *b)
 {
-	mat4 mv;
-	mat3 normat;
+	const f32 x_max = (f32) ren.sc_x1 - (1.0f / 256.0f), y_max = (f32) ren.sc_y1 - (1.0f / 256.0f);
+	return (fminf(a[0], b[0]) >= (f32) ren.sc_x0 && fmaxf(a[0], b[0]) <= x_max &&
+			fminf(a[1], b[1]) >= (f32) ren.sc_y0 && fmaxf(a[1], b[1]) <= y_max);
+}
 
-	/*Check primitive type*/
-	if (prim_type - 1 > 2) {
-		return;
-	}
-	mat4_mul(mv, view, model);
-	mat4_normalMatrix(normat, mv);
 
-	/*Obtain matrix for first camera*/
-	switch(prim_type) {
-	case GFX_POINT: {
-		/*Draw all points*/
-		for (u32 i = 0; i < count; ++i) {
-			Vert p = v_arr[i];
-			vec3_mat4Mul(p.pos, mv, p.pos);
-			if (ren.lighting_mode) {
-				vec3_matMul(p.norm, normat, p.norm);
-			}
-			_point(&p, proj);
+/*Line anti-aliasing is a blend over the pixels, so not for samples or the G-buffer*/
+static inline bint
+_gfxLineSmoothOn(void)
+{
+	return (ren.line_smooth && !ren.msaa && ren.lighting_mode != GFX_LIGHT_DEFERRED);
+}
+
+
+/*
+ * Clips the segment between the clip space points c0 and c1 to the near plane
+ * and to the DisplayRect. Outputs its screen endpoints (x and y in pixels, z
+ * depth) and their parameters along the segment. Returns FALSE if nothing is
+ * left. The scissor is left to the pixels, so a line takes the same pixels in
+ * any scissor rect.
+ */
+static bint
+_gfxLineClip(const f32 *c0, const f32 *c1, f32 s[2][3], f32 t[2])
+{
+	f32 t0 = 0.0f, t1 = 1.0f, w[2];
+
+	/*Near plane (z >= -w) and the camera plane*/
+	for (u32 k = 0; k < 2; ++k) {
+		f32 d0 = (k ? c0[3] - 1e-5f : c0[2] + c0[3]);
+		f32 d1 = (k ? c1[3] - 1e-5f : c1[2] + c1[3]);
+		if (d0 < 0.0f && d1 < 0.0f) {
+			return FALSE;
 		}
-	} break;
-	case GFX_LINE: {
-		count -= count % prim_type;
-		/*Draw all lines*/
-		for (u32 i = 0; i < count; i += 2) {
-			Vert p[2] = {v_arr[i], v_arr[i+1]};
-			vec3_mat4Mul(p[0].pos, mv, p[0].pos);
-			vec3_mat4Mul(p[1].pos, mv, p[1].pos);
-			if (ren.lighting_mode) {
-				vec3_matMul(p[0].norm, normat, p[0].norm);
-				vec3_matMul(p[1].norm, normat, p[1].norm);
-			}
-			//TODO: IMPLEMENT LINE FUNCTION
-			//_line(p, p + 1, view_pos, proj);
+		if (d0 < 0.0f) {
+			t0 = fmaxf(t0, d0 / (d0 - d1));
+		} else if (d1 < 0.0f) {
+			t1 = fminf(t1, d0 / (d0 - d1));
 		}
-	} break;
-	case GFX_TRIANGLE: {
-		count -= count % prim_type;
-		/*Draw all Triangles*/
-		for (u32 i = 0; i < count; i += 3) {
-			Vert p[3] = {v_arr[i], v_arr[i+1], v_arr[i+2]};
-			vec3_mat4Mul(p[0].pos, mv, p[0].pos);
-			vec3_mat4Mul(p[1].pos, mv, p[1].pos);
-			vec3_mat4Mul(p[2].pos, mv, p[2].pos);
-			if (ren.lighting_mode) {
-				vec3_matMul(p[0].norm, normat, p[0].norm);
-				vec3_matMul(p[1].norm, normat, p[1].norm);
-				vec3_matMul(p[2].norm, normat, p[2].norm);
+	}
+	if (t0 > t1) {
+		return FALSE;
+	}
+	for (u32 e = 0; e < 2; ++e) {
+		vec4 c;
+		for (u32 k = 0; k < 4; ++k) {
+			c[k] = (e ? (t1 == 1.0f ? c1[k] : lerp(c0[k], c1[k], t1)) : lerp(c0[k], c1[k], t0));
+		}
+		f32 inv_w = 1.0f / c[3];
+		s[e][0] = ((c[0] * inv_w + 1.0f) * 0.5f * (ren.vp_w - 1)) + ren.vp_x;
+		s[e][1] = ((1.0f - c[1] * inv_w) * 0.5f * (ren.vp_h - 1)) + ren.vp_y;
+		s[e][2] = c[2] * inv_w;
+		w[e] = c[3];
+	}
+	/*Liang-Barsky against the DisplayRect, the pixel x holds [x, x + 1)*/
+	const f32 lim[2][2] = {{(f32) ren.vp_x, (f32) (ren.vp_x + ren.vp_w) - (1.0f / 256.0f)},
+						   {(f32) ren.vp_y, (f32) (ren.vp_y + ren.vp_h) - (1.0f / 256.0f)}};
+	f32 u0 = 0.0f, u1 = 1.0f;
+	for (u32 k = 0; k < 2; ++k) {
+		f32 d = s[1][k] - s[0][k];
+		f32 p[2] = {-d, d}, q[2] = {s[0][k] - lim[k][0], lim[k][1] - s[0][k]};
+		for (u32 j = 0; j < 2; ++j) {
+			if (p[j] == 0.0f) {
+				if (q[j] < 0.0f) {
+					return FALSE;
+				}
+			} else if (p[j] < 0.0f) {
+				u0 = fmaxf(u0, q[j] / p[j]);
+			} else {
+				u1 = fminf(u1, q[j] / p[j]);
 			}
-			_triangle(p, p + 1, p + 2, proj, tex);
 		}
-	} break;
 	}
+	if (u0 > u1) {
+		return FALSE;
+	}
+	f32 a[3], b[3];
+	for (u32 k = 0; k < 3; ++k) {
+		a[k] = lerp(s[0][k], s[1][k], u0);
+		b[k] = (u1 == 1.0f ? s[1][k] : lerp(s[0][k], s[1][k], u1));
+	}
+	memcpy(s[0], a, sizeof(a));
+	memcpy(s[1], b, sizeof(b));
+	/*Screen parameters back to the segment, perspective correct*/
+	f32 tc0 = (u0 * w[0]) / (((1.0f - u0) * w[1]) + (u0 * w[0]));
+	f32 tc1 = (u1 * w[0]) / (((1.0f - u1) * w[1]) + (u1 * w[0]));
+	t[0] = lerp(t0, t1, tc0);
+	t[1] = lerp(t0, t1, tc1);
+	return TRUE;
 }
 
 
-/*Draws the given mesh with textures and transformation matrices*/
+/*Draws a line lit at its ends (G-buffer per pixel in deferred mode)*/
 void
-gfxDrawMesh(Mesh *msh, mat4 proj, mat4 view, Tex *tex)
+_line(Vert *p0, Vert *p1, mat4 proj)
 {
-	mat4 mv;
-	mat3 normat;
+	vec4 c0, c1;
+	f32 s[2][3], t[2];
+	LineAttr attr;
+
+	c0[3] = vec3_mat4MulStandard(c0, proj, p0->pos);
+	c1[3] = vec3_mat4MulStandard(c1, proj, p1->pos);
+	if (!_gfxLineClip(c0, c1, s, t)) {
+		return;
+	}
+	const bint deferred = (_gfxDrawLighting() == GFX_LIGHT_DEFERRED);
+	for (u32 e = 0; e < 2; ++e) {
+		vec3_lerp(attr.color[e], p0->color, p1->color, t[e]);
+		vec3_lerp(attr.norm[e], p0->norm, p1->norm, t[e]);
+		if (ren.lighting_mode && !deferred) {
+			vec3 pos, tmp;
+			vec3_lerp(pos, p0->pos, p1->pos, t[e]);
+			vec3_normalize(attr.norm[e]);
+			_gfxComputeLighting(tmp, pos, attr.norm[e], _gfxLightTile((s32) s[e][0], (s32) s[e][1]));
+			vec3_mul(attr.color[e], tmp, attr.color[e]);
+		}
+		vec3_clamp(attr.color[e], 0.0f, 1.0f);
+	}
+	/*Same color at both ends needs no interpolation*/
+	u32 color = vec3_toRGB(attr.color[0]);
+	const LineAttr *a = ((deferred || color != vec3_toRGB(attr.color[1])) ? &attr : NULL);
+	const bint test = !_gfxLineInScissor(s[0], s[1]);
+	if (_gfxLineSmoothOn()) {
+		_gfxLineSmooth(s[0], s[1], color, a, test);
+	} else {
+		_gfxLineRaster(s[0], s[1], color, a, test);
+	}
+}
+
+
+/*A batch of points drawn by the jobs*/
+typedef struct PointBatch_t {
+	const f32 *x;
+	const f32 *y;
+	const f32 *z;
+	const u32 *color;
+	u32 count;
+	const f32 *mvp;
+	u32 tiles_w;
+	u32 tiles;
+	s32 r0;					// splat pixels before the center
+	s32 r1;					// splat pixels after the center
+} PointBatch;
+
+
+/*Range of screen tiles touched by a splat rect*/
+#define POINT_TILES(rect, tx0, ty0, tx1, ty1) \
+	const u32 tx0 = (u32) (rect[0] - (s32) ren.vp_x) >> POINT_TILE_SHIFT, \
+			  ty0 = (u32) (rect[1] - (s32) ren.vp_y) >> POINT_TILE_SHIFT, \
+			  tx1 = (u32) (rect[2] - (s32) ren.vp_x) >> POINT_TILE_SHIFT, \
+			  ty1 = (u32) (rect[3] - (s32) ren.vp_y) >> POINT_TILE_SHIFT
+
+
+/*Screen rect [x0, x1] x [y0, y1] of the splat at x, y inside the scissor, FALSE if empty*/
+static inline bint
+_gfxPointRect(const PointBatch *pb, s32 x, s32 y, s32 rect[4])
+{
+	rect[0] = (x - pb->r0 > (s32) ren.sc_x0 ? x - pb->r0 : (s32) ren.sc_x0);
+	rect[1] = (y - pb->r0 > (s32) ren.sc_y0 ? y - pb->r0 : (s32) ren.sc_y0);
+	rect[2] = (x + pb->r1 < (s32) ren.sc_x1 - 1 ? x + pb->r1 : (s32) ren.sc_x1 - 1);
+	rect[3] = (y + pb->r1 < (s32) ren.sc_y1 - 1 ? y + pb->r1 : (s32) ren.sc_y1 - 1);
+	return (rect[0] <= rect[2] && rect[1] <= rect[3]);
+}
+
+
+/*
+ * Projects a chunk of the batch with SSE (vec3_projectSoA) and counts the
+ * splats that fall in each screen tile, for this chunk
+ */
+static void
+_gfxPointProject(void *data, u32 chunk)
+{
+	const PointBatch *pb = (const PointBatch*) data;
+	const u32 i0 = chunk * POINT_CHUNK;
+	const u32 i1 = (i0 + POINT_CHUNK < pb->count ? i0 + POINT_CHUNK : pb->count);
+	u32 *hist = ren.point_hist + (chunk * pb->tiles);
+	f32 sx[POINT_BLOCK], sy[POINT_BLOCK], sz[POINT_BLOCK], sw[POINT_BLOCK];
+	/*NDC bounds grown by the splat radius and a pixel*/
+	const f32 lim_x = 1.0f + ((f32) (2 * (pb->r1 + 1)) / (f32) (ren.vp_w > 1 ? ren.vp_w - 1 : 1));
+	const f32 lim_y = 1.0f + ((f32) (2 * (pb->r1 + 1)) / (f32) (ren.vp_h > 1 ? ren.vp_h - 1 : 1));
+
+	memset(hist, 0, pb->tiles * sizeof(u32));
+	for (u32 b = i0; b < i1; b += POINT_BLOCK) {
+		const u32 n = (b + POINT_BLOCK < i1 ? POINT_BLOCK : i1 - b);
+		vec3_projectSoA(sx, sy, sz, sw, pb->mvp, pb->x + b, pb->y + b, pb->z + b, n);
+		/*
+		 * Pixel positions as PIXW and PIXH, kept while the splat can overlap the
+		 * DisplayRect and with x at -POINT_TILE if behind the camera or out of it
+		 */
+		u32 k = 0;
+#ifdef __SSE__
+		const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+		const __m128 lx = _mm_set1_ps(lim_x), ly = _mm_set1_ps(lim_y);
+		const __m128 sw_x = _mm_set1_ps((f32) (ren.vp_w - 1)), sw_y = _mm_set1_ps((f32) (ren.vp_h - 1));
+		const __m128 vx = _mm_set1_ps((f32) ren.vp_x), vy = _mm_set1_ps((f32) ren.vp_y);
+		for (; k + 4 <= n; k += 4) {
+			__m128 x = _mm_loadu_ps(sx + k), y = _mm_loadu_ps(sy + k);
+			__m128 in = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(_mm_loadu_ps(sw + k), zero),
+											  _mm_and_ps(_mm_cmpge_ps(x, _mm_sub_ps(zero, lx)), _mm_cmple_ps(x, lx))),
+								   _mm_and_ps(_mm_cmpge_ps(y, _mm_sub_ps(zero, ly)), _mm_cmple_ps(y, ly)));
+			x = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(x, one), half), sw_x), vx);
+			y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, y), half), sw_y), vy);
+			_mm_storeu_ps(sx + k, _mm_or_ps(_mm_and_ps(in, x), _mm_andnot_ps(in, _mm_set1_ps(-(f32) POINT_TILE))));
+			_mm_storeu_ps(sy + k, y);
+		}
+#endif
+		for (; k < n; ++k) {
+			bint in = (sw[k] > 0.0f && sx[k] >= -lim_x && sx[k] <= lim_x && sy[k] >= -lim_y && sy[k] <= lim_y);
+			sx[k] = (in ? ((sx[k] + 1.0f) * 0.5f * (ren.vp_w - 1)) + ren.vp_x : -(f32) POINT_TILE);
+			sy[k] = ((1.0f - sy[k]) * 0.5f * (ren.vp_h - 1)) + ren.vp_y;
+		}
+		for (k = 0; k < n; ++k) {
+			PointRec *r = ren.point_rec + b + k;
+			s32 rect[4];
+			r->xy = POINT_CULLED;
+			if (sx[k] <= -(f32) POINT_TILE) {
+				continue;
+			}
+			/*Culled by the splat rect, so the center may be a few pixels out*/
+			s32 x = (s32) floorf(sx[k]), y = (s32) floorf(sy[k]);
+			if (!_gfxPointRect(pb, x, y, rect)) {
+				continue;
+			}
+			r->xy = POINT_XY(x, y);
+			r->z = sz[k];
+			r->color = (pb->color ? pb->color[b + k] : 0xFFFFFFu);
+			POINT_TILES(rect, tx0, ty0, tx1, ty1);
+			if (tx0 == tx1 && ty0 == ty1) {
+				hist[(ty0 * pb->tiles_w) + tx0]++;
+				continue;
+			}
+			for (u32 ty = ty0; ty <= ty1; ++ty) {
+				for (u32 tx = tx0; tx <= tx1; ++tx) {
+					hist[(ty * pb->tiles_w) + tx]++;
+				}
+			}
+		}
+	}
+}
+
+
+/*Copies the splats of a chunk to the bins of their tiles, after those of the previous chunks*/
+static void
+_gfxPointScatter(void *data, u32 chunk)
+{
+	const PointBatch *pb = (const PointBatch*) data;
+	const u32 i0 = chunk * POINT_CHUNK;
+	const u32 i1 = (i0 + POINT_CHUNK < pb->count ? i0 + POINT_CHUNK : pb->count);
+	u32 *ofs = ren.point_hist + (chunk * pb->tiles);
+
+	for (u32 i = i0; i < i1; ++i) {
+		const PointRec *r = ren.point_rec + i;
+		s32 rect[4];
+		if (r->xy == POINT_CULLED) {
+			continue;
+		}
+		_gfxPointRect(pb, POINT_X(r->xy), POINT_Y(r->xy), rect);
+		POINT_TILES(rect, tx0, ty0, tx1, ty1);
+		for (u32 ty = ty0; ty <= ty1; ++ty) {
+			for (u32 tx = tx0; tx <= tx1; ++tx) {
+				ren.point_bin[ofs[(ty * pb->tiles_w) + tx]++] = *r;
+			}
+		}
+	}
+}
+
+
+/*
+ * Draws the splats binned in a screen tile, in the order they were given. No
+ * other job writes the pixels of the tile, so the depth test needs no atomics.
+ */
+static void
+_gfxPointSplat(void *data, u32 tile)
+{
+	const PointBatch *pb = (const PointBatch*) data;
+	const s32 tx0 = (s32) (ren.vp_x + ((tile % pb->tiles_w) * POINT_TILE));
+	const s32 ty0 = (s32) (ren.vp_y + ((tile / pb->tiles_w) * POINT_TILE));
+	const s32 tx1 = tx0 + POINT_TILE - 1, ty1 = ty0 + POINT_TILE - 1;
+
+	/*Single pixels are always in their tile*/
+	if (pb->r1 == 0 && !ren.msaa && ren.lighting_mode != GFX_LIGHT_DEFERRED) {
+		for (u32 i = ren.point_ofs[tile]; i < ren.point_ofs[tile + 1]; ++i) {
+			const PointRec *r = ren.point_bin + i;
+			const u32 offset = PIX_ROW((u32) POINT_Y(r->xy)) + PIX_COL((u32) POINT_X(r->xy));
+			if (ren.depth_test) {
+				if (r->z < 0.0f || ren.zbuff[offset] < r->z) {
+					continue;
+				}
+				ren.zbuff[offset] = r->z;
+			}
+			ren.pix[offset] = r->color;
+		}
+		return;
+	}
+	for (u32 i = ren.point_ofs[tile]; i < ren.point_ofs[tile + 1]; ++i) {
+		const PointRec *r = ren.point_bin + i;
+		s32 rect[4];
+		_gfxPointRect(pb, POINT_X(r->xy), POINT_Y(r->xy), rect);
+		rect[0] = (rect[0] > tx0 ? rect[0] : tx0);
+		rect[1] = (rect[1] > ty0 ? rect[1] : ty0);
+		rect[2] = (rect[2] < tx1 ? rect[2] : tx1);
+		rect[3] = (rect[3] < ty1 ? rect[3] : ty1);
+		for (s32 y = rect[1]; y <= rect[3]; ++y) {
+			const u32 row = PIX_ROW((u32) y);
+			for (s32 x = rect[0]; x <= rect[2]; ++x) {
+				_gfxLinePixel(row + PIX_COL((u32) x), r->z, r->color);
+			}
+		}
+	}
+}
+
+
+/*
+ * Draws count points (positions in SoA, transformed by mvp) as square splats
+ * of GFX_POINT_SIZE pixels. Each batch is projected and binned in screen tiles
+ * by chunks in parallel, then the tiles are splatted in parallel.
+ */
+static void
+_gfxDrawPoints(const f32 *x, const f32 *y, const f32 *z, const u32 *color, u32 count, const mat4 mvp)
+{
+	PointBatch pb;
+
+	if (count == 0 || ren.sc_x0 >= ren.sc_x1 || ren.sc_y0 >= ren.sc_y1) {
+		return;
+	}
+	pb.mvp = mvp;
+	pb.tiles_w = (ren.vp_w + POINT_TILE - 1) / POINT_TILE;
+	pb.tiles = pb.tiles_w * ((ren.vp_h + POINT_TILE - 1) / POINT_TILE);
+	pb.r0 = (s32) (ren.point_size - 1) / 2;
+	pb.r1 = (s32) ren.point_size / 2;
+	/*Scratch for a full batch, kept for the next draws*/
+	const u32 batch = (count < POINT_BATCH ? count : POINT_BATCH);
+	const u32 hist_size = ((batch + POINT_CHUNK - 1) / POINT_CHUNK) * pb.tiles;
+	if (ren.point_rec_size < batch) {
+		free(ren.point_rec);
+		ren.point_rec_size = batch;
+		ren.point_rec = (PointRec*) malloc(batch * sizeof(PointRec));
+	}
+	if (ren.point_hist_size < hist_size + pb.tiles + 1) {
+		free(ren.point_hist);
+		ren.point_hist_size = hist_size + pb.tiles + 1;
+		ren.point_hist = (u32*) malloc(ren.point_hist_size * sizeof(u32));
+	}
+	ren.point_ofs = ren.point_hist + hist_size;
+	/*Samples expanded by a splat are listed, which is not thread safe*/
+	const bint serial = (ren.msaa && ren.lighting_mode != GFX_LIGHT_DEFERRED);
+
+	for (u32 b = 0; b < count; b += POINT_BATCH) {
+		pb.x = x + b;
+		pb.y = y + b;
+		pb.z = z + b;
+		pb.color = (color ? color + b : NULL);
+		pb.count = (count - b < POINT_BATCH ? count - b : POINT_BATCH);
+		const u32 chunks = (pb.count + POINT_CHUNK - 1) / POINT_CHUNK;
+		gfxJobParallel(_gfxPointProject, &pb, chunks);
+		/*Bins of the tiles in order, each split by chunk*/
+		u32 sum = 0;
+		for (u32 t = 0; t < pb.tiles; ++t) {
+			ren.point_ofs[t] = sum;
+			for (u32 c = 0; c < chunks; ++c) {
+				u32 n = ren.point_hist[(c * pb.tiles) + t];
+				ren.point_hist[(c * pb.tiles) + t] = sum;
+				sum += n;
+			}
+		}
+		ren.point_ofs[pb.tiles] = sum;
+		if (ren.point_bin_size < sum) {
+			free(ren.point_bin);
+			ren.point_bin_size = sum + (sum >> 3);
+			ren.point_bin = (PointRec*) malloc(ren.point_bin_size * sizeof(PointRec));
+		}
+		gfxJobParallel(_gfxPointScatter, &pb, chunks);
+		if (serial) {
+			for (u32 t = 0; t < pb.tiles; ++t) {
+				_gfxPointSplat(&pb, t);
+			}
+		} else {
+			gfxJobParallel(_gfxPointSplat, &pb, pb.tiles);
+		}
+	}
+}
+
+
+/*
+ * Draws a point cloud: count positions in SoA and their colors as the display
+ * stores them (0x00BBGGRR, NULL for white), unlit. Each point is a square
+ * splat of GFX_POINT_SIZE pixels, depth tested.
+ */
+void
+gfxDrawPoints(const f32 *x, const f32 *y, const f32 *z, const u32 *color, u32 count,
+			  mat4 proj, mat4 view, mat4 model)
+{
+	mat4 mv, mvp;
+
+	_gfxLightingBegin(proj);
+	ren.serial++;
+	mat4_mul(mv, view, model);
+	mat4_mul(mvp, proj, mv);
+	_gfxDrawPoints(x, y, z, color, count, mvp);
+}
+
+
+/*Interpolation setup of a triangle, for the coarse shading lattice*/
+typedef struct TriLerp_t {
+	const f32*	bar_d0;
+	const f32*	bar_d1;
+	const f32*	bar_0;
+	const f32*	vpos_w;
+	const Vert*	p[3];
+} TriLerp;
+
+
+/*
+ * Phong shading rate of a triangle (area in pixels): the largest block size
+ * whose change of the normals across it stays under the quality threshold.
+ * Triangles under 16 blocks are shaded at a finer rate.
+ */
+static u32
+_gfxShadingRate(const Vert *p0, const Vert *p1, const Vert *p2, f32 area)
+{
+	vec3 n0, n1, n2;
+	if (ren.shading_rate < 2) {
+		return 1;
+	}
+	memcpy(n0, p0->norm, sizeof(vec3));
+	memcpy(n1, p1->norm, sizeof(vec3));
+	memcpy(n2, p2->norm, sizeof(vec3));
+	vec3_normalize(n0);
+	vec3_normalize(n1);
+	vec3_normalize(n2);
+	f32 dev = 1.0f - fminf(vec3_dot(n0, n1), fminf(vec3_dot(n1, n2), vec3_dot(n2, n0)));
+	f32 per_pixel = dev / sqrtf(fmaxf(area, 1.0f));
+	f32 threshold = 0.0004f * (f32) (100 - ren.shading_quality);
+	u32 rate = ren.shading_rate;
+	/*Small triangles would light about as many lattice points as pixels*/
+	while (rate > 1 && (per_pixel * (f32) rate > threshold || area < (f32) (16 * rate * rate))) {
+		rate >>= 1;
+	}
+	return rate;
+}
+
+
+/*
+ * Lighting at count lattice points (pixel x0 + i * rate, y) of a coarse shaded
+ * triangle, the attributes are extrapolated outside of it. Points also in the
+ * previous lattice line (same y) are copied from it.
+ */
+static void
+_gfxLatticeLight(vec3 *out, s32 x0, u32 count, u32 rate, s32 y, const TriLerp *t,
+				 const vec3 *prev, s32 prev_x0, u32 prev_count)
+{
+	f32 pos[3][PHONG_BATCH], norm[3][PHONG_BATCH], light[3][PHONG_BATCH];
+	u32 slot[PHONG_BATCH], n = 0, tile = 0;
+	const f32 fy = y + 0.5f;
+
+	for (u32 i = 0; i <= count; ++i) {
+		s32 x = x0 + (s32) (i * rate);
+		s32 pi = (prev ? (x - prev_x0) / (s32) rate : -1);
+		bint copy = (i < count && prev && x >= prev_x0 && pi < (s32) prev_count);
+		u32 tl = (i < count && !copy ? _gfxLightTile(x, y) : tile);
+		if (n && (i == count || n == PHONG_BATCH || tl != tile)) {
+			_gfxComputeLightingN(light[0], light[1], light[2], pos[0], pos[1], pos[2],
+								 norm[0], norm[1], norm[2], n, tile);
+			for (u32 k = 0; k < n; ++k) {
+				out[slot[k]][0] = light[0][k];
+				out[slot[k]][1] = light[1][k];
+				out[slot[k]][2] = light[2][k];
+			}
+			n = 0;
+		}
+		if (i == count) {
+			break;
+		}
+		if (copy) {
+			memcpy(out[i], prev[pi], sizeof(vec3));
+			continue;
+		}
+		tile = tl;
+		/*Barycentric coordinates without clamping, unless the extrapolation goes behind the camera*/
+		vec3 bar, tmp, p_attr, n_attr;
+		vec3_add(bar, vec3_smul(tmp, x + 0.5f, t->bar_d0), t->bar_0);
+		vec3_add(bar, bar, vec3_smul(tmp, fy, t->bar_d1));
+		bar[2] = 1.0f - bar[0] - bar[1];
+		f32 w0 = bar[0] * t->vpos_w[0], w1 = bar[1] * t->vpos_w[1], w2 = bar[2] * t->vpos_w[2];
+		if (!(w0 + w1 + w2 > 0.0f)) {
+			vec3_clamp(bar, 0.0f, 1.0f);
+			bar[2] = 1.0f - bar[0] - bar[1];
+			w0 = bar[0] * t->vpos_w[0], w1 = bar[1] * t->vpos_w[1], w2 = bar[2] * t->vpos_w[2];
+		}
+		f32 inv_p = 1.0f / (w0 + w1 + w2);
+		vec3_lerpAttr(p_attr, w0, t->p[0]->pos, w1, t->p[1]->pos, w2, t->p[2]->pos, inv_p);
+		vec3_lerpAttr(n_attr, w0, t->p[0]->norm, w1, t->p[1]->norm, w2, t->p[2]->norm, inv_p);
+		for (u32 k = 0; k < 3; ++k) {
+			pos[k][n] = p_attr[k];
+			norm[k][n] = n_attr[k];
+		}
+		slot[n++] = i;
+	}
+}
+
+
+/*
+ * Rotated grid positions of the 4 MSAA samples in a pixel, the pixel center
+ * is at (0.5, 0.5) as in the spans.
+ */
+static const f32 msaa_pos[4][2] = {{0.375f, 0.125f}, {0.875f, 0.375f}, {0.125f, 0.625f}, {0.625f, 0.875f}};
+
+/*Barycentric coordinates and depth of each MSAA sample relative to the pixel corner*/
+static void
+_gfxMsaaSetup(f32 step[4][4], const vec3 bar_d0, const vec3 bar_d1, const vec3 vpos_z)
+{
+	for (u32 k = 0; k < 4; ++k) {
+		for (u32 i = 0; i < 3; ++i) {
+			step[k][i] = (msaa_pos[k][0] * bar_d0[i]) + (msaa_pos[k][1] * bar_d1[i]);
+		}
+		step[k][3] = vec3_dot(step[k], vpos_z);
+	}
+}
+
+
+/*
+ * Tests the coverage and depth of the 4 samples of a pixel, from the
+ * barycentric coordinates and depth of its corner. Writes the depth of the
+ * samples passing (unless write is FALSE) and returns their mask.
+ */
+static inline u32
+_gfxMsaaCover(u32 off, const f32 corner[4], f32 step[4][4], bint write)
+{
+	f32 *sz = ren.msaa_z + (off << 2);
+	u32 mask = 0;
+	for (u32 k = 0; k < 4; ++k) {
+		/*
+		 * Small tolerance, samples on an edge shared by two triangles are not
+		 * missed by both. Degenerate triangles give NaN and cover nothing.
+		 */
+		if (!(corner[0] + step[k][0] >= -1e-5f && corner[1] + step[k][1] >= -1e-5f &&
+			  corner[2] + step[k][2] >= -1e-5f)) {
+			continue;
+		}
+		if (ren.depth_test) {
+			const f32 z = corner[3] + step[k][3];
+			if (z < 0.0f || sz[k] < z) {
+				continue;
+			}
+			sz[k] = (write ? z : sz[k]);
+		}
+		mask |= 1u << k;
+	}
+	return mask;
+}
+
+
+/*Draws a triangle*/
+void
+_triangle(Vert *p0, Vert *p1, Vert *p2, mat4 proj, Tex *tex)
+{
+	Vert *tmp_swap;
+	vec4 spv0, spv1, spv2;
+	f32 *sp0 = spv0, *sp1 = spv1, *sp2 = spv2, *tmp_v;
+
+	/*Screen space transform */
+	sp0[3] = 1.0f / vec3_mat4MulStandard(sp0, proj, p0->pos);
+	sp1[3] = 1.0f / vec3_mat4MulStandard(sp1, proj, p1->pos);
+	sp2[3] = 1.0f / vec3_mat4MulStandard(sp2, proj, p2->pos);
+	vec3_smul(sp0, sp0[3], sp0);
+	vec3_smul(sp1, sp1[3], sp1);
+	vec3_smul(sp2, sp2[3], sp2);
+	/*Check if its front facing*/
+	f32 area = edge_func(sp0[0], sp0[1], sp1[0], sp1[1], sp2[0], sp2[1]);
+	if (!(area > 0.0f)) {
+		return;
+	}
+
+	/* Order p from highest to lowest y value (p0=highest)*/
+	if (sp0[1] < sp1[1]) {
+		tmp_swap = p0;
+		p0 = p1;
+		p1 = tmp_swap;
+		tmp_v = sp0;
+		sp0 = sp1;
+		sp1 = tmp_v;
+	}
+	if (sp1[1] < sp2[1]) {
+		tmp_swap = p1;
+		p1 = p2;
+		p2 = tmp_swap;
+		tmp_v = sp1;
+		sp1 = sp2;
+		sp2 = tmp_v;
+	}
+	if (sp0[1] < sp1[1]) {
+		tmp_swap = p0;
+		p0 = p1;
+		p1 = tmp_swap;
+		tmp_v = sp0;
+		sp0 = sp1;
+		sp1 = tmp_v;
+	}
+	/*Display space transform*/
+	sp0[0] = PIXW(sp0[0]), sp0[1] = PIXH(sp0[1]);
+	sp1[0] = PIXW(sp1[0]), sp1[1] = PIXH(sp1[1]);
+	sp2[0] = PIXW(sp2[0]), sp2[1] = PIXH(sp2[1]);
+	/*Compute spans of triangle depending on midle point location*/
+	bint cmp = edge_func(sp0[0], sp0[1], sp2[0], sp2[1], sp1[0], sp1[1]) > 0.0;
+	_gfxSpanCompute(sp0[0], sp0[1], sp1[0], sp1[1], !cmp);
+	_gfxSpanCompute(sp0[0], sp0[1], sp2[0], sp2[1], cmp);
+	_gfxSpanCompute(sp1[0], sp1[1], sp2[0], sp2[1], !cmp);
+
+	/*Precompute perspective correction*/
+	const f32 d = 1.0f / ((sp0[0] - sp2[0])*(sp1[1] - sp0[1]) - (sp0[0] - sp1[0])*(sp2[1] - sp0[1]));
+	const vec3 bar_d0 = {(sp1[1] - sp2[1])*d, (sp2[1] - sp0[1])*d, (sp0[1] - sp1[1])*d};
+	const vec3 bar_d1 = {(sp2[0] - sp1[0])*d, (sp0[0] - sp2[0])*d, (sp1[0] - sp0[0])*d};
+	const vec3 bar_0  = {(sp1[0]*sp2[1] - sp2[0]*sp1[1]) * d, (sp2[0]*sp0[1] - sp0[0]*sp2[1]) * d, (sp0[0]*sp1[1] - sp1[0]*sp0[1]) * d};
+	const vec3 vpos_z = {sp0[2], sp1[2], sp2[2]};
+	const vec3 vpos_w = {sp0[3], sp1[3], sp2[3]};
+	/*GOURAUD SHADING if active*/
+	if (ren.lighting_mode == GFX_LIGHT_GOURAUD) {
+		vec3 tmp;
+		_gfxComputeLighting(tmp, p0->pos, p0->norm, _gfxLightTile((s32) sp0[0], (s32) sp0[1]));
+		vec3_mul(p0->color, tmp, p0->color);
+		vec3_clamp(p0->color, 0.0f, 1.0f);
+		_gfxComputeLighting(tmp, p1->pos, p1->norm, _gfxLightTile((s32) sp1[0], (s32) sp1[1]));
+		vec3_mul(p1->color, tmp, p1->color);
+		vec3_clamp(p1->color, 0.0f, 1.0f);
+		_gfxComputeLighting(tmp, p2->pos, p2->norm, _gfxLightTile((s32) sp2[0], (s32) sp2[1]));
+		vec3_mul(p2->color, tmp, p2->color);
+		vec3_clamp(p2->color, 0.0f, 1.0f);
+	}
+
+	/*
+	 * Transparent fragments are depth tested without writing the depth, and lit
+	 * here in deferred mode as the G-buffer has no room for them
+	 */
+	const bint oit = ren.transparency && ren.oit_accum != NULL;
+	const u32 lighting = (oit && ren.lighting_mode == GFX_LIGHT_DEFERRED ? GFX_LIGHT_PHONG : _gfxDrawLighting());
+
+	/*Iterate spans to render inside triangle*/
+	PhongBatch batch;
+	batch.count = 0;
+	batch.mtrl = 0;
+	batch.blend = oit;
+	const u32 y_last = (ren.sc_y1 < ren.vp_y + ren.vp_h ? ren.sc_y1 : ren.vp_y + ren.vp_h - 1);
+	const u32 y_begin = clamp(sp0[1], ren.sc_y0, y_last);
+	const u32 y_end = clamp(sp2[1], ren.sc_y0, y_last);
+	/*MSAA, the G-buffer keeps a single sample*/
+	const bint msaa = ren.msaa && ren.lighting_mode != GFX_LIGHT_DEFERRED;
+	const u32 x_last = (ren.sc_x1 < ren.vp_x + ren.vp_w ? ren.sc_x1 : ren.vp_x + ren.vp_w - 1);
+	f32 msaa_step[4][4];
+	if (msaa) {
+		_gfxMsaaSetup(msaa_step, bar_d0, bar_d1, vpos_z);
+	}
+
+	/*Coarse Phong shading, lighting on a lattice of rate pixels interpolated inside each block*/
+	const u32 rate = (lighting == GFX_LIGHT_PHONG && !msaa ? _gfxShadingRate(p0, p1, p2, 0.5f / fabsf(d)) : 1);
+	const f32 inv_rate = 1.0f / (f32) rate;
+	const TriLerp tl = {bar_d0, bar_d1, bar_0, vpos_w, {p0, p1, p2}};
+	vec3 *lat_top = ren.lattice, *lat_bot = ren.lattice + (ren.max_w + 2), *lat_prev = NULL;
+	vec3 *lat_free = ren.lattice + 2 * (ren.max_w + 2);
+	s32 lat_x0 = 0, prev_x0 = 0;
+	u32 lat_count = 0, block_y = 0;
+	//#pragma omp parallel for
+	//printf("tri: %d %d\n", y_begin, y_end);
+	for (u32 y = y_begin; y < y_end; ++y) {
+		vec3 pos_attr, col_attr, norm_attr, tmp;
+		vec4 texel;
+		vec2 tex_attr;
+		u32 x = ren.spans[y].x[0];
+		u32 xend = ren.spans[y].x[1];
+		u32 ln = PIX_ROW(y);
+		if (msaa) {
+			/*The pixels touched go from the span of the row to the span below it, one more on each side*/
+			u32 bx0 = ren.sc_x0, bx1 = x_last;
+			if ((f32) (y + 1) >= sp2[1]) {
+				/*Bottom vertex, or bottom edge when the middle vertex is as low*/
+				f32 ex = (sp1[1] >= sp2[1] ? sp1[0] : sp2[0]);
+				bx0 = (u32) clamp(ceilf(fminf(ex, sp2[0])), ren.sc_x0, x_last);
+				bx1 = (u32) clamp(ceilf(fmaxf(ex, sp2[0])), ren.sc_x0, x_last);
+			} else if (y + 1 < ren.sc_y1) {
+				bx0 = ren.spans[y + 1].x[0], bx1 = ren.spans[y + 1].x[1];
+			}
+			x = (bx0 < x ? bx0 : x);
+			xend = (bx1 > xend ? bx1 : xend);
+			x = (x > ren.sc_x0 ? x - 1 : x);
+			xend = (xend < x_last ? xend + 1 : xend);
+		}
+		if (oit && x < xend) {
+			ren.oit_rect[0] = (x < ren.oit_rect[0] ? x : ren.oit_rect[0]);
+			ren.oit_rect[1] = (y < ren.oit_rect[1] ? y : ren.oit_rect[1]);
+			ren.oit_rect[2] = (xend > ren.oit_rect[2] ? xend : ren.oit_rect[2]);
+			ren.oit_rect[3] = (y + 1 > ren.oit_rect[3] ? y + 1 : ren.oit_rect[3]);
+		}
+		if (rate > 1 && (y == y_begin || y % rate == 0)) {
+			/*New block row, lattice lines above and below it over the spans of its rows*/
+			u32 xmin = ren.max_w, xmax = 0, prev_count = lat_count;
+			block_y = y - (y % rate);
+			for (u32 r = y; r < block_y + rate && r < y_end; ++r) {
+				if (ren.spans[r].x[0] < ren.spans[r].x[1]) {
+					/*Spans are clamped to the viewport, so never negative*/
+					const u32 x0 = (u32) ren.spans[r].x[0], x1 = (u32) ren.spans[r].x[1] - 1;
+					xmin = (x0 < xmin ? x0 : xmin);
+					xmax = (x1 > xmax ? x1 : xmax);
+				}
+			}
+			if (xmin > xmax) {
+				xmin = xmax = 0;
+			}
+			/*The old bottom line is the new top line*/
+			if (y != y_begin) {
+				lat_prev = lat_bot;
+				prev_x0 = lat_x0;
+				lat_bot = lat_top;
+				lat_top = lat_free;
+				lat_free = lat_prev;
+			}
+			lat_x0 = (s32) (xmin - (xmin % rate));
+			lat_count = ((xmax - (u32) lat_x0) / rate) + 2;
+			_gfxLatticeLight(lat_top, lat_x0, lat_count, rate, (s32) block_y, &tl, lat_prev, prev_x0, prev_count);
+			_gfxLatticeLight(lat_bot, lat_x0, lat_count, rate, (s32) (block_y + rate), &tl, NULL, 0, 0);
+		}
+		for (; x < xend; ++x) {
+			vec3 bar;
+			f32 fx = x + 0.5f, fy = y + 0.5f;
+			/*Get barycentric coordinates*/
+			vec3_add(bar, vec3_smul(tmp, fx, bar_d0), bar_0);
+			vec3_add(bar, bar, vec3_smul(tmp, fy, bar_d1));
+			vec3_clamp(bar, 0.0f, 1.0f);
+			bar[2] = 1.0f - bar[0] - bar[1];
+
+			/*clip z in [0, 1]*/
+			const u32 off = ln + PIX_COL(x);
+			f32 z = vec3_dot(bar, vpos_z);
+			f32 curr_z = ren.zbuff[off];
+			u32 mask = 0;
+			if (msaa) {
+				/*Coverage and depth per sample, the rest once for the pixel*/
+				f32 corner[4];
+				for (u32 k = 0; k < 3; ++k) {
+					corner[k] = bar_0[k] + ((f32) x * bar_d0[k]) + ((f32) y * bar_d1[k]);
+				}
+				corner[3] = vec3_dot(corner, vpos_z);
+				mask = _gfxMsaaCover(off, corner, msaa_step, !oit);
+				if (!mask) {
+					continue;
+				}
+			} else if (ren.depth_test) {
+				if (z < 0.0f || curr_z < z) {
+					continue;
+				}
+			}
+			/*Precompute perspective correction for interpolation*/
+			f32 w0 = bar[0] * vpos_w[0];
+			f32 w1 = bar[1] * vpos_w[1];
+			f32 w2 = bar[2] * vpos_w[2];
+			f32 inv_p = 1.0f / (w0 + w1 + w2);
+
+			/*interpolate face color*/
+			vec3_lerpAttr(col_attr, w0, p0->color, w1, p1->color, w2, p2->color, inv_p);
+			f32 alpha = (oit ? ((w0 * p0->color[3]) + (w1 * p1->color[3]) + (w2 * p2->color[3])) * inv_p : 1.0f);
+			/*Apply texture to face (none while it is still loading)*/
+			if (tex != NULL) {
+				vec2_lerpAttr(tex_attr,  w0, p0->tex, w1, p1->tex, w2, p2->tex, inv_p);
+				_gfxSampleTex(texel, tex, tex_attr);
+				vec3_mul(col_attr, texel, col_attr);
+				alpha *= texel[3];
+			}
+			if (oit) {
+				/*Partly covered MSAA pixels take the covered part of the alpha*/
+				if (msaa) {
+					alpha *= (f32) ((mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + (mask >> 3)) * 0.25f;
+				}
+				alpha = clamp(alpha, 0.0f, 1.0f);
+				if (!(alpha > 0.0f)) {
+					continue;
+				}
+			}
+
+			/*DEFERRED SHADING, the G-buffer is lit by gfxDeferredResolve*/
+			if (lighting == GFX_LIGHT_DEFERRED) {
+				vec3_lerpAttr(norm_attr, w0, p0->norm, w1, p1->norm, w2, p2->norm, inv_p);
+				_gfxGBufferWrite(off, z, col_attr, norm_attr);
+				continue;
+			}
+
+			/*PHONG SHADING if active, lit in batches or coarse*/
+			if (lighting == GFX_LIGHT_PHONG && rate > 1) {
+				/*Bilinear lighting from the lattice around the pixel*/
+				u32 lx = x - (u32) lat_x0, i = lx / rate;
+				f32 fx = (f32) (lx - (i * rate)) * inv_rate, fy = (f32) (y - block_y) * inv_rate;
+				for (u32 k = 0; k < 3; ++k) {
+					f32 top = lerp(lat_top[i][k], lat_top[i + 1][k], fx);
+					f32 bot = lerp(lat_bot[i][k], lat_bot[i + 1][k], fx);
+					col_attr[k] *= lerp(top, bot, fy);
+				}
+			} else if (lighting == GFX_LIGHT_PHONG) {
+				u32 tile = _gfxLightTile((s32) x, (s32) y);
+				if (batch.count && batch.tile != tile) {
+					_gfxPhongFlush(&batch);
+				}
+				u32 n = batch.count++;
+				batch.tile = tile;
+				vec3_lerpAttr(pos_attr, w0, p0->pos, w1, p1->pos, w2, p2->pos, inv_p);
+				vec3_lerpAttr(norm_attr, w0, p0->norm, w1, p1->norm, w2, p2->norm, inv_p);
+				batch.off[n] = off;
+				batch.z[n] = (oit ? inv_p : z);
+				batch.mask[n] = (u8) (oit ? 0 : mask);
+				batch.alpha[n] = alpha;
+				for (u32 k = 0; k < 3; ++k) {
+					batch.col[k][n] = col_attr[k];
+					batch.pos[k][n] = pos_attr[k];
+					batch.norm[k][n] = norm_attr[k];
+				}
+				if (batch.count == PHONG_BATCH) {
+					_gfxPhongFlush(&batch);
+				}
+				continue;
+			}
+			vec3_clamp(col_attr, 0.0f, 1.0f);
+			if (oit) {
+				_gfxOitAdd(off, col_attr, alpha, inv_p);
+				continue;
+			}
+
+			/*Draw pixel and update z-buffer*/
+			if (msaa) {
+				_gfxMsaaWrite(off, mask, vec3_toRGB(col_attr));
+				continue;
+			}
+			ren.zbuff[off] = (ren.depth_test ? z : curr_z);
+			ren.pix[off] = vec3_toRGB(col_attr);
+			if (ren.gforward) {
+				ren.galbedo[off] = 0;
+			}
+		}
+	}
+	if (batch.count) {
+		_gfxPhongFlush(&batch);
+	}
+}
+
+
+void
+gfxDraw(u32 prim_type, Vert *v_arr, u32 count, mat4 proj, mat4 view, mat4 model, Tex *tex)
+{
+	mat4 mv;
+	mat3 normat;
 
-	gfxMaterialSet(&msh->mtrl);
 	/*Check primitive type*/
-	mat4_mul(mv, view, msh->model);
+	if (prim_type - 1 > 2) {
+		return;
+	}
+	_gfxLightingBegin(proj);
+	ren.serial++;
+	mat4_mul(mv, view, model);
 	mat4_normalMatrix(normat, mv);
 
-	u32 count = msh->indx_count - (msh->indx_count % 3);
-	if (count < 3) {
+	/*Obtain matrix for first camera*/
+	switch(prim_type) {
+	case GFX_POINT: {
+		/*The G-buffer is lit per pixel, so deferred points are written one by one*/
+		if (ren.lighting_mode == GFX_LIGHT_DEFERRED) {
+			for (u32 i = 0; i < count; ++i) {
+				Vert p = v_arr[i];
+				vec3_mat4Mul(p.pos, mv, p.pos);
+				vec3_matMul(p.norm, normat, p.norm);
+				_point(&p, proj);
+			}
+			break;
+		}
+		/*Else lit here and drawn as a point cloud in view space*/
+		f32 *pos = (f32*) malloc(count * 3 * sizeof(f32));
+		u32 *color = (u32*) malloc(count * sizeof(u32));
+		for (u32 i = 0; i < count; ++i) {
+			Vert p = v_arr[i];
+			vec3_mat4Mul(p.pos, mv, p.pos);
+			if (ren.lighting_mode) {
+				vec3 sp, tmp;
+				vec3_matMul(p.norm, normat, p.norm);
+				f32 inv_w = 1.0f / vec3_mat4MulStandard(sp, proj, p.pos);
+				_gfxComputeLighting(tmp, p.pos, p.norm,
+									_gfxLightTile((s32) PIXW(sp[0] * inv_w), (s32) PIXH(sp[1] * inv_w)));
+				vec3_mul(p.color, tmp, p.color);
+			}
+			vec3_clamp(p.color, 0.0f, 1.0f);
+			pos[i] = p.pos[0];
+			pos[count + i] = p.pos[1];
+			pos[(2 * count) + i] = p.pos[2];
+			color[i] = vec3_toRGB(p.color);
+		}
+		_gfxDrawPoints(pos, pos + count, pos + (2 * count), color, count, proj);
+		free(color);
+		free(pos);
+	} break;
+	case GFX_LINE: {
+		count -= count % prim_type;
+		/*Draw all lines*/
+		for (u32 i = 0; i < count; i += 2) {
+			Vert p[2] = {v_arr[i], v_arr[i+1]};
+			vec3_mat4Mul(p[0].pos, mv, p[0].pos);
+			vec3_mat4Mul(p[1].pos, mv, p[1].pos);
+			if (ren.lighting_mode) {
+				vec3_matMul(p[0].norm, normat, p[0].norm);
+				vec3_matMul(p[1].norm, normat, p[1].norm);
+			}
+			_line(p, p + 1, proj);
+		}
+	} break;
+	case GFX_TRIANGLE: {
+		count -= count % prim_type;
+		/*Draw all Triangles*/
+		for (u32 i = 0; i < count; i += 3) {
+			Vert p[3] = {v_arr[i], v_arr[i+1], v_arr[i+2]};
+			vec3_mat4Mul(p[0].pos, mv, p[0].pos);
+			vec3_mat4Mul(p[1].pos, mv, p[1].pos);
+			vec3_mat4Mul(p[2].pos, mv, p[2].pos);
+			if (ren.lighting_mode) {
+				vec3_matMul(p[0].norm, normat, p[0].norm);
+				vec3_matMul(p[1].norm, normat, p[1].norm);
+				vec3_matMul(p[2].norm, normat, p[2].norm);
+			}
+			_triangle(p, p + 1, p + 2, proj, tex);
+		}
+	} break;
+	}
+}
+
+
+/*Lights the G-buffer pixels of one screen tile (the same tiles as the point lights)*/
+static void
+_gfxResolveTile(void *data, u32 tile)
+{
+	const f32 *inv_proj = (const f32*) data;
+	const u32 tiles_w = (ren.vp_w + GFX_LIGHT_TILE - 1) / GFX_LIGHT_TILE;
+	const u32 x0 = ren.vp_x + ((tile % tiles_w) * GFX_LIGHT_TILE);
+	const u32 y0 = ren.vp_y + ((tile / tiles_w) * GFX_LIGHT_TILE);
+	const u32 x1 = (x0 + GFX_LIGHT_TILE < ren.vp_x + ren.vp_w ? x0 + GFX_LIGHT_TILE : ren.vp_x + ren.vp_w);
+	const u32 y1 = (y0 + GFX_LIGHT_TILE < ren.vp_y + ren.vp_h ? y0 + GFX_LIGHT_TILE : ren.vp_y + ren.vp_h);
+	PhongBatch batch;
+	batch.count = 0;
+	batch.mtrl = 0;
+	batch.blend = FALSE;
+	batch.tile = _gfxLightTile((s32) x0, (s32) y0);
+
+	for (u32 y = y0; y < y1; ++y) {
+		for (u32 x = x0; x < x1; ++x) {
+			u32 offset = PIX_ROW(y) + PIX_COL(x);
+			u32 albedo = ren.galbedo[offset];
+			u32 mtrl = albedo >> 24;
+			if (mtrl == 0) {
+				continue;
+			}
+			if (batch.count && batch.mtrl != mtrl) {
+				_gfxPhongFlush(&batch);
+			}
+			/*View space position from the screen position and depth*/
+			vec3 ndc = {COORDX(x + 0.5f), COORDY(y + 0.5f), ren.gdepth[offset]}, pos, norm;
+			f32 inv_w = 1.0f / vec3_mat4MulStandard(pos, inv_proj, ndc);
+			_gfxOctUnpack(norm, ren.gnorm[offset]);
+
+			u32 n = batch.count++;
+			batch.mtrl = mtrl;
+			batch.off[n] = offset;
+			batch.mask[n] = 0;
+			for (u32 k = 0; k < 3; ++k) {
+				batch.col[k][n] = ((albedo >> (k * 8)) & 0xFF) * (1.0f / 255.0f);
+				batch.pos[k][n] = pos[k] * inv_w;
+				batch.norm[k][n] = norm[k];
+			}
+			if (batch.count == PHONG_BATCH) {
+				_gfxPhongFlush(&batch);
+			}
+		}
+	}
+	if (batch.count) {
+		_gfxPhongFlush(&batch);
+	}
+}
+
+
+/*
+ * Lights the G-buffer written by the draws in GFX_LIGHT_DEFERRED mode since
+ * the last gfxClear, once per pixel and in parallel over screen tiles. The
+ * positions are rebuilt with the projection of the first deferred draw, the
+ * draws with another projection were lit forward instead.
+ */
+void
+gfxDeferredResolve(void)
+{
+	mat4 inv_proj;
+
+	if (ren.galbedo == NULL || ren.vp_w == 0 || ren.vp_h == 0) {
+		return;
+	}
+	mat4_identity(inv_proj);
+	mat4_inverse(inv_proj, ren.gproj);
+	/*The last draw may have binned the point lights for another projection, the next ones rebin them*/
+	_gfxLightTilesUpdate(ren.gproj, ren.vp_x, ren.vp_y, ren.vp_w, ren.vp_h);
+	u32 tiles = ((ren.vp_w + GFX_LIGHT_TILE - 1) / GFX_LIGHT_TILE) *
+				((ren.vp_h + GFX_LIGHT_TILE - 1) / GFX_LIGHT_TILE);
+	gfxJobParallel(_gfxResolveTile, inv_proj, tiles);
+	ren.linear_serial = _gfxDisplayKey() - 1;
+}
+
+
+/*Composites the accumulated transparency over the pixels of a band of rows*/
+static void
+_gfxTransparentRows(void *data, u32 band)
+{
+	const u32 *r = ren.oit_rect;
+	const u32 y0 = r[1] + (band * OIT_ROWS);
+	const u32 y1 = (y0 + OIT_ROWS < r[3] ? y0 + OIT_ROWS : r[3]);
+	(void) data;
+	for (u32 y = y0; y < y1; ++y) {
+		const u32 ln = PIX_ROW(y);
+		for (u32 x = r[0]; x < r[2]; ++x) {
+			const u32 off = ln + PIX_COL(x);
+			const f32 reveal = ren.oit_reveal[off];
+			if (reveal >= 1.0f) {
+				continue;
+			}
+			/*Weighted average color of the fragments, covering 1 - revealage of the pixel*/
+			f32 *acc = ren.oit_accum + (off << 2);
+			const f32 s = (1.0f - reveal) * 255.0f / clamp(acc[3], 1e-4f, 5e4f);
+			const f32 add[3] = {acc[0] * s, acc[1] * s, acc[2] * s};
+			/*Expanded MSAA pixels are blended in each sample, as they are resolved later*/
+			const bint expanded = ren.msaa_state != NULL && (ren.msaa_state[off] & MSAA_EXPANDED);
+			u32 *dst = (expanded ? MSAA_COL(ren.msaa_state[off]) : ren.pix + off);
+			for (u32 k = 0; k < (expanded ? 4u : 1u); ++k) {
+				u32 c = 0;
+				for (u32 i = 0; i < 3; ++i) {
+					f32 v = ((f32) ((dst[k] >> (i * 8)) & 0xFF) * reveal) + add[i] + 0.5f;
+					c |= (v < 255.0f ? (u32) v : 255u) << (i * 8);
+				}
+				dst[k] = c;
+			}
+			acc[0] = acc[1] = acc[2] = acc[3] = 0.0f;
+			ren.oit_reveal[off] = 1.0f;
+		}
+	}
+}
+
+
+/*
+ * Composites the triangles drawn with GFX_TRANSPARENCY since the last resolve
+ * (or gfxClear) over the display, and clears them. Called after the opaque
+ * draws and gfxDeferredResolve, in parallel over bands of rows of the pixels
+ * that were touched.
+ */
+void
+gfxTransparentResolve(void)
+{
+	if (ren.oit_accum == NULL || ren.oit_rect[0] >= ren.oit_rect[2] || ren.oit_rect[1] >= ren.oit_rect[3]) {
+		return;
+	}
+	gfxJobParallel(_gfxTransparentRows, NULL, (ren.oit_rect[3] - ren.oit_rect[1] + OIT_ROWS - 1) / OIT_ROWS);
+	ren.oit_rect[0] = ren.oit_rect[1] = 0xFFFFFFFFu;
+	ren.oit_rect[2] = ren.oit_rect[3] = 0;
+	ren.msaa_serial = ren.serial - 1;
+	ren.linear_serial = _gfxDisplayKey() - 1;
+}
+
+
+/*Frustum planes (a, b, c, d) extracted from the projection (view space) or projection * view (world space)*/
+void
+_gfxFrustumPlanes(vec4 planes[6], mat4 proj)
+{
+	for (u32 i = 0; i < 3; ++i) {
+		for (u32 k = 0; k < 4; ++k) {
+			planes[i*2][k]   = proj[(k * 4) + 3] + proj[(k * 4) + i];
+			planes[i*2+1][k] = proj[(k * 4) + 3] - proj[(k * 4) + i];
+		}
+	}
+	for (u32 i = 0; i < 6; ++i) {
+		f32 len = sqrtf(vec3_dot(planes[i], planes[i]));
+		len = (len > 0.0f ? 1.0f / len : 1.0f);
+		planes[i][0] *= len;
+		planes[i][1] *= len;
+		planes[i][2] *= len;
+		planes[i][3] *= len;
+	}
+}
+
+
+/*Checks if the view space sphere is completely outside the frustum*/
+static bint
+_gfxSphereCulled(vec4 planes[6], const vec3 c, f32 r)
+{
+	for (u32 i = 0; i < 6; ++i) {
+		if (vec3_dot(planes[i], c) + planes[i][3] < -r) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+/*Checks if all the triangles of a cluster face away from the camera*/
+static bint
+_gfxConeCulled(MeshCluster *cl, const vec3 vcenter, f32 vradius, mat3 normat, bint ortho)
+{
+	vec3 axis;
+	if (cl->cone_cutoff >= 1.0f) {
+		return FALSE;
+	}
+	vec3_matMul(axis, normat, cl->cone_axis);
+	vec3_normalize(axis);
+	/*Orthographic views look down -z, perspective ones from the origin*/
+	if (ortho) {
+		return -axis[2] >= cl->cone_cutoff;
+	}
+	f32 dist = sqrtf(vec3_dot(vcenter, vcenter));
+	return vec3_dot(vcenter, axis) >= (cl->cone_cutoff * dist) + vradius;
+}
+
+
+/*Converts a half float to float*/
+static inline f32
+_halfToFloat(u16 h)
+{
+	union { f32 f; u32 u; } v;
+	u32 sign = ((u32) h & 0x8000u) << 16;
+	u32 exp = (h >> 10) & 0x1Fu;
+	u32 man = h & 0x3FFu;
+	if (exp == 0) {
+		v.f = (f32) man * (1.0f / 16777216.0f);
+		v.u |= sign;
+	} else if (exp == 31) {
+		v.u = sign | 0x7F800000u | (man << 13);
+	} else {
+		v.u = sign | ((exp + 112) << 23) | (man << 13);
+	}
+	return v.f;
+}
+
+
+/*Decodes the i-th packed vertex of the mesh*/
+static inline void
+_gfxUnpackVert(Vert *out, const Mesh *msh, u32 i)
+{
+	const PackedVert *pv = msh->pvrtx + i;
+	const f32 q = 1.0f / 65535.0f;
+
+	out->pos[0] = msh->bmin[0] + ((msh->bmax[0] - msh->bmin[0]) * (pv->pos[0] * q));
+	out->pos[1] = msh->bmin[1] + ((msh->bmax[1] - msh->bmin[1]) * (pv->pos[1] * q));
+	out->pos[2] = msh->bmin[2] + ((msh->bmax[2] - msh->bmin[2]) * (pv->pos[2] * q));
+	/*Octahedral normal*/
+	f32 x = pv->norm[0] * (1.0f / 32767.0f);
+	f32 y = pv->norm[1] * (1.0f / 32767.0f);
+	f32 z = 1.0f - fabsf(x) - fabsf(y);
+	if (z < 0.0f) {
+		f32 ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	out->norm[0] = x;
+	out->norm[1] = y;
+	out->norm[2] = z;
+	vec3_normalize(out->norm);
+	out->tex[0] = _halfToFloat(pv->tex[0]);
+	out->tex[1] = _halfToFloat(pv->tex[1]);
+	if (msh->pcolor) {
+		u32 c = msh->pcolor[i];
+		out->color[0] = (c & 0xFF) * (1.0f / 255.0f);
+		out->color[1] = ((c >> 8) & 0xFF) * (1.0f / 255.0f);
+		out->color[2] = ((c >> 16) & 0xFF) * (1.0f / 255.0f);
+		out->color[3] = (c >> 24) * (1.0f / 255.0f);
+	} else {
+		out->color[0] = out->color[1] = out->color[2] = out->color[3] = 1.0f;
+	}
+}
+
+
+/*Fetches the i-th vertex of the mesh (decoding it if packed)*/
+static inline void
+_gfxFetchVert(Vert *out, const Mesh *msh, u32 i)
+{
+	if (msh->pvrtx) {
+		_gfxUnpackVert(out, msh, i);
+	} else {
+		*out = msh->vrtx[i];
+	}
+}
+
+
+/*Fetches the position of the i-th vertex of the mesh (decoding it if packed)*/
+static inline void
+_gfxFetchPos(vec3 out, const Mesh *msh, u32 i)
+{
+	if (msh->pvrtx) {
+		const PackedVert *pv = msh->pvrtx + i;
+		const f32 q = 1.0f / 65535.0f;
+		out[0] = msh->bmin[0] + ((msh->bmax[0] - msh->bmin[0]) * (pv->pos[0] * q));
+		out[1] = msh->bmin[1] + ((msh->bmax[1] - msh->bmin[1]) * (pv->pos[1] * q));
+		out[2] = msh->bmin[2] + ((msh->bmax[2] - msh->bmin[2]) * (pv->pos[2] * q));
+	} else {
+		memcpy(out, msh->vrtx[i].pos, sizeof(vec3));
+	}
+}
+
+
+/*
+ * Draws the unique edges of a mesh level (-1 is the full detail) with the wire
+ * color, their depth moved towards the camera by bias. Each vertex of the level
+ * is projected and tested against the scissor once, so the edges with both ends inside go
+ * straight to the rasterizer and only the ones crossing it are clipped.
+ */
+static void
+_gfxDrawEdges(Mesh *msh, s32 lod, mat4 mv, mat4 proj, f32 bias)
+{
+	mat4 mvp;
+
+	if (msh->edge[0] == NULL) {
+		gfxMeshEdgesBuild(msh);
+	}
+	const u32 *edge = msh->edge[lod + 1];
+	const u32 count = msh->edge_count[lod + 1];
+	const u32 *verts = msh->edge_vert[lod + 1];
+	if (count == 0) {
 		return;
 	}
+	if (ren.wire_size < msh->vrtx_count) {
+		free(ren.wire_vert);
+		ren.wire_size = msh->vrtx_count;
+		ren.wire_vert = (WireVert*) malloc(ren.wire_size * sizeof(WireVert));
+	}
+	mat4_mul(mvp, proj, mv);
+	const f32 x_max = (f32) ren.sc_x1 - (1.0f / 256.0f), y_max = (f32) ren.sc_y1 - (1.0f / 256.0f);
+	/*Only the vertices of the edges, the coarse LODs use few of them*/
+	for (u32 j = 0; j < msh->edge_vert_count[lod + 1]; ++j) {
+		const u32 i = (verts ? verts[j] : j);
+		WireVert *wv = ren.wire_vert + i;
+		vec3 pos;
+		_gfxFetchPos(pos, msh, i);
+		wv->clip[3] = vec3_mat4MulStandard(wv->clip, mvp, pos);
+		if (wv->clip[2] + wv->clip[3] < 0.0f || wv->clip[3] < 1e-5f) {
+			wv->code = WIRE_NEAR;
+			continue;
+		}
+		f32 inv_w = 1.0f / wv->clip[3];
+		wv->s[0] = ((wv->clip[0] * inv_w + 1.0f) * 0.5f * (ren.vp_w - 1)) + ren.vp_x;
+		wv->s[1] = ((1.0f - wv->clip[1] * inv_w) * 0.5f * (ren.vp_h - 1)) + ren.vp_y;
+		wv->s[2] = (wv->clip[2] * inv_w) - bias;
+		wv->code = (wv->s[0] < (f32) ren.sc_x0 ? WIRE_LEFT : 0) | (wv->s[0] > x_max ? WIRE_RIGHT : 0) |
+				   (wv->s[1] < (f32) ren.sc_y0 ? WIRE_TOP : 0) | (wv->s[1] > y_max ? WIRE_BOTTOM : 0);
+	}
+	const bint smooth = _gfxLineSmoothOn();
+	const u32 color = ren.wire_color;
+	for (u32 i = 0; i < count; ++i) {
+		const WireVert *a = ren.wire_vert + edge[2 * i], *b = ren.wire_vert + edge[(2 * i) + 1];
+		f32 s[2][3], t[2];
+		const f32 *sa = a->s, *sb = b->s;
+		bint test = FALSE;
+		if (a->code & b->code) {
+			continue;
+		}
+		if (a->code | b->code) {
+			if (!_gfxLineClip(a->clip, b->clip, s, t)) {
+				continue;
+			}
+			s[0][2] -= bias;
+			s[1][2] -= bias;
+			sa = s[0], sb = s[1];
+			test = TRUE;
+		}
+		if (smooth) {
+			_gfxLineSmooth(sa, sb, color, NULL, test);
+		} else {
+			_gfxLineRaster(sa, sb, color, NULL, test);
+		}
+	}
+}
 
-	/*Draw all Triangles*/
-	//printf("DRAW BEGIN..\n");
+
+/*
+ * Draws indexed triangles of the mesh transforming them with the modelview
+ * matrix, indices are read from indx or from indx16 when it is not NULL
+ */
+static void
+_gfxDrawIndexed(const Mesh *msh, const u32 *indx, const u16 *indx16, u32 count,
+				mat4 mv, mat3 normat, mat4 proj, Tex *tex)
+{
 	for (u32 i = 0; i < count; i += 3) {
-		Vert p[3] = {msh->vrtx[msh->indx[i]],
-					 msh->vrtx[msh->indx[i+1]],
-					 msh->vrtx[msh->indx[i+2]]};
+		Vert p[3];
+		if (indx16) {
+			_gfxFetchVert(p, msh, indx16[i]);
+			_gfxFetchVert(p + 1, msh, indx16[i+1]);
+			_gfxFetchVert(p + 2, msh, indx16[i+2]);
+		} else {
+			_gfxFetchVert(p, msh, indx[i]);
+			_gfxFetchVert(p + 1, msh, indx[i+1]);
+			_gfxFetchVert(p + 2, msh, indx[i+2]);
+		}
 		vec3_mat4Mul(p[0].pos, mv, p[0].pos);
 		vec3_mat4Mul(p[1].pos, mv, p[1].pos);
 		vec3_mat4Mul(p[2].pos, mv, p[2].pos);
@@ -541,3 +2754,436 @@ gfxDrawMesh(Mesh *msh, mat4 proj, mat4 view, Tex *tex)
 		_triangle(p, p + 1, p + 2, proj, tex);
 	}
 }
+
+
+/*Largest scale factor of the modelview matrix*/
+static f32
+_gfxMatScale(mat4 mv)
+{
+	f32 sx = (mv[0] * mv[0]) + (mv[1] * mv[1]) + (mv[2] * mv[2]);
+	f32 sy = (mv[4] * mv[4]) + (mv[5] * mv[5]) + (mv[6] * mv[6]);
+	f32 sz = (mv[8] * mv[8]) + (mv[9] * mv[9]) + (mv[10] * mv[10]);
+	return sqrtf(sx > sy ? (sx > sz ? sx : sz) : (sy > sz ? sy : sz));
+}
+
+
+/*
+ * Selects the coarsest LOD whose error projected with the view space bounding
+ * sphere of the mesh stays under the pixel threshold (-1 is the full mesh)
+ */
+static s32
+_gfxMeshLodSelect(Mesh *msh, mat4 proj, const vec3 vcenter, f32 vradius, f32 scale)
+{
+	if (msh->lod_count == 0 || ren.lod_error == 0) {
+		return -1;
+	}
+	/*Pixels per view space unit at the nearest point of the sphere*/
+	f32 px_unit = proj[5] * 0.5f * ren.vp_h;
+	if (proj[11] != 0.0f) {
+		f32 dist = -vcenter[2] - vradius;
+		if (dist <= 0.0f) {
+			return -1;
+		}
+		px_unit /= dist;
+	}
+	s32 sel = -1;
+	for (u32 i = 0; i < msh->lod_count; ++i) {
+		if (msh->lod[i].error * scale * px_unit > (f32) ren.lod_error) {
+			break;
+		}
+		sel = i;
+	}
+	return sel;
+}
+
+
+/*
+ * Screen rect [x0, x1) x [y0, y1) inside the DisplayRect that the mesh drawn
+ * with the model matrix can touch, from its projected bounding sphere box.
+ * Returns FALSE if the mesh is out of the screen.
+ */
+bint
+_gfxMeshRect(Mesh *msh, mat4 proj, mat4 view, mat4 model, u32 rect[4])
+{
+	mat4 mv;
+	vec3 vcenter;
+	u32 vp[4];
+	f32 x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+
+	_gfxViewport(vp);
+	memcpy(rect, vp, sizeof(vp));
+	if (msh->vrtx_count == 0 || ren.vp_w == 0 || ren.vp_h == 0) {
+		return FALSE;
+	}
+	mat4_mul(mv, view, model);
+	vec3_mat4Mul(vcenter, mv, msh->bcenter);
+	f32 r = msh->bradius * _gfxMatScale(mv);
+	for (u32 i = 0; i < 8; ++i) {
+		vec4 sp;
+		vec3 c = {vcenter[0] + ((i & 1) ? r : -r),
+				  vcenter[1] + ((i & 2) ? r : -r),
+				  vcenter[2] + ((i & 4) ? r : -r)};
+		f32 w = vec3_mat4MulStandard(sp, proj, c);
+		/*Boxes crossing the camera plane may cover any pixel*/
+		if (w <= 1e-6f) {
+			return TRUE;
+		}
+		x0 = fminf(x0, sp[0] / w), x1 = fmaxf(x1, sp[0] / w);
+		y0 = fminf(y0, sp[1] / w), y1 = fmaxf(y1, sp[1] / w);
+	}
+	if (x1 < -1.0f || x0 > 1.0f || y1 < -1.0f || y0 > 1.0f) {
+		return FALSE;
+	}
+	/*A pixel of margin for the rounding of the spans*/
+	rect[0] = (u32) clamp(PIXW(x0) - 1.0f, vp[0], vp[2]);
+	rect[2] = (u32) clamp(PIXW(x1) + 2.0f, vp[0], vp[2]);
+	rect[1] = (u32) clamp(PIXH(y1) - 1.0f, vp[1], vp[3]);
+	rect[3] = (u32) clamp(PIXH(y0) + 2.0f, vp[1], vp[3]);
+	return (rect[0] < rect[2] && rect[1] < rect[3]);
+}
+
+
+/*Draws the given mesh with textures and transformation matrices*/
+void
+gfxDrawMesh(Mesh *msh, mat4 proj, mat4 view, Tex *tex)
+{
+	mat4 mv;
+	mat3 normat;
+	vec4 planes[6];
+	vec3 vcenter;
+
+	gfxMaterialSet(&msh->mtrl);
+	_gfxLightingBegin(proj);
+	ren.serial++;
+	/*Check primitive type*/
+	mat4_mul(mv, view, msh->model);
+	mat4_normalMatrix(normat, mv);
+
+	/*Cull the whole mesh before any vertex work*/
+	f32 scale = _gfxMatScale(mv);
+	vec3_mat4Mul(vcenter, mv, msh->bcenter);
+	if (ren.culling) {
+		_gfxFrustumPlanes(planes, proj);
+		if (_gfxSphereCulled(planes, vcenter, msh->bradius * scale)) {
+			return;
+		}
+	}
+
+	/*Pick the level of detail*/
+	s32 lod = _gfxMeshLodSelect(msh, proj, vcenter, msh->bradius * scale, scale);
+	if (ren.wireframe == GFX_WIRE_ONLY) {
+		/*Edges only, the back facing ones too*/
+	} else if (lod >= 0) {
+		u32 count = msh->lod[lod].indx_count;
+		_gfxDrawIndexed(msh, msh->lod[lod].indx, NULL, count - (count % 3), mv, normat, proj, tex);
+	} else if (ren.culling && msh->clst_count > 0) {
+		/*Full detail, cull each cluster against the frustum and by its normal cone*/
+		bint ortho = (proj[11] == 0.0f);
+		for (u32 c = 0; c < msh->clst_count; ++c) {
+			MeshCluster *cl = msh->clst + c;
+			vec3 cc;
+			f32 cr = cl->radius * scale;
+			vec3_mat4Mul(cc, mv, cl->center);
+			if (_gfxSphereCulled(planes, cc, cr) ||
+				_gfxConeCulled(cl, cc, cr, normat, ortho)) {
+				continue;
+			}
+			if (msh->pindx) {
+				_gfxDrawIndexed(msh, NULL, msh->pindx + cl->indx_ofs, cl->indx_count, mv, normat, proj, tex);
+			} else {
+				_gfxDrawIndexed(msh, msh->indx + cl->indx_ofs, NULL, cl->indx_count, mv, normat, proj, tex);
+			}
+		}
+	} else {
+		u32 count = msh->indx_count - (msh->indx_count % 3);
+		_gfxDrawIndexed(msh, msh->indx, msh->pindx, count, mv, normat, proj, tex);
+	}
+	if (ren.wireframe) {
+		_gfxDrawEdges(msh, lod, mv, proj, (ren.wireframe == GFX_WIRE_OVERLAY ? WIRE_BIAS : 0.0f));
+	}
+}
+
+
+/*
+ * Draws indexed triangles with the vertices transformed once per instance,
+ * xf caches the transformed vertices of the instance marked by id in stamp
+ */
+static void
+_gfxDrawIndexedCached(const Vert *src, Vert *xf, u32 *stamp, u32 id,
+					  const u32 *indx, const u16 *indx16, u32 count,
+					  mat4 mv, mat3 normat, mat4 proj, Tex *tex)
+{
+	for (u32 i = 0; i < count; i += 3) {
+		Vert p[3];
+		for (u32 k = 0; k < 3; ++k) {
+			u32 v = (indx16 ? indx16[i+k] : indx[i+k]);
+			if (stamp[v] != id) {
+				xf[v] = src[v];
+				vec3_mat4Mul(xf[v].pos, mv, xf[v].pos);
+				if (ren.lighting_mode) {
+					vec3_matMul(xf[v].norm, normat, xf[v].norm);
+				}
+				stamp[v] = id;
+			}
+			p[k] = xf[v];
+		}
+		_triangle(p, p + 1, p + 2, proj, tex);
+	}
+}
+
+
+/*
+ * Draws count copies of the mesh, one per model matrix (msh->model is not
+ * used). Instances are culled by their bounding sphere and pick their own
+ * LOD, vertices are decoded once and transformed once per visible instance.
+ */
+void
+gfxDrawMeshInstanced(Mesh *msh, mat4 proj, mat4 view, Tex *tex, const mat4 *models, u32 count)
+{
+	vec4 planes[6];
+	const Vert *src = msh->vrtx;
+	Vert *unpacked = NULL;
+
+	if (count == 0 || msh->vrtx_count == 0) {
+		return;
+	}
+	gfxMaterialSet(&msh->mtrl);
+	_gfxLightingBegin(proj);
+	ren.serial++;
+	_gfxFrustumPlanes(planes, proj);
+	bint ortho = (proj[11] == 0.0f);
+	/*Packed meshes are decoded once for all the instances*/
+	if (msh->pvrtx) {
+		unpacked = (Vert*) malloc(msh->vrtx_count * sizeof(Vert));
+		for (u32 i = 0; i < msh->vrtx_count; ++i) {
+			_gfxUnpackVert(unpacked + i, msh, i);
+		}
+		src = unpacked;
+	}
+	Vert *xf = (Vert*) malloc(msh->vrtx_count * sizeof(Vert));
+	u32 *stamp = (u32*) calloc(msh->vrtx_count, sizeof(u32));
+
+	for (u32 n = 0; n < count; ++n) {
+		mat4 mv;
+		mat3 normat;
+		vec3 vcenter;
+		u32 id = n + 1;
+
+		mat4_mul(mv, view, (f32*) models[n]);
+		f32 scale = _gfxMatScale(mv);
+		vec3_mat4Mul(vcenter, mv, msh->bcenter);
+		if (ren.culling && _gfxSphereCulled(planes, vcenter, msh->bradius * scale)) {
+			continue;
+		}
+		mat4_normalMatrix(normat, mv);
+
+		s32 lod = _gfxMeshLodSelect(msh, proj, vcenter, msh->bradius * scale, scale);
+		if (ren.wireframe == GFX_WIRE_ONLY) {
+			/*Edges only*/
+		} else if (lod >= 0) {
+			u32 lcount = msh->lod[lod].indx_count;
+			_gfxDrawIndexedCached(src, xf, stamp, id, msh->lod[lod].indx, NULL,
+								  lcount - (lcount % 3), mv, normat, proj, tex);
+		} else if (ren.culling && msh->clst_count > 0) {
+			for (u32 c = 0; c < msh->clst_count; ++c) {
+				MeshCluster *cl = msh->clst + c;
+				vec3 cc;
+				f32 cr = cl->radius * scale;
+				vec3_mat4Mul(cc, mv, cl->center);
+				if (_gfxSphereCulled(planes, cc, cr) ||
+					_gfxConeCulled(cl, cc, cr, normat, ortho)) {
+					continue;
+				}
+				_gfxDrawIndexedCached(src, xf, stamp, id,
+									  (msh->pindx ? NULL : msh->indx + cl->indx_ofs),
+									  (msh->pindx ? msh->pindx + cl->indx_ofs : NULL),
+									  cl->indx_count, mv, normat, proj, tex);
+			}
+		} else {
+			_gfxDrawIndexedCached(src, xf, stamp, id, msh->indx, msh->pindx,
+								  msh->indx_count - (msh->indx_count % 3), mv, normat, proj, tex);
+		}
+		if (ren.wireframe) {
+			_gfxDrawEdges(msh, lod, mv, proj, (ren.wireframe == GFX_WIRE_OVERLAY ? WIRE_BIAS : 0.0f));
+		}
+	}
+	free(stamp);
+	free(xf);
+	free(unpacked);
+}
+
+
+/*
+ * Depth-only triangle (x and y in texels, z screen depth) for shadow maps,
+ * front faces only as in _triangle. No spans or attributes, the covered range
+ * of each row comes from the edge equations and the depth is a plane in x.
+ */
+static void
+_triangleDepth(ShadowMap *sm, const f32 *a, const f32 *b, const f32 *c)
+{
+	/*Texel y grows downwards, so front faces have a negative area here*/
+	f32 area = -edge_func(a[0], a[1], b[0], b[1], c[0], c[1]);
+	if (!(area > 0.0f)) {
+		return;
+	}
+	const f32 *tmp = b;
+	b = c;
+	c = tmp;
+	/*Depth plane*/
+	const f32 inv_area = 1.0f / area;
+	const f32 dzdx = -((a[2] * (c[1] - b[1])) + (b[2] * (a[1] - c[1])) + (c[2] * (b[1] - a[1]))) * inv_area;
+	const f32 dzdy = ((a[2] * (c[0] - b[0])) + (b[2] * (a[0] - c[0])) + (c[2] * (b[0] - a[0]))) * inv_area;
+	/*Edges as E(x) = e[0] + e[1] * x + e[2] * y, inside where all are >= 0, e[3] = 1 / e[1]*/
+	const f32 *v[3] = {a, b, c};
+	f32 e[3][4];
+	for (u32 i = 0; i < 3; ++i) {
+		const f32 *p = v[i], *q = v[(i + 1) % 3];
+		e[i][0] = ((q[1] - p[1]) * p[0]) - ((q[0] - p[0]) * p[1]);
+		e[i][1] = -(q[1] - p[1]);
+		e[i][2] = (q[0] - p[0]);
+		e[i][3] = (e[i][1] != 0.0f ? 1.0f / e[i][1] : 0.0f);
+	}
+	f32 ymin = fminf(a[1], fminf(b[1], c[1])), ymax = fmaxf(a[1], fmaxf(b[1], c[1]));
+	s32 y0 = (s32) clamp(ceilf(ymin - 0.5f), 0.0f, (f32) sm->size);
+	s32 y1 = (s32) clamp(floorf(ymax - 0.5f), -1.0f, (f32) sm->size - 1);
+
+	for (s32 y = y0; y <= y1; ++y) {
+		f32 fy = y + 0.5f;
+		f32 xl = 0.0f, xr = (f32) sm->size;
+		for (u32 i = 0; i < 3; ++i) {
+			f32 k = e[i][0] + (e[i][2] * fy);
+			if (e[i][1] > 0.0f) {
+				xl = fmaxf(xl, -k * e[i][3]);
+			} else if (e[i][1] < 0.0f) {
+				xr = fminf(xr, -k * e[i][3]);
+			} else if (k < 0.0f) {
+				xr = -1.0f;
+			}
+		}
+		s32 x0 = (s32) ceilf(xl - 0.5f);
+		s32 x1 = (s32) fminf(floorf(xr - 0.5f), (f32) sm->size - 1);
+		f32 *row = sm->depth + ((u32) y * sm->size);
+		const f32 z0 = a[2] + (dzdx * (0.5f - a[0])) + (dzdy * (fy - a[1]));
+		s32 x = x0;
+#ifdef __SSE__
+		__m128 z4 = _mm_add_ps(_mm_set1_ps(z0 + (dzdx * (f32) x0)),
+							   _mm_mul_ps(_mm_set1_ps(dzdx), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f)));
+		const __m128 dz4 = _mm_set1_ps(4.0f * dzdx);
+		for (; x + 3 <= x1; x += 4) {
+			_mm_storeu_ps(row + x, _mm_min_ps(z4, _mm_loadu_ps(row + x)));
+			z4 = _mm_add_ps(z4, dz4);
+		}
+#endif
+		for (; x <= x1; ++x) {
+			f32 z = z0 + (dzdx * (f32) x);
+			row[x] = (z < row[x] ? z : row[x]);
+		}
+	}
+}
+
+
+/*Texel space position of a clip space point in front of the light, w is 1 / w*/
+static inline void
+_gfxShadowTexel(vec4 out, const vec4 c, f32 half)
+{
+	f32 w = 1.0f / c[3];
+	out[0] = ((c[0] * w) + 1.0f) * half;
+	out[1] = (1.0f - (c[1] * w)) * half;
+	out[2] = c[2] * w;
+	out[3] = w;
+}
+
+
+/*
+ * Clips a triangle given in clip space to the near plane of the light
+ * (z >= -w, as _gfxLineClip) and draws the depth of what is left, a
+ * triangle or a quad split in two.
+ */
+static void
+_gfxShadowTriangleClip(ShadowMap *sm, const vec4 c[3], f32 half)
+{
+	vec4 poly[4];
+	u32 n = 0;
+	for (u32 i = 0; i < 3; ++i) {
+		const f32 *p = c[i], *q = c[(i + 1) % 3];
+		f32 dp = p[2] + p[3], dq = q[2] + q[3];
+		if (dp >= 0.0f) {
+			memcpy(poly[n++], p, sizeof(vec4));
+		}
+		if ((dp >= 0.0f) != (dq >= 0.0f)) {
+			f32 t = dp / (dp - dq);
+			for (u32 k = 0; k < 4; ++k) {
+				poly[n][k] = lerp(p[k], q[k], t);
+			}
+			n++;
+		}
+	}
+	for (u32 i = 0; i < n; ++i) {
+		_gfxShadowTexel(poly[i], poly[i], half);
+	}
+	for (u32 i = 1; i + 1 < n; ++i) {
+		_triangleDepth(sm, poly[0], poly[i], poly[i + 1]);
+	}
+}
+
+
+/*Draws the depth of the mesh (with msh->model) into the shadow map from its light*/
+void
+gfxDrawShadowMap(ShadowMap *sm, Mesh *msh)
+{
+	mat4 mv, mvp;
+	vec4 planes[6];
+	vec3 vcenter;
+
+	if (sm->depth == NULL || msh->vrtx_count == 0) {
+		return;
+	}
+	ren.serial++;
+	mat4_mul(mv, sm->view, msh->model);
+	mat4_mul(mvp, sm->proj, mv);
+	/*Skip meshes outside the light frustum*/
+	_gfxFrustumPlanes(planes, sm->proj);
+	vec3_mat4Mul(vcenter, mv, msh->bcenter);
+	if (_gfxSphereCulled(planes, vcenter, msh->bradius * _gfxMatScale(mv))) {
+		return;
+	}
+	/*Texel space positions, w < 0 for vertices behind the near plane of the light*/
+	vec4 *sp = (vec4*) malloc(msh->vrtx_count * sizeof(vec4));
+	const f32 half = 0.5f * sm->size;
+	for (u32 i = 0; i < msh->vrtx_count; ++i) {
+		vec3 pos;
+		_gfxFetchPos(pos, msh, i);
+		sp[i][3] = vec3_mat4MulStandard(sp[i], mvp, pos);
+		if (!(sp[i][2] + sp[i][3] >= 0.0f && sp[i][3] > 1e-6f)) {
+			sp[i][3] = -1.0f;
+			continue;
+		}
+		_gfxShadowTexel(sp[i], sp[i], half);
+	}
+	u32 count = msh->indx_count - (msh->indx_count % 3);
+	for (u32 i = 0; i < count; i += 3) {
+		u32 i0, i1, i2;
+		if (msh->pindx) {
+			i0 = msh->pindx[i], i1 = msh->pindx[i + 1], i2 = msh->pindx[i + 2];
+		} else {
+			i0 = msh->indx[i], i1 = msh->indx[i + 1], i2 = msh->indx[i + 2];
+		}
+		/*Triangles crossing the near plane are clipped in clip space*/
+		if (sp[i0][3] < 0.0f || sp[i1][3] < 0.0f || sp[i2][3] < 0.0f) {
+			if (sp[i0][3] < 0.0f && sp[i1][3] < 0.0f && sp[i2][3] < 0.0f) {
+				continue;
+			}
+			vec4 c[3];
+			const u32 id[3] = {i0, i1, i2};
+			for (u32 k = 0; k < 3; ++k) {
+				vec3 pos;
+				_gfxFetchPos(pos, msh, id[k]);
+				c[k][3] = vec3_mat4MulStandard(c[k], mvp, pos);
+			}
+			_gfxShadowTriangleClip(sm, (const vec4*) c, half);
+			continue;
+		}
+		_triangleDepth(sm, sp[i0], sp[i1], sp[i2]);
+	}
+	free(sp);
+}
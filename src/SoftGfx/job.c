@@ -0,0 +1,268 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * job.c : Worker thread pool
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <SoftGfx/job.h>
+
+
+#define JOB_MAX_THREADS		64
+
+
+/*A job is a function run for count indices, by any number of threads*/
+struct Job_tag {
+	JobFunc			fn;
+	void*			data;
+	u32				count;
+	u32				next;		//next index to run
+	u32				done;		//number of finished indices
+	struct Job_tag*	link;		//next job in the queue
+};
+
+/* Struct for the thread pool state */
+static struct job_pool_t {
+	pthread_t		thr[JOB_MAX_THREADS];
+	u32				thr_count;	//worker threads (the caller also works)
+	bint			init;
+	bint			quit;
+	pthread_mutex_t	lock;
+	pthread_cond_t	work_cv;	//signaled when jobs are queued
+	pthread_cond_t	done_cv;	//signaled when a job finishes
+	Job*			head;
+	Job*			tail;
+} pool = {.init = FALSE};
+
+
+/*Takes the next index of a queued job, unqueuing it when all are taken (lock must be held)*/
+static void
+_jobTakeFrom(Job *job, u32 *index)
+{
+	*index = job->next++;
+	if (job->next < job->count) {
+		return;
+	}
+	Job **link = &pool.head, *prev = NULL;
+	while (*link != job) {
+		prev = *link;
+		link = &(*link)->link;
+	}
+	*link = job->link;
+	if (pool.tail == job) {
+		pool.tail = prev;
+	}
+}
+
+
+/*Takes the next index of the first queued job (lock must be held)*/
+static Job*
+_jobTake(u32 *index)
+{
+	Job *job = pool.head;
+	if (job != NULL) {
+		_jobTakeFrom(job, index);
+	}
+	return job;
+}
+
+
+/*Adds a job at the end of the queue and wakes the workers (lock must be held)*/
+static void
+_jobPush(Job *job)
+{
+	if (pool.tail) {
+		pool.tail->link = job;
+	} else {
+		pool.head = job;
+	}
+	pool.tail = job;
+	pthread_cond_broadcast(&pool.work_cv);
+}
+
+
+/*Runs one index of a job and marks it as done (lock must be held, released while running)*/
+static void
+_jobRun(Job *job, u32 index)
+{
+	pthread_mutex_unlock(&pool.lock);
+	job->fn(job->data, index);
+	pthread_mutex_lock(&pool.lock);
+	if (++job->done == job->count) {
+		pthread_cond_broadcast(&pool.done_cv);
+	}
+}
+
+
+/*Worker thread loop*/
+static void*
+_jobWorker(void *arg)
+{
+	u32 index;
+	(void) arg;
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.quit) {
+		Job *job = _jobTake(&index);
+		if (job == NULL) {
+			pthread_cond_wait(&pool.work_cv, &pool.lock);
+			continue;
+		}
+		_jobRun(job, index);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+
+/*Starts the pool with the given number of threads (0 = one per CPU)*/
+void
+gfxJobInit(u32 threads)
+{
+	if (pool.init) {
+		return;
+	}
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0 ? (u32) cpus : 1);
+	}
+	threads = (threads > JOB_MAX_THREADS ? JOB_MAX_THREADS : threads);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work_cv, NULL);
+	pthread_cond_init(&pool.done_cv, NULL);
+	pool.head = pool.tail = NULL;
+	pool.quit = FALSE;
+	pool.thr_count = 0;
+	/*The calling thread is the first worker*/
+	for (u32 i = 1; i < threads; ++i) {
+		if (pthread_create(pool.thr + pool.thr_count, NULL, _jobWorker, NULL) != 0) {
+			printf("WARNING: Could only start %u job threads\n", pool.thr_count);
+			break;
+		}
+		pool.thr_count++;
+	}
+	pool.init = TRUE;
+}
+
+
+/*Stops all the worker threads*/
+void
+gfxJobQuit(void)
+{
+	if (!pool.init) {
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = TRUE;
+	pthread_cond_broadcast(&pool.work_cv);
+	pthread_mutex_unlock(&pool.lock);
+	for (u32 i = 0; i < pool.thr_count; ++i) {
+		pthread_join(pool.thr[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.work_cv);
+	pthread_cond_destroy(&pool.done_cv);
+	pool.init = FALSE;
+}
+
+
+/*Number of threads that run jobs (including the caller)*/
+u32
+gfxJobThreads(void)
+{
+	gfxJobInit(0);
+	return pool.thr_count + 1;
+}
+
+
+/*Runs fn(data, i) for i in [0, count) in parallel, returns when all are done*/
+void
+gfxJobParallel(JobFunc fn, void *data, u32 count)
+{
+	Job job = {fn, data, count, 0, 0, NULL};
+	u32 index;
+
+	if (count == 0) {
+		return;
+	}
+	gfxJobInit(0);
+	if (pool.thr_count == 0 || count == 1) {
+		for (u32 i = 0; i < count; ++i) {
+			fn(data, i);
+		}
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	_jobPush(&job);
+	/*Help with this job only (others may be long running loads) until it is finished*/
+	while (job.done < job.count) {
+		if (job.next == job.count) {
+			pthread_cond_wait(&pool.done_cv, &pool.lock);
+			continue;
+		}
+		_jobTakeFrom(&job, &index);
+		_jobRun(&job, index);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+/*
+ * Runs fn(data, 0) in the background and returns a handle for gfxJobDone and
+ * gfxJobWait, that must always be called to release it
+ */
+Job*
+gfxJobAsync(JobFunc fn, void *data)
+{
+	Job *job = (Job*) malloc(sizeof(Job));
+	*job = (Job) {fn, data, 1, 0, 0, NULL};
+	gfxJobInit(0);
+	/*Without workers it is run right away*/
+	if (pool.thr_count == 0) {
+		job->next = job->done = 1;
+		fn(data, 0);
+		return job;
+	}
+	pthread_mutex_lock(&pool.lock);
+	_jobPush(job);
+	pthread_mutex_unlock(&pool.lock);
+	return job;
+}
+
+
+/*Returns TRUE when a background job has finished*/
+bint
+gfxJobDone(Job *job)
+{
+	bint done;
+	if (pool.thr_count == 0) {
+		return (job->done == job->count);
+	}
+	pthread_mutex_lock(&pool.lock);
+	done = (job->done == job->count);
+	pthread_mutex_unlock(&pool.lock);
+	return done;
+}
+
+
+/*Waits for a background job (running it here if not started yet) and releases it*/
+void
+gfxJobWait(Job *job)
+{
+	u32 index;
+	if (pool.thr_count > 0) {
+		pthread_mutex_lock(&pool.lock);
+		if (job->next < job->count) {
+			_jobTakeFrom(job, &index);
+			_jobRun(job, index);
+		}
+		while (job->done < job->count) {
+			pthread_cond_wait(&pool.done_cv, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+	free(job);
+}
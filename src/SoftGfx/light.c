@@ -1,12 +1,24 @@
 /*
  * SoftGfx - 1.0 - public domain
- * gfx.c : Graphics related functions
+ * light.c : Lighting related functions
  */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SoftGfx/light.h>
 #include <SoftGfx/vm_math.h>
 #include <math.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+
+/*Entries of the specular power table, x^Se for x in [0, 1]*/
+#define SPEC_LUT_SIZE		1024
+/*Shininess values with a table, the next ones use powf*/
+#define SPEC_LUT_MAX		64
 
 
 /*Light state*/
@@ -16,13 +28,140 @@ struct LightEXT_t {
 } lights;
 static Material material;
 static u32 light_act;
+static u32 light_serial;		//changes with anything that changes the lighting
+
+/*Light x material products, updated when the lights or the material change*/
+static struct LightCache_t {
+	u32		count;					//active lights
+	u32		id[GFX_MAX_LIGHTS];		//index of each active light
+	vec3	kd[GFX_MAX_LIGHTS];		//light color * Kd
+	vec3	ks[GFX_MAX_LIGHTS];		//light color * Ks
+	vec3	ambient;				//sum of light color * Ka
+	vec3	mat_kd;					//material Kd and Ks for the point lights
+	vec3	mat_ks;
+	f32		spec_se;				//shininess of the table
+	const f32*	spec_lut;			//shared table of the shininess, NULL for powf
+} cache;
+
+/*Specular power tables, built once for each shininess and kept, so materials can alternate*/
+static struct SpecLuts_t {
+	f32		se[SPEC_LUT_MAX];
+	f32*	lut[SPEC_LUT_MAX];
+	u32		count;
+} spec_luts;
+
+/*Shadow maps of the lights and the camera view to light clip space matrices*/
+static struct Shadows_t {
+	ShadowMap*	sm[GFX_MAX_LIGHTS];
+	mat4		m[GFX_MAX_LIGHTS];
+	mat4		inv_view;		//inverse of the last gfxLightViewUpdate view
+} shadows = {.inv_view = {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+						  0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f}};
+
+/*Materials of the deferred draws since the last clear, id 0 means no geometry*/
+#define DEFERRED_MAX_MATERIALS	255
+
+static struct Deferred_t {
+	struct LightCache_t*	mtrl;
+	u32						count;
+	u32						size;
+} deferred;
+
+/*Point lights with attenuation, binned in screen tiles*/
+static struct PointLights_t {
+	PointLight*	l;
+	vec4*		vpos;			//view position and 1 / radius^2
+	u32			count;
+	u32			size;			//allocated lights
+	mat4		view;			//view of the last gfxLightViewUpdate
+	bint		dirty;			//tiles need to be rebuilt
+	mat4		proj;			//projection and viewport of the tiles
+	u32			vp[4];
+	u32			tiles_w;		//0 if there are no tiles
+	u32			tiles_h;
+	u32*		tile_first;		//tiles_w * tiles_h + 2 offsets into tile_light, with the off viewport list last
+	u32			tile_size;
+	u32*		tile_light;		//light ids of each tile
+	u32			light_size;
+} plights = {.view = {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+					  0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f}};
+
+
+/*Table of x^se, built the first time the shininess is seen (NULL once SPEC_LUT_MAX have one)*/
+static const f32*
+_gfxSpecLut(f32 se)
+{
+	for (u32 i = 0; i < spec_luts.count; ++i) {
+		if (spec_luts.se[i] == se) {
+			return spec_luts.lut[i];
+		}
+	}
+	if (spec_luts.count == SPEC_LUT_MAX) {
+		return NULL;
+	}
+	f32 *lut = (f32*) malloc((SPEC_LUT_SIZE + 1) * sizeof(f32));
+	for (u32 i = 0; i <= SPEC_LUT_SIZE; ++i) {
+		lut[i] = powf((f32) i / SPEC_LUT_SIZE, se);
+	}
+	spec_luts.se[spec_luts.count] = se;
+	spec_luts.lut[spec_luts.count++] = lut;
+	return lut;
+}
+
+
+/*Recomputes the per light constants of the current material*/
+static void
+_gfxLightPrepare(void)
+{
+	vec3 tmp;
+	cache.count = 0;
+	cache.ambient[0] = cache.ambient[1] = cache.ambient[2] = 0.0f;
+	for (u32 i = 0; i < GFX_MAX_LIGHTS; ++i) {
+		if ((light_act >> i) & 1) {
+			u32 n = cache.count++;
+			cache.id[n] = i;
+			vec3_mul(cache.kd[n], lights.l[i].color, material.Kd);
+			vec3_mul(cache.ks[n], lights.l[i].color, material.Ks);
+			vec3_add(cache.ambient, cache.ambient, vec3_mul(tmp, lights.l[i].color, material.Ka));
+		}
+	}
+	memcpy(cache.mat_kd, material.Kd, sizeof(vec3));
+	memcpy(cache.mat_ks, material.Ks, sizeof(vec3));
+	if (cache.spec_se != material.Se || cache.spec_lut == NULL) {
+		cache.spec_se = material.Se;
+		cache.spec_lut = _gfxSpecLut(material.Se);
+	}
+	light_serial++;
+}
+
+
+/*Specular power from the table (x in [0, 1])*/
+static inline f32
+_gfxSpecPow(const struct LightCache_t *lc, f32 x)
+{
+	if (lc->spec_lut == NULL) {
+		return powf(x, lc->spec_se);
+	}
+	f32 f = x * SPEC_LUT_SIZE;
+	u32 i = (u32) f;
+	if (i >= SPEC_LUT_SIZE) {
+		return lc->spec_lut[SPEC_LUT_SIZE];
+	}
+	f -= (f32) i;
+	return lc->spec_lut[i] + ((lc->spec_lut[i + 1] - lc->spec_lut[i]) * f);
+}
 
 
 /*Sets the current material*/
 void
 gfxMaterialSet(Material *m)
 {
+	/*Meshes set their material on every draw*/
+	if (memcmp(&material, m, sizeof(Material)) == 0) {
+		return;
+	}
 	material = *m;
+	_gfxLightPrepare();
 }
 
 /*Avtivates the lights that will be used (lowest bit is first light and so on)*/
@@ -30,6 +169,29 @@ void
 gfxLightActive(u32 active_bit)
 {
 	light_act = active_bit;
+	_gfxLightPrepare();
+}
+
+/*Moves the point lights to view space*/
+static void
+_gfxPointLightsView(void)
+{
+	for (u32 i = 0; i < plights.count; ++i) {
+		f32 r = plights.l[i].radius;
+		vec3_mat4Mul(plights.vpos[i], plights.view, plights.l[i].pos);
+		plights.vpos[i][3] = (r > 0.0f ? 1.0f / (r * r) : INFINITY);
+	}
+	plights.dirty = TRUE;
+}
+
+/*Camera view to light clip space matrix of the shadow map of the light*/
+static void
+_gfxShadowMatrix(u32 light)
+{
+	mat4 tmp;
+	const ShadowMap *sm = shadows.sm[light];
+	mat4_mul(tmp, sm->view, shadows.inv_view);
+	mat4_mul(shadows.m[light], sm->proj, tmp);
 }
 
 /*Updates active light position to view space*/
@@ -41,6 +203,18 @@ gfxLightViewUpdate(mat4 view)
 			vec3_mat4Mul(lights.vpos[i], view, lights.l[i].pos);
 		}
 	}
+	/*The point light tiles are only rebuilt when the view moved*/
+	if (memcmp(plights.view, view, sizeof(mat4)) != 0) {
+		memcpy(plights.view, view, sizeof(mat4));
+		_gfxPointLightsView();
+		light_serial++;
+	}
+	mat4_inverse(shadows.inv_view, view);
+	for (u32 i = 0; i < GFX_MAX_LIGHTS; ++i) {
+		if (shadows.sm[i]) {
+			_gfxShadowMatrix(i);
+		}
+	}
 }
 
 /*Sets the Light properties*/
@@ -49,43 +223,497 @@ gfxLightSet(u8 light_id, Light *l)
 {
 	light_id = light_id & (GFX_MAX_LIGHTS - 1);
 	lights.l[light_id] = *l;
+	_gfxLightPrepare();
+}
+
+/*Replaces the point lights (world positions, moved to view space with the last gfxLightViewUpdate)*/
+void
+gfxPointLightSet(const PointLight *l, u32 count)
+{
+	if (count > plights.size) {
+		plights.size = count;
+		plights.l = (PointLight*) realloc(plights.l, count * sizeof(PointLight));
+		plights.vpos = (vec4*) realloc(plights.vpos, count * sizeof(vec4));
+	}
+	if (count) {
+		memcpy(plights.l, l, count * sizeof(PointLight));
+	}
+	plights.count = count;
+	_gfxPointLightsView();
+	light_serial++;
+}
+
+
+/*Allocates a shadow map with the light projection and view*/
+void
+gfxShadowMapInit(ShadowMap *sm, u32 size, mat4 proj, mat4 view)
+{
+	sm->size = size;
+	sm->depth = (f32*) malloc(size * size * sizeof(f32));
+	memcpy(sm->proj, proj, sizeof(mat4));
+	memcpy(sm->view, view, sizeof(mat4));
+	sm->bias = 0.002f;
+	sm->pcf = 1;
+	gfxShadowMapClear(sm);
+}
+
+void
+gfxShadowMapFree(ShadowMap *sm)
+{
+	for (u32 i = 0; i < GFX_MAX_LIGHTS; ++i) {
+		if (shadows.sm[i] == sm) {
+			shadows.sm[i] = NULL;
+		}
+	}
+	free(sm->depth);
+	sm->depth = NULL;
+}
+
+/*Resets the depth to the far plane*/
+void
+gfxShadowMapClear(ShadowMap *sm)
+{
+	for (u32 i = 0; i < sm->size * sm->size; ++i) {
+		sm->depth[i] = 1.0f;
+	}
+	light_serial++;
+}
+
+/*
+ * Shadows the light with the map (NULL removes it), call it again after
+ * changing the matrices of the map.
+ */
+void
+gfxShadowMapSet(u8 light_id, ShadowMap *sm)
+{
+	light_id = light_id & (GFX_MAX_LIGHTS - 1);
+	shadows.sm[light_id] = sm;
+	if (sm) {
+		_gfxShadowMatrix(light_id);
+	}
+	light_serial++;
+}
+
+/*Changes whenever the lights, the material or the shadows change*/
+u32
+_gfxLightSerial(void)
+{
+	return light_serial;
+}
+
+
+/*Lit fraction of a view space position in the shadow map of the light (PCF over (2 * pcf + 1)^2 texels)*/
+static f32
+_gfxShadowFactor(u32 light, const vec3 pos)
+{
+	const ShadowMap *sm = shadows.sm[light];
+	vec3 lp, p = {pos[0], pos[1], pos[2]};
+	f32 w = vec3_mat4MulStandard(lp, shadows.m[light], p);
+	if (!(w > 0.0f)) {
+		return 1.0f;
+	}
+	w = 1.0f / w;
+	f32 x = ((lp[0] * w) + 1.0f) * 0.5f * sm->size;
+	f32 y = (1.0f - (lp[1] * w)) * 0.5f * sm->size;
+	f32 z = (lp[2] * w) - sm->bias;
+	if (x < 0.0f || y < 0.0f || x >= sm->size || y >= sm->size) {
+		return 1.0f;
+	}
+	s32 r = (s32) sm->pcf, last = (s32) sm->size - 1;
+	s32 tx = (s32) x, ty = (s32) y;
+	u32 lit = 0;
+	for (s32 j = ty - r; j <= ty + r; ++j) {
+		const f32 *row = sm->depth + ((u32) (j < 0 ? 0 : (j > last ? last : j)) * sm->size);
+		for (s32 i = tx - r; i <= tx + r; ++i) {
+			lit += (z <= row[i < 0 ? 0 : (i > last ? last : i)]);
+		}
+	}
+	return (f32) lit / (f32) ((2 * r + 1) * (2 * r + 1));
 }
 
 
-/*Calculates the lighting given the position and normal (also pass view positon for world view)*/
+/*
+ * Bins the point lights in tiles of GFX_LIGHT_TILE pixels by the screen
+ * bounds of their spheres, done once per projection, viewport and view.
+ * The light rects are clipped to the viewport, so one more list after the
+ * tiles holds every light for the positions outside of it.
+ */
 void
-_gfxComputeLighting(vec3 out, vec3 pos, vec3 norm)
+_gfxLightTilesUpdate(mat4 proj, u32 vp_x, u32 vp_y, u32 vp_w, u32 vp_h)
+{
+	const u32 vp[4] = {vp_x, vp_y, vp_w, vp_h};
+	if (!plights.dirty && !memcmp(plights.proj, proj, sizeof(mat4)) && !memcmp(plights.vp, vp, sizeof(vp))) {
+		return;
+	}
+	plights.dirty = FALSE;
+	memcpy(plights.proj, proj, sizeof(mat4));
+	memcpy(plights.vp, vp, sizeof(vp));
+	plights.tiles_w = 0;
+	if (plights.count == 0 || vp_w == 0 || vp_h == 0) {
+		return;
+	}
+	u32 tw = (vp_w + GFX_LIGHT_TILE - 1) / GFX_LIGHT_TILE;
+	u32 th = (vp_h + GFX_LIGHT_TILE - 1) / GFX_LIGHT_TILE;
+	u32 tiles = tw * th;
+	if (tiles + 2 > plights.tile_size) {
+		plights.tile_size = tiles + 2;
+		plights.tile_first = (u32*) realloc(plights.tile_first, plights.tile_size * sizeof(u32));
+	}
+	u32 *first = plights.tile_first;
+	u32 (*rect)[4] = (u32(*)[4]) malloc(plights.count * sizeof(*rect));
+	memset(first, 0, (tiles + 2) * sizeof(u32));
+
+	/*Tile rectangle of each light from the projected corners of its bounding box*/
+	for (u32 i = 0; i < plights.count; ++i) {
+		const f32 *c = plights.vpos[i];
+		f32 r = plights.l[i].radius;
+		f32 x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+		u32 behind = 0;
+		for (u32 k = 0; k < 8; ++k) {
+			vec3 corner = {c[0] + ((k & 1) ? r : -r), c[1] + ((k & 2) ? r : -r), c[2] + ((k & 4) ? r : -r)};
+			vec3 sp;
+			f32 w = vec3_mat4MulStandard(sp, proj, corner);
+			if (!(w > 1e-6f)) {
+				behind++;
+				continue;
+			}
+			f32 px = (((sp[0] / w) + 1.0f) * 0.5f * (vp_w - 1));
+			f32 py = ((1.0f - (sp[1] / w)) * 0.5f * (vp_h - 1));
+			x0 = fminf(x0, px), x1 = fmaxf(x1, px);
+			y0 = fminf(y0, py), y1 = fmaxf(y1, py);
+		}
+		if (behind == 8) {
+			rect[i][0] = rect[i][2] = 1, rect[i][1] = rect[i][3] = 0;
+			continue;
+		}
+		if (behind) {
+			/*Crosses the camera plane, covers the whole viewport*/
+			x0 = y0 = -INFINITY;
+			x1 = y1 = INFINITY;
+		}
+		/*One pixel of margin for the snapping of the vertices*/
+		x0 = fmaxf(floorf(x0) - 1.0f, 0.0f), x1 = fminf(ceilf(x1) + 1.0f, (f32) (vp_w - 1));
+		y0 = fmaxf(floorf(y0) - 1.0f, 0.0f), y1 = fminf(ceilf(y1) + 1.0f, (f32) (vp_h - 1));
+		if (x1 < x0 || y1 < y0) {
+			rect[i][0] = rect[i][2] = 1, rect[i][1] = rect[i][3] = 0;
+			continue;
+		}
+		rect[i][0] = (u32) x0 / GFX_LIGHT_TILE, rect[i][1] = (u32) x1 / GFX_LIGHT_TILE;
+		rect[i][2] = (u32) y0 / GFX_LIGHT_TILE, rect[i][3] = (u32) y1 / GFX_LIGHT_TILE;
+		for (u32 ty = rect[i][2]; ty <= rect[i][3]; ++ty) {
+			for (u32 tx = rect[i][0]; tx <= rect[i][1]; ++tx) {
+				first[(ty * tw) + tx + 1]++;
+			}
+		}
+	}
+	/*Prefix sum and fill the light lists*/
+	for (u32 t = 0; t < tiles; ++t) {
+		first[t + 1] += first[t];
+	}
+	if (first[tiles] + plights.count > plights.light_size) {
+		plights.light_size = first[tiles] + plights.count;
+		plights.tile_light = (u32*) realloc(plights.tile_light, plights.light_size * sizeof(u32));
+	}
+	for (u32 i = 0; i < plights.count; ++i) {
+		for (u32 ty = rect[i][2]; ty <= rect[i][3]; ++ty) {
+			for (u32 tx = rect[i][0]; tx <= rect[i][1]; ++tx) {
+				plights.tile_light[first[(ty * tw) + tx]++] = i;
+			}
+		}
+	}
+	/*Filling moved each offset to the start of the next tile*/
+	memmove(first + 1, first, tiles * sizeof(u32));
+	first[0] = 0;
+	for (u32 i = 0; i < plights.count; ++i) {
+		plights.tile_light[first[tiles] + i] = i;
+	}
+	first[tiles + 1] = first[tiles] + plights.count;
+	free(rect);
+	plights.tiles_w = tw;
+	plights.tiles_h = th;
+}
+
+
+/*Tile holding a display position, positions outside the viewport get the list of all the lights*/
+u32
+_gfxLightTile(s32 x, s32 y)
 {
-	vec3 ambient, diffuse, specular = {0.0f}, light_dir, view_dir, ref_dir, tmp;
+	if (plights.tiles_w == 0) {
+		return 0;
+	}
+	s32 dx = x - (s32) plights.vp[0], dy = y - (s32) plights.vp[1];
+	if (dx < 0 || dy < 0 || dx >= (s32) plights.vp[2] || dy >= (s32) plights.vp[3]) {
+		return plights.tiles_w * plights.tiles_h;
+	}
+	return ((u32) (dy / GFX_LIGHT_TILE) * plights.tiles_w) + (u32) (dx / GFX_LIGHT_TILE);
+}
+
+
+/*Lighting of a position and normal (in view space) with the material constants and the light tile*/
+static void
+_gfxLight(const struct LightCache_t *lc, vec3 out, vec3 pos, vec3 norm, u32 tile)
+{
+	vec3 view_dir, light_dir, ref_dir;
 	const vec3 VZERO = {0.0f, 0.0f, 0.0f};
-	out[0] = 0.0f;
-	out[1] = 0.0f;
-	out[2] = 0.0f;
+	memcpy(out, lc->ambient, sizeof(vec3));
 
 	vec3_normalize(norm);
 	vec3_normalize(vec3_sub(view_dir, VZERO, pos));
-	for (u32 i = 0; i < GFX_MAX_LIGHTS; ++i) {
-		if ((light_act >> i) & 1) {
-			/*Diffuse calc*/
-			vec3_normalize(vec3_sub(light_dir, lights.vpos[i], pos));
-			f32 diff = vec3_dot(norm, light_dir);
-			diff = (diff > 0.0f ? diff : 0.0f);
+	for (u32 n = 0; n < lc->count; ++n) {
+		/*Diffuse calc*/
+		vec3_normalize(vec3_sub(light_dir, lights.vpos[lc->id[n]], pos));
+		f32 diff = vec3_dot(norm, light_dir);
 
-			/*Specular calc*/
-			vec3_reflect(ref_dir, vec3_sub(tmp, VZERO, light_dir), norm);
-			f32 spec = vec3_dot(view_dir, ref_dir);
-			spec = powf((spec > 0.0f ? spec : 0.0f), material.Se);
+		/*Specular calc, the reflection of -light_dir is 2 * diff * norm - light_dir*/
+		vec3_sub(ref_dir, vec3_smul(ref_dir, 2.0f * diff, norm), light_dir);
+		f32 spec = vec3_dot(view_dir, ref_dir);
+		spec = _gfxSpecPow(lc, spec > 0.0f ? spec : 0.0f);
+		diff = (diff > 0.0f ? diff : 0.0f);
+		if (shadows.sm[lc->id[n]]) {
+			f32 lit = _gfxShadowFactor(lc->id[n], pos);
+			diff *= lit;
+			spec *= lit;
+		}
 
-			/*Combine components*/
-			vec3_mul(ambient, lights.l[i].color, material.Ka);
-			vec3_mul(diffuse, lights.l[i].color, vec3_smul(diffuse, diff, material.Kd));
-			vec3_mul(specular, lights.l[i].color, vec3_smul(specular, spec, material.Ks));
+		/*Combine components*/
+		for (u32 k = 0; k < 3; ++k) {
+			out[k] += (lc->kd[n][k] * diff) + (lc->ks[n][k] * spec);
+		}
+	}
+	if (plights.tiles_w == 0) {
+		return;
+	}
+	/*Point lights of the tile, attenuated to 0 at their radius*/
+	vec3 dsum = {0.0f, 0.0f, 0.0f}, ssum = {0.0f, 0.0f, 0.0f};
+	for (u32 n = plights.tile_first[tile]; n < plights.tile_first[tile + 1]; ++n) {
+		u32 id = plights.tile_light[n];
+		const f32 *lp = plights.vpos[id];
+		vec3_sub(light_dir, lp, pos);
+		f32 dist2 = vec3_dot(light_dir, light_dir);
+		f32 att = 1.0f - (dist2 * lp[3]);
+		if (att <= 0.0f) {
+			continue;
+		}
+		att *= att;
+		if (dist2 > 0.0f) {
+			vec3_smul(light_dir, 1.0f / sqrtf(dist2), light_dir);
+		}
+		f32 diff = vec3_dot(norm, light_dir);
+		vec3_sub(ref_dir, vec3_smul(ref_dir, 2.0f * diff, norm), light_dir);
+		f32 spec = vec3_dot(view_dir, ref_dir);
+		spec = _gfxSpecPow(lc, spec > 0.0f ? spec : 0.0f) * att;
+		diff = (diff > 0.0f ? diff : 0.0f) * att;
+		for (u32 k = 0; k < 3; ++k) {
+			dsum[k] += plights.l[id].color[k] * diff;
+			ssum[k] += plights.l[id].color[k] * spec;
+		}
+	}
+	for (u32 k = 0; k < 3; ++k) {
+		out[k] += (lc->mat_kd[k] * dsum[k]) + (lc->mat_ks[k] * ssum[k]);
+	}
+}
+
+
+#ifdef __SSE__
+/*Normalizes 4 vectors in SoA layout given their squared length (zero vectors are kept)*/
+static inline void
+_sseNormalize(__m128 d[3], __m128 mag)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128 valid = _mm_cmpgt_ps(mag, _mm_setzero_ps());
+	__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(mag));
+	inv = _mm_or_ps(_mm_and_ps(valid, inv), _mm_andnot_ps(valid, one));
+	d[0] = _mm_mul_ps(d[0], inv);
+	d[1] = _mm_mul_ps(d[1], inv);
+	d[2] = _mm_mul_ps(d[2], inv);
+}
 
-			/*Add to out color*/
-			vec3_add(out, vec3_add(out, vec3_add(out, out, ambient), diffuse), specular);
+static inline __m128
+_sseDot(const __m128 a[3], const __m128 b[3])
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+/*Diffuse and specular factors of a light for 4 fragments (all directions normalized)*/
+static inline void
+_sseLightTerms(const struct LightCache_t *lc, __m128 *diff, __m128 *spec, const __m128 n[3], const __m128 v[3], const __m128 ld[3])
+{
+	const __m128 zero = _mm_setzero_ps();
+	f32 spec_in[4], spec_out[4];
+	__m128 d = _sseDot(n, ld);
+	/*Reflection of -light_dir dotted with the view direction*/
+	__m128 d2 = _mm_add_ps(d, d);
+	__m128 ref[3] = {_mm_sub_ps(_mm_mul_ps(d2, n[0]), ld[0]),
+					 _mm_sub_ps(_mm_mul_ps(d2, n[1]), ld[1]),
+					 _mm_sub_ps(_mm_mul_ps(d2, n[2]), ld[2])};
+	_mm_storeu_ps(spec_in, _mm_max_ps(_sseDot(v, ref), zero));
+	for (u32 k = 0; k < 4; ++k) {
+		spec_out[k] = _gfxSpecPow(lc, spec_in[k]);
+	}
+	*spec = _mm_loadu_ps(spec_out);
+	*diff = _mm_max_ps(d, zero);
+}
+#endif
+
+
+/*
+ * Lighting of count fragments in SoA layout (pos and norm in view space, the
+ * normals do not need to be normalized) in the same light tile, out gets the
+ * r, g and b arrays. Same math as _gfxLight, four fragments at a time with SSE.
+ */
+static void
+_gfxLightN(const struct LightCache_t *lc, f32 *out_r, f32 *out_g, f32 *out_b,
+		   const f32 *px, const f32 *py, const f32 *pz,
+		   const f32 *nx, const f32 *ny, const f32 *nz, u32 count, u32 tile)
+{
+	u32 i = 0;
+#ifdef __SSE__
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 p[3] = {_mm_loadu_ps(px + i), _mm_loadu_ps(py + i), _mm_loadu_ps(pz + i)};
+		__m128 n[3] = {_mm_loadu_ps(nx + i), _mm_loadu_ps(ny + i), _mm_loadu_ps(nz + i)};
+		__m128 v[3] = {_mm_sub_ps(zero, p[0]), _mm_sub_ps(zero, p[1]), _mm_sub_ps(zero, p[2])};
+		__m128 c[3] = {_mm_set1_ps(lc->ambient[0]), _mm_set1_ps(lc->ambient[1]), _mm_set1_ps(lc->ambient[2])};
+		__m128 diff, spec;
+
+		_sseNormalize(n, _sseDot(n, n));
+		_sseNormalize(v, _sseDot(v, v));
+		for (u32 l = 0; l < lc->count; ++l) {
+			const f32 *lp = lights.vpos[lc->id[l]];
+			__m128 ld[3] = {_mm_sub_ps(_mm_set1_ps(lp[0]), p[0]),
+							_mm_sub_ps(_mm_set1_ps(lp[1]), p[1]),
+							_mm_sub_ps(_mm_set1_ps(lp[2]), p[2])};
+			_sseNormalize(ld, _sseDot(ld, ld));
+			_sseLightTerms(lc, &diff, &spec, n, v, ld);
+			if (shadows.sm[lc->id[l]]) {
+				f32 lit[4];
+				for (u32 k = 0; k < 4; ++k) {
+					vec3 pos = {px[i + k], py[i + k], pz[i + k]};
+					lit[k] = _gfxShadowFactor(lc->id[l], pos);
+				}
+				diff = _mm_mul_ps(diff, _mm_loadu_ps(lit));
+				spec = _mm_mul_ps(spec, _mm_loadu_ps(lit));
+			}
+			for (u32 k = 0; k < 3; ++k) {
+				c[k] = _mm_add_ps(c[k], _mm_add_ps(_mm_mul_ps(_mm_set1_ps(lc->kd[l][k]), diff),
+												   _mm_mul_ps(_mm_set1_ps(lc->ks[l][k]), spec)));
+			}
+		}
+		if (plights.tiles_w) {
+			__m128 dsum[3] = {zero, zero, zero}, ssum[3] = {zero, zero, zero};
+			for (u32 t = plights.tile_first[tile]; t < plights.tile_first[tile + 1]; ++t) {
+				u32 id = plights.tile_light[t];
+				const f32 *lp = plights.vpos[id];
+				__m128 ld[3] = {_mm_sub_ps(_mm_set1_ps(lp[0]), p[0]),
+								_mm_sub_ps(_mm_set1_ps(lp[1]), p[1]),
+								_mm_sub_ps(_mm_set1_ps(lp[2]), p[2])};
+				__m128 dist2 = _sseDot(ld, ld);
+				__m128 att = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(dist2, _mm_set1_ps(lp[3]))), zero);
+				/*Skip lights out of reach of the 4 fragments*/
+				if (!_mm_movemask_ps(_mm_cmpgt_ps(att, zero))) {
+					continue;
+				}
+				att = _mm_mul_ps(att, att);
+				_sseNormalize(ld, dist2);
+				_sseLightTerms(lc, &diff, &spec, n, v, ld);
+				diff = _mm_mul_ps(diff, att);
+				spec = _mm_mul_ps(spec, att);
+				for (u32 k = 0; k < 3; ++k) {
+					__m128 col = _mm_set1_ps(plights.l[id].color[k]);
+					dsum[k] = _mm_add_ps(dsum[k], _mm_mul_ps(col, diff));
+					ssum[k] = _mm_add_ps(ssum[k], _mm_mul_ps(col, spec));
+				}
+			}
+			for (u32 k = 0; k < 3; ++k) {
+				c[k] = _mm_add_ps(c[k], _mm_add_ps(_mm_mul_ps(_mm_set1_ps(lc->mat_kd[k]), dsum[k]),
+												   _mm_mul_ps(_mm_set1_ps(lc->mat_ks[k]), ssum[k])));
+			}
+		}
+		_mm_storeu_ps(out_r + i, c[0]);
+		_mm_storeu_ps(out_g + i, c[1]);
+		_mm_storeu_ps(out_b + i, c[2]);
+	}
+	/*The last 1 to 3 fragments go through SSE too, padded with copies of the last one*/
+	if (i < count) {
+		f32 in[6][4], out[3][4];
+		const f32 *src[6] = {px, py, pz, nx, ny, nz};
+		for (u32 k = 0; k < 4; ++k) {
+			u32 j = (i + k < count ? i + k : count - 1);
+			for (u32 a = 0; a < 6; ++a) {
+				in[a][k] = src[a][j];
+			}
+		}
+		_gfxLightN(lc, out[0], out[1], out[2], in[0], in[1], in[2], in[3], in[4], in[5], 4, tile);
+		for (; i < count; ++i) {
+			out_r[i] = out[0][i & 3];
+			out_g[i] = out[1][i & 3];
+			out_b[i] = out[2][i & 3];
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		vec3 out, pos = {px[i], py[i], pz[i]}, norm = {nx[i], ny[i], nz[i]};
+		_gfxLight(lc, out, pos, norm, tile);
+		out_r[i] = out[0];
+		out_g[i] = out[1];
+		out_b[i] = out[2];
+	}
+}
+
+
+/*Calculates the lighting given the position and normal (in view space) and the light tile*/
+void
+_gfxComputeLighting(vec3 out, vec3 pos, vec3 norm, u32 tile)
+{
+	_gfxLight(&cache, out, pos, norm, tile);
+}
+
+
+/*Lighting of count fragments of the current material in the same light tile, see _gfxLightN*/
+void
+_gfxComputeLightingN(f32 *out_r, f32 *out_g, f32 *out_b,
+					 const f32 *px, const f32 *py, const f32 *pz,
+					 const f32 *nx, const f32 *ny, const f32 *nz, u32 count, u32 tile)
+{
+	_gfxLightN(&cache, out_r, out_g, out_b, px, py, pz, nx, ny, nz, count, tile);
+}
+
+
+/*Id of the current material for the G-buffer, 0 once the table is full*/
+u32
+_gfxDeferredMaterial(void)
+{
+	/*Everything but the table, which follows from the shininess*/
+	for (u32 i = deferred.count; i > 0; --i) {
+		if (!memcmp(deferred.mtrl + (i - 1), &cache, offsetof(struct LightCache_t, spec_lut))) {
+			return i;
 		}
 	}
+	if (deferred.count == DEFERRED_MAX_MATERIALS) {
+		return 0;
+	}
+	if (deferred.count == deferred.size) {
+		deferred.size = (deferred.size ? deferred.size << 1 : 8);
+		deferred.mtrl = (struct LightCache_t*) realloc(deferred.mtrl, deferred.size * sizeof(*deferred.mtrl));
+	}
+	deferred.mtrl[deferred.count++] = cache;
+	return deferred.count;
 }
 
 
+/*Forgets the materials of the G-buffer*/
+void
+_gfxDeferredReset(void)
+{
+	deferred.count = 0;
+}
+
 
+/*Lighting of count G-buffer pixels with the given material id, see _gfxLightN*/
+void
+_gfxDeferredLightingN(u32 mtrl, f32 *out_r, f32 *out_g, f32 *out_b,
+					  const f32 *px, const f32 *py, const f32 *pz,
+					  const f32 *nx, const f32 *ny, const f32 *nz, u32 count, u32 tile)
+{
+	_gfxLightN(deferred.mtrl + (mtrl - 1), out_r, out_g, out_b, px, py, pz, nx, ny, nz, count, tile);
+}
@@ -3,18 +3,27 @@
  * mesh.c : Mesh related functions
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <SoftGfx/mesh.h>
 #include <SoftGfx/vm_math.h>
 #include <math.h>
 
 
 
-//#define HASH(i, j, k)		(((i ^ (j << 4)) >> 4) ^ (k << 8))
-#define HASH(i, j, k)		((i << 10 ^ j << 10) | k)
-//#define HASH(i, j, k)		(((((i + j)*(i + j + 1) >> 1)+ j + k)*(((i + j)*(i + j + 1) >> 1) + j + k + 1) >> 1) + k)
+#define HASH(i, j, k)		((((i) * 0x9E3779B1u) ^ ((j) * 0x85EBCA77u) ^ ((k) * 0xC2B2AE3Du)) * 0x27D4EB2Fu)
+#define SET_EMPTY			0xFFFFFFFFu
+
+
+extern void _gfxMeshNormalsGen(Mesh *msh, const u32 *pos_id, u32 pos_count, u32 flags, vec4 *tangents);
+extern void _gfxMeshEdgesFree(Mesh *msh);
 
 
 static const
@@ -43,82 +52,392 @@ struct Rep_arr {
 	RepItem* data;
 	u32		i;
 	u32		size;
-	u32		exists[0x80000];
-}set_arr = {NULL, 0, 4096, {0}};
+	u32*	table;		//open addressing table of indices into data
+	u32		table_size;	//power of two, at least twice size
+};
 
 //==============================================================================
 // HASH TABLE FOR REPEATED VERTICES
 //==============================================================================
-/* Bad implementation of set */
+/* Set of unique (pos, tex, norm) index triplets with linear probing */
 void
-_setInit(void)
+_setInit(struct Rep_arr *set)
 {
-	set_arr.i = 0;
-	set_arr.size = 1024;
-	set_arr.data = calloc(set_arr.size << 1, sizeof(RepItem));
-	memset(set_arr.exists, 0, sizeof(set_arr.exists));
+	set->i = 0;
+	set->size = 1024;
+	set->data = calloc(set->size, sizeof(RepItem));
+	set->table_size = set->size << 1;
+	set->table = malloc(set->table_size * sizeof(u32));
+	memset(set->table, 0xFF, set->table_size * sizeof(u32));
 }
 
 void
-_setQuit(void)
+_setQuit(struct Rep_arr *set)
 {
-	free(set_arr.data);
+	free(set->data);
+	free(set->table);
 }
 
 
 void
-_setDoubleSize(void)
+_setDoubleSize(struct Rep_arr *set)
 {
-	RepItem* tmp_data = set_arr.data;
-	set_arr.data = calloc(set_arr.size << 1, sizeof(RepItem));
-	memcpy(set_arr.data, tmp_data, set_arr.size * sizeof(RepItem));
+	RepItem* tmp_data = set->data;
+	set->data = calloc(set->size << 1, sizeof(RepItem));
+	memcpy(set->data, tmp_data, set->size * sizeof(RepItem));
 	free(tmp_data);
-	set_arr.size <<= 1;
+	set->size <<= 1;
+	/*Rehash all items in a table twice the size*/
+	free(set->table);
+	set->table_size = set->size << 1;
+	set->table = malloc(set->table_size * sizeof(u32));
+	memset(set->table, 0xFF, set->table_size * sizeof(u32));
+	for (u32 n = 0; n < set->i; ++n) {
+		RepItem *it = set->data + n;
+		u32 h = HASH(it->v0, it->v1, it->v2) & (set->table_size - 1);
+		while (set->table[h] != SET_EMPTY) {
+			h = (h + 1) & (set->table_size - 1);
+		}
+		set->table[h] = n;
+	}
 }
 
 
 u32
-_setInsert(u32 i, u32 j, u32 k)
+_setInsert(struct Rep_arr *set, u32 i, u32 j, u32 k)
 {
 	i -= (i > 0 ? 1 : 0);
 	j -= (j > 0 ? 1 : 0);
 	k -= (k > 0 ? 1 : 0);
-	if (set_arr.i == set_arr.size) {
-		_setDoubleSize();
-	}
-	u32 h = HASH(i, j, k) & 0xFFFFFFu;
-	//printf("%d\n", h >> 5);
-	if ((set_arr.exists[h >> 5] >> (h & 0x1fu)) & 0x1) {
-		//u32 indx = 0;
-		//printf("WHAT\n");
-		for (u32 indx = 0; indx < set_arr.i; ++indx) {
-			if (set_arr.data[indx].v0 == i &&
-				set_arr.data[indx].v1 == j &&
-				set_arr.data[indx].v2 == k) {
-					return indx;
-			}
-			//++indx;
+	if (set->i == set->size) {
+		_setDoubleSize(set);
+	}
+	u32 h = HASH(i, j, k) & (set->table_size - 1);
+	while (set->table[h] != SET_EMPTY) {
+		RepItem *it = set->data + set->table[h];
+		if (it->v0 == i && it->v1 == j && it->v2 == k) {
+			return set->table[h];
 		}
+		h = (h + 1) & (set->table_size - 1);
 	}
-	set_arr.data[set_arr.i].v0 = i;
-	set_arr.data[set_arr.i].v1 = j;
-	set_arr.data[set_arr.i].v2 = k;
-	++set_arr.i;
-	set_arr.exists[h >> 5] |= 1 << (h & 0x1fu);
-	return set_arr.i - 1;
+	set->data[set->i].v0 = i;
+	set->data[set->i].v1 = j;
+	set->data[set->i].v2 = k;
+	set->table[h] = set->i;
+	++set->i;
+	return set->i - 1;
 }
 
 
 //==============================================================================
+// BINARY MESH CACHE
+//==============================================================================
+/* Cache layout: header and aligned sections (vertices, indices, colors, clusters, LODs) */
+#define CACHE_MAGIC			0x4D584753u		/* "SGXM" */
+#define CACHE_VERSION		4u
+#define CACHE_ALIGN			64u
+#define CACHE_ALIGN_UP(x)	(((x) + (CACHE_ALIGN - 1)) & ~((u64) CACHE_ALIGN - 1))
+
+/*Sections of the cache file*/
+enum {
+	SEC_VRTX,		//Vert or PackedVert array
+	SEC_INDX,		//u32 or u16 indices
+	SEC_COLOR,		//packed colors
+	SEC_CLST,		//culling clusters
+	SEC_LOD,		//LOD indices (one section per LOD)
+	SEC_MAX = SEC_LOD + GFX_MESH_MAX_LODS
+};
+
+typedef struct MeshCacheHdr_tag {
+	u32			magic;
+	u32			version;
+	u32			vert_size;	//size of a vertex when baked
+	u32			vrtx_count;
+	u32			indx_count;
+	u32			flags;		//gfxMeshLoadEx flags used when baked
+	u64			src_mtime;	//mtime of the source OBJ
+	u64			src_size;	//size of the source OBJ
+	u64			file_size;
+	u64			sec_ofs[SEC_MAX];	//file offset of each section
+	u64			sec_size[SEC_MAX];	//size in bytes of each section
+	Material	mtrl;
+	vec3		bmin;
+	vec3		bmax;
+	vec3		bcenter;
+	f32			bradius;
+	u32			clst_count;
+	u32			lod_count;
+	u32			lod_indx_count[GFX_MESH_MAX_LODS];
+	f32			lod_error[GFX_MESH_MAX_LODS];
+} MeshCacheHdr;
+
+
+/* The array is part of the cache mapping of the mesh (not allocated) */
+static inline bint
+_meshInMap(const Mesh *msh, const void *ptr)
+{
+	const u8 *p = (const u8*) ptr, *m = (const u8*) msh->map;
+	return (m != NULL && p >= m && p < m + msh->map_size);
+}
+
+
+/* Computes the bounds of a set of triangles and their normal cone */
+static void
+_meshClusterBounds(MeshCluster *cl, const Vert *vrtx, const u32 *indx)
+{
+	vec3 bmin, bmax, axis = {0.0f, 0.0f, 0.0f};
+	f32 r2 = 0.0f, min_dot = 1.0f;
+
+	memcpy(bmin, vrtx[indx[0]].pos, sizeof(vec3));
+	memcpy(bmax, vrtx[indx[0]].pos, sizeof(vec3));
+	for (u32 i = 0; i < cl->indx_count; ++i) {
+		const f32 *p = vrtx[indx[i]].pos;
+		for (u32 k = 0; k < 3; ++k) {
+			bmin[k] = (p[k] < bmin[k] ? p[k] : bmin[k]);
+			bmax[k] = (p[k] > bmax[k] ? p[k] : bmax[k]);
+		}
+	}
+	vec3_smul(cl->center, 0.5f, vec3_add(cl->center, bmin, bmax));
+	for (u32 i = 0; i < cl->indx_count; ++i) {
+		vec3 d;
+		vec3_sub(d, vrtx[indx[i]].pos, cl->center);
+		f32 dd = vec3_dot(d, d);
+		r2 = (dd > r2 ? dd : r2);
+	}
+	cl->radius = sqrtf(r2);
 
+	/*Normal cone: average face normal and the widest deviation from it*/
+	for (u32 pass = 0; pass < 2; ++pass) {
+		for (u32 i = 0; i + 2 < cl->indx_count; i += 3) {
+			vec3 e0, e1, n;
+			vec3_sub(e0, vrtx[indx[i+1]].pos, vrtx[indx[i]].pos);
+			vec3_sub(e1, vrtx[indx[i+2]].pos, vrtx[indx[i]].pos);
+			vec3_cross(n, e0, e1);
+			if (vec3_dot(n, n) == 0.0f) {
+				continue;
+			}
+			vec3_normalize(n);
+			if (pass == 0) {
+				vec3_add(axis, axis, n);
+			} else {
+				f32 d = vec3_dot(n, axis);
+				min_dot = (d < min_dot ? d : min_dot);
+			}
+		}
+		if (pass == 0) {
+			if (vec3_dot(axis, axis) == 0.0f) {
+				min_dot = 0.0f;
+				break;
+			}
+			vec3_normalize(axis);
+		}
+	}
+	memcpy(cl->cone_axis, axis, sizeof(vec3));
+	/*Cones wider than a hemisphere can never be culled*/
+	cl->cone_cutoff = (min_dot <= 0.0f ? 1.0f : sqrtf(1.0f - (min_dot * min_dot)));
+}
+
+
+/* Computes the bounding box, bounding sphere and culling clusters of the mesh */
 void
-gfxMeshLoad(Mesh *msh, const char *filename)
+gfxMeshBoundsUpdate(Mesh *msh)
+{
+	if (msh->vrtx == NULL) {
+		return;
+	}
+	msh->bmin[0] = msh->bmin[1] = msh->bmin[2] = 0.0f;
+	msh->bmax[0] = msh->bmax[1] = msh->bmax[2] = 0.0f;
+	for (u32 i = 0; i < msh->vrtx_count; ++i) {
+		f32 *p = msh->vrtx[i].pos;
+		for (u32 k = 0; k < 3; ++k) {
+			if (i == 0 || p[k] < msh->bmin[k]) msh->bmin[k] = p[k];
+			if (i == 0 || p[k] > msh->bmax[k]) msh->bmax[k] = p[k];
+		}
+	}
+	/*Sphere centered on the box, radius from the farthest vertex*/
+	f32 r2 = 0.0f;
+	vec3_smul(msh->bcenter, 0.5f, vec3_add(msh->bcenter, msh->bmin, msh->bmax));
+	for (u32 i = 0; i < msh->vrtx_count; ++i) {
+		vec3 d;
+		vec3_sub(d, msh->vrtx[i].pos, msh->bcenter);
+		f32 dd = vec3_dot(d, d);
+		r2 = (dd > r2 ? dd : r2);
+	}
+	msh->bradius = sqrtf(r2);
+
+	/*Clusters are consecutive runs of triangles (their count only depends on the indices)*/
+	u32 count = msh->indx_count - (msh->indx_count % 3);
+	u32 clst_indx = GFX_MESH_CLUSTER_TRIS * 3;
+	u32 clst_count = (count + clst_indx - 1) / clst_indx;
+	if (msh->clst == NULL || msh->clst_count != clst_count) {
+		if (!_meshInMap(msh, msh->clst)) {
+			free(msh->clst);
+		}
+		msh->clst = (MeshCluster*) calloc(clst_count ? clst_count : 1, sizeof(MeshCluster));
+	}
+	msh->clst_count = clst_count;
+	for (u32 c = 0; c < clst_count; ++c) {
+		MeshCluster *cl = msh->clst + c;
+		cl->indx_ofs = c * clst_indx;
+		cl->indx_count = (count - cl->indx_ofs < clst_indx ? count - cl->indx_ofs : clst_indx);
+		_meshClusterBounds(cl, msh->vrtx, msh->indx + cl->indx_ofs);
+	}
+}
+
+
+/* Maps the cache file if it is valid for the source, returns TRUE on success */
+static bint
+_meshCacheMap(Mesh *msh, const char *cache_name, const struct stat *src, u32 flags)
+{
+	struct stat st;
+	void *sec[SEC_MAX];
+	int fd = open(cache_name, O_RDONLY);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if (fstat(fd, &st) != 0 || (u64) st.st_size < sizeof(MeshCacheHdr)) {
+		close(fd);
+		return FALSE;
+	}
+	/* Private writable mapping: pages stay shared until someone writes to them */
+	u8 *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return FALSE;
+	}
+	MeshCacheHdr *hdr = (MeshCacheHdr*) map;
+	u32 vert_size = (flags & GFX_MESH_PACK ? sizeof(PackedVert) : sizeof(Vert));
+	bint ok = hdr->magic == CACHE_MAGIC && hdr->version == CACHE_VERSION &&
+			  hdr->flags == flags && hdr->vert_size == vert_size &&
+			  hdr->file_size == (u64) st.st_size &&
+			  hdr->src_mtime == (u64) src->st_mtime && hdr->src_size == (u64) src->st_size &&
+			  hdr->lod_count <= GFX_MESH_MAX_LODS;
+	for (u32 i = 0; ok && i < SEC_MAX; ++i) {
+		ok = (hdr->sec_ofs[i] + hdr->sec_size[i] <= hdr->file_size);
+		sec[i] = (hdr->sec_size[i] ? map + hdr->sec_ofs[i] : NULL);
+	}
+	if (!ok) {
+		munmap(map, st.st_size);
+		return FALSE;
+	}
+	if (flags & GFX_MESH_PACK) {
+		msh->pvrtx = (PackedVert*) sec[SEC_VRTX];
+		msh->pcolor = (u32*) sec[SEC_COLOR];
+		if (hdr->sec_size[SEC_INDX] == (u64) hdr->indx_count * sizeof(u16)) {
+			msh->pindx = (u16*) sec[SEC_INDX];
+		} else {
+			msh->indx = (u32*) sec[SEC_INDX];
+		}
+	} else {
+		msh->vrtx = (Vert*) sec[SEC_VRTX];
+		msh->indx = (u32*) sec[SEC_INDX];
+	}
+	msh->vrtx_count = hdr->vrtx_count;
+	msh->indx_count = hdr->indx_count;
+	msh->clst = (MeshCluster*) sec[SEC_CLST];
+	msh->clst_count = hdr->clst_count;
+	msh->lod_count = hdr->lod_count;
+	for (u32 i = 0; i < hdr->lod_count; ++i) {
+		msh->lod[i].indx = (u32*) sec[SEC_LOD + i];
+		msh->lod[i].indx_count = hdr->lod_indx_count[i];
+		msh->lod[i].error = hdr->lod_error[i];
+	}
+	msh->mtrl = hdr->mtrl;
+	memcpy(msh->bmin, hdr->bmin, sizeof(vec3));
+	memcpy(msh->bmax, hdr->bmax, sizeof(vec3));
+	memcpy(msh->bcenter, hdr->bcenter, sizeof(vec3));
+	msh->bradius = hdr->bradius;
+	mat4_identity(msh->model);
+	msh->map = map;
+	msh->map_size = st.st_size;
+	return TRUE;
+}
+
+
+/* Writes the cache file for the mesh, failures are silently ignored */
+static void
+_meshCacheWrite(Mesh *msh, const char *cache_name, const struct stat *src, u32 flags)
+{
+	char tmp_name[1024 + 32];
+	MeshCacheHdr hdr;
+	const void *sec[SEC_MAX] = {NULL};
+	static const u8 zero[CACHE_ALIGN] = {0};
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.vrtx_count = msh->vrtx_count;
+	hdr.indx_count = msh->indx_count;
+	hdr.flags = flags;
+	hdr.src_mtime = (u64) src->st_mtime;
+	hdr.src_size = (u64) src->st_size;
+	if (msh->pvrtx != NULL) {
+		hdr.vert_size = sizeof(PackedVert);
+		sec[SEC_VRTX] = msh->pvrtx;
+		sec[SEC_COLOR] = msh->pcolor;
+		hdr.sec_size[SEC_COLOR] = (msh->pcolor ? (u64) msh->vrtx_count * sizeof(u32) : 0);
+	} else {
+		hdr.vert_size = sizeof(Vert);
+		sec[SEC_VRTX] = msh->vrtx;
+	}
+	hdr.sec_size[SEC_VRTX] = (u64) msh->vrtx_count * hdr.vert_size;
+	sec[SEC_INDX] = (msh->pindx ? (const void*) msh->pindx : (const void*) msh->indx);
+	hdr.sec_size[SEC_INDX] = (u64) msh->indx_count * (msh->pindx ? sizeof(u16) : sizeof(u32));
+	sec[SEC_CLST] = msh->clst;
+	hdr.sec_size[SEC_CLST] = (u64) msh->clst_count * sizeof(MeshCluster);
+	hdr.clst_count = msh->clst_count;
+	hdr.lod_count = msh->lod_count;
+	for (u32 i = 0; i < msh->lod_count; ++i) {
+		sec[SEC_LOD + i] = msh->lod[i].indx;
+		hdr.sec_size[SEC_LOD + i] = (u64) msh->lod[i].indx_count * sizeof(u32);
+		hdr.lod_indx_count[i] = msh->lod[i].indx_count;
+		hdr.lod_error[i] = msh->lod[i].error;
+	}
+	hdr.file_size = sizeof(hdr);
+	for (u32 i = 0; i < SEC_MAX; ++i) {
+		hdr.sec_ofs[i] = CACHE_ALIGN_UP(hdr.file_size);
+		hdr.file_size = hdr.sec_ofs[i] + hdr.sec_size[i];
+	}
+	hdr.mtrl = msh->mtrl;
+	memcpy(hdr.bmin, msh->bmin, sizeof(vec3));
+	memcpy(hdr.bmax, msh->bmax, sizeof(vec3));
+	memcpy(hdr.bcenter, msh->bcenter, sizeof(vec3));
+	hdr.bradius = msh->bradius;
+
+	/*Write to a temporary file and rename so readers never see a partial cache*/
+	/*Unique per process and mesh, as several meshes may be loading at once*/
+	snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.%p", cache_name, (long) getpid(), (void*) msh);
+	FILE *out = fopen(tmp_name, "wb");
+	if (!out) {
+		return;
+	}
+	bint ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+	u64 ofs = sizeof(hdr);
+	for (u32 i = 0; ok && i < SEC_MAX; ++i) {
+		u64 pad = hdr.sec_ofs[i] - ofs;
+		ok = fwrite(zero, 1, pad, out) == pad;
+		ok = ok && fwrite(sec[i], 1, hdr.sec_size[i], out) == hdr.sec_size[i];
+		ofs = hdr.sec_ofs[i] + hdr.sec_size[i];
+	}
+	ok = (fclose(out) == 0) && ok;
+	if (!ok || rename(tmp_name, cache_name) != 0) {
+		remove(tmp_name);
+	}
+}
+
+
+//==============================================================================
+
+/*Parses a Wavefront OBJ file into the mesh*/
+static void
+_meshLoadOBJ(Mesh *msh, const char *filename)
 {
 	/*Open the file*/
 	u32 nv = 0, nn = 0, nt = 0, nf = 0, max_v = 0;
 	u32 has_n = 0, has_t = 0;
-	char line[1024];
+	char line[1024], *save;
 	struct WFVert *wfv;
+	struct Rep_arr set_arr;
 	FILE *in = fopen(filename, "r");
 	if (!in) {
  		printf("ERROR: The file %s was not found.", filename);
@@ -138,6 +457,7 @@ gfxMeshLoad(Mesh *msh, const char *filename)
  	}
 	/*Find max number of vertices and create arrays for indices, Waveform vertx */
 	if (nf == 0) {
+		fclose(in);
 		return;
 	}
 	max_v = (nv > nn ? nv : nn);
@@ -146,7 +466,7 @@ gfxMeshLoad(Mesh *msh, const char *filename)
 	wfv = (struct WFVert*) calloc(max_v * 4, sizeof(struct WFVert));
 
 	/*Create the set for storing faces*/
-	_setInit();
+	_setInit(&set_arr);
 	nv = nf = nn = nt = 0;
 	/*Reread line*/
 	fseek(in, 0L, SEEK_SET);
@@ -181,85 +501,85 @@ gfxMeshLoad(Mesh *msh, const char *filename)
 			switch (has_n + has_t) {
 				case 0: {
 					u32 vfirst, vlast;
-					char *tok = strtok(line+2," /\n");
+					char *tok = strtok_r(line+2, " /\n", &save);
 					v0 = atoi(tok);
-					vfirst = _setInsert(v0, 0, 0);
-					v0 = atoi(tok = strtok(NULL, " /\n"));
-					vlast = _setInsert(v0, 0, 0);
-					tok = strtok(NULL, " /\n");
+					vfirst = _setInsert(&set_arr, v0, 0, 0);
+					v0 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vlast = _setInsert(&set_arr, v0, 0, 0);
+					tok = strtok_r(NULL, " /\n", &save);
 					while (tok != NULL)
 					{
 						v0 = atoi(tok);
 						faces[nf] = vfirst;
 						faces[nf+1] = vlast;
-						faces[nf+2] = vlast = _setInsert(v0, 0, 0);
+						faces[nf+2] = vlast = _setInsert(&set_arr, v0, 0, 0);
 						nf += 3;
-						tok = strtok(NULL, " /\n");
+						tok = strtok_r(NULL, " /\n", &save);
 					}
 				} break;
 				case 1: {
 					u32 vfirst, vlast;
-					char *tok = strtok(line+2," /\n");
+					char *tok = strtok_r(line+2, " /\n", &save);
 					v0 = atoi(tok);
-					v1 = atoi(tok = strtok(NULL, " /\n"));
-					vfirst = _setInsert(v0, v1, 0);
-					v0 = atoi(tok = strtok(NULL, " /\n"));
-					v1 = atoi(tok = strtok(NULL, " /\n"));
-					vlast = _setInsert(v0, v1, 0);
-					tok = strtok(NULL, " /\n");
+					v1 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vfirst = _setInsert(&set_arr, v0, v1, 0);
+					v0 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					v1 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vlast = _setInsert(&set_arr, v0, v1, 0);
+					tok = strtok_r(NULL, " /\n", &save);
 					while (tok != NULL)
 					{
 						v0 = atoi(tok);
-						v1 = atoi(tok = strtok(NULL, " /\n"));
+						v1 = atoi(tok = strtok_r(NULL, " /\n", &save));
 						faces[nf] = vfirst;
 						faces[nf+1] = vlast;
-						faces[nf+2] = vlast = _setInsert(v0, v1, 0);
+						faces[nf+2] = vlast = _setInsert(&set_arr, v0, v1, 0);
 						nf += 3;
-						tok = strtok(NULL, " /\n");
+						tok = strtok_r(NULL, " /\n", &save);
 					}
 				} break;
 				case 2: {
 					u32 vfirst, vlast;
-					char *tok = strtok(line+2," /\n");
+					char *tok = strtok_r(line+2, " /\n", &save);
 					v0 = atoi(tok);
-					v2 = atoi(tok = strtok(NULL, " /\n"));
-					vfirst = _setInsert(v0, 0, v2);
-					v0 = atoi(tok = strtok(NULL, " /\n"));
-					v2 = atoi(tok = strtok(NULL, " /\n"));
-					vlast = _setInsert(v0, 0, v2);
-					tok = strtok(NULL, " /\n");
+					v2 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vfirst = _setInsert(&set_arr, v0, 0, v2);
+					v0 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					v2 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vlast = _setInsert(&set_arr, v0, 0, v2);
+					tok = strtok_r(NULL, " /\n", &save);
 					while (tok != NULL) {
 						v0 = atoi(tok);
-						v2 = atoi(tok = strtok(NULL, " /\n"));
+						v2 = atoi(tok = strtok_r(NULL, " /\n", &save));
 						faces[nf] = vfirst;
 						faces[nf+1] = vlast;
-						faces[nf+2] = vlast = _setInsert(v0, 0, v2);
+						faces[nf+2] = vlast = _setInsert(&set_arr, v0, 0, v2);
 						nf += 3;
-						tok = strtok(NULL, " /\n");
+						tok = strtok_r(NULL, " /\n", &save);
 					}
 				} break;
 				case 3: {
 					u32 vfirst, vlast;
-					char *tok = strtok(line+2," /\n");
+					char *tok = strtok_r(line+2, " /\n", &save);
 					v0 = atoi(tok);
-					v1 = atoi(tok = strtok(NULL, " /\n"));
-					v2 = atoi(tok = strtok(NULL, " /\n"));
-					vfirst = _setInsert(v0, v1, v2);
-					v0 = atoi(tok = strtok(NULL, " /\n"));
-					v1 = atoi(tok = strtok(NULL, " /\n"));
-					v2 = atoi(tok = strtok(NULL, " /\n"));
-					vlast = _setInsert(v0, v1, v2);
-					tok = strtok(NULL, " /\n");
+					v1 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					v2 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vfirst = _setInsert(&set_arr, v0, v1, v2);
+					v0 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					v1 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					v2 = atoi(tok = strtok_r(NULL, " /\n", &save));
+					vlast = _setInsert(&set_arr, v0, v1, v2);
+					tok = strtok_r(NULL, " /\n", &save);
 					while (tok != NULL)
 					{
 						v0 = atoi(tok);
-						v1 = atoi(tok = strtok(NULL, " /\n"));
-						v2 = atoi(tok = strtok(NULL, " /\n"));
+						v1 = atoi(tok = strtok_r(NULL, " /\n", &save));
+						v2 = atoi(tok = strtok_r(NULL, " /\n", &save));
 						faces[nf] = vfirst;
 						faces[nf+1] = vlast;
-						faces[nf+2] = vlast = _setInsert(v0, v1, v2);
+						faces[nf+2] = vlast = _setInsert(&set_arr, v0, v1, v2);
 						nf += 3;
-						tok = strtok(NULL, " /\n");
+						tok = strtok_r(NULL, " /\n", &save);
 					}
 				} break;
 			}
@@ -291,36 +611,19 @@ gfxMeshLoad(Mesh *msh, const char *filename)
 		msh->vrtx[i].color[0] = 1.0f;
 		msh->vrtx[i].color[1] = 1.0f;
 		msh->vrtx[i].color[2] = 1.0f;
+		msh->vrtx[i].color[3] = 1.0f;
 	}
 
-	/*Calculate normals if there were none*/
+	/*Calculate normals if there were none, shared by vertices with the same position*/
 	if (!has_n) {
-		u32 count = msh->indx_count - (msh->indx_count % 3);
-		u8 norm_count[2048];
-		/* Add all face normals */
-		for (u32 i = 0; i < count; i += 3) {
-			vec3 vv, ww, tmp;
-			vec3_sub(vv, msh->vrtx[msh->indx[i+1]].pos, msh->vrtx[msh->indx[i]].pos);
-			vec3_sub(ww, msh->vrtx[msh->indx[i+2]].pos, msh->vrtx[msh->indx[i]].pos);
-			vec3_cross(tmp, vv, ww);
-			vec3_normalize(tmp);
-
-			vec3_add(msh->vrtx[msh->indx[i]].norm, msh->vrtx[msh->indx[i]].norm, tmp);
-			vec3_add(msh->vrtx[msh->indx[i+1]].norm, msh->vrtx[msh->indx[i+1]].norm, tmp);
-			vec3_add(msh->vrtx[msh->indx[i+2]].norm, msh->vrtx[msh->indx[i+2]].norm, tmp);
-			norm_count[msh->indx[i]]++;
-			norm_count[msh->indx[i+1]]++;
-			norm_count[msh->indx[i+2]]++;
-		}
-		/* Get average normal for each vertex */
+		u32 *pos_id = (u32*) malloc(msh->vrtx_count * sizeof(u32));
+		u32 pos_count = nv;
 		for (u32 i = 0; i < msh->vrtx_count; ++i) {
-			if (norm_count[i]) {
-				msh->vrtx[i].norm[0] /= (f32) norm_count[i];
-				msh->vrtx[i].norm[1] /= (f32) norm_count[i];
-				msh->vrtx[i].norm[2] /= (f32) norm_count[i];
-				vec3_normalize(msh->vrtx[i].norm);
-			}
+			pos_id[i] = set_arr.data[i].v0;
+			pos_count = (pos_id[i] >= pos_count ? pos_id[i] + 1 : pos_count);
 		}
+		_gfxMeshNormalsGen(msh, pos_id, pos_count, GFX_NORMALS_AREA, NULL);
+		free(pos_id);
 	}
 	/*Calculate spherical texture mapping given the vertex normals*/
 	if (!has_t) {
@@ -331,18 +634,120 @@ gfxMeshLoad(Mesh *msh, const char *filename)
 	}
 
 	/*Free used dinamic data*/
-	_setQuit();
+	_setQuit(&set_arr);
 	free(wfv);
 	free(faces);
 	fclose(in);
 }
 
 
+/*Loads an OBJ mesh, using (and refreshing) its binary cache when possible*/
+void
+gfxMeshLoad(Mesh *msh, const char *filename)
+{
+	gfxMeshLoadEx(msh, filename, 0);
+}
+
+
+/*Loads an OBJ mesh applying the processing in flags (GFX_MESH_*)*/
+void
+gfxMeshLoadEx(Mesh *msh, const char *filename, u32 flags)
+{
+	struct stat src;
+	char cache_name[1024];
+
+	memset(msh, 0, sizeof(*msh));
+	snprintf(cache_name, sizeof(cache_name), "%s" GFX_MESH_CACHE_EXT, filename);
+	bint has_src = (stat(filename, &src) == 0);
+	if (has_src && _meshCacheMap(msh, cache_name, &src, flags)) {
+		return;
+	}
+	_meshLoadOBJ(msh, filename);
+	if (msh->indx_count == 0) {
+		return;
+	}
+	if (flags & GFX_MESH_LOD) {
+		gfxMeshLodBuild(msh);
+	}
+	/*The optimizer also updates the bounds for the new order*/
+	if (flags & GFX_MESH_OPTIMIZE) {
+		gfxMeshOptimize(msh);
+	} else {
+		gfxMeshBoundsUpdate(msh);
+	}
+	if (flags & GFX_MESH_PACK) {
+		gfxMeshPack(msh);
+	}
+	if (has_src) {
+		_meshCacheWrite(msh, cache_name, &src, flags);
+	}
+}
+
+
+/*Arguments of a background mesh load*/
+typedef struct MeshLoadJob_tag {
+	Mesh*	msh;
+	u32		flags;
+	char	filename[];
+} MeshLoadJob;
+
+static void
+_meshLoadJob(void *data, u32 index)
+{
+	MeshLoadJob *ld = (MeshLoadJob*) data;
+	(void) index;
+	gfxMeshLoadEx(ld->msh, ld->filename, ld->flags);
+	free(ld);
+}
+
+
+/*
+ * Starts loading a mesh (as gfxMeshLoadEx) on the job threads, the mesh must
+ * not be used until gfxJobDone on the returned handle is TRUE, release the
+ * handle with gfxJobWait
+ */
+Job*
+gfxMeshLoadAsync(Mesh *msh, const char *filename, u32 flags)
+{
+	size_t len = strlen(filename) + 1;
+	MeshLoadJob *ld = (MeshLoadJob*) malloc(sizeof(MeshLoadJob) + len);
+	ld->msh = msh;
+	ld->flags = flags;
+	memcpy(ld->filename, filename, len);
+	return gfxJobAsync(_meshLoadJob, ld);
+}
+
+
 /*Frees the internal mesh arrays*/
 void
 gfxMeshFree(Mesh *msh)
 {
-	free(msh->vrtx);
-	free(msh->indx);
+	if (msh->map != NULL) {
+		/*Clusters rebuilt by gfxMeshBoundsUpdate are on the heap*/
+		if (!_meshInMap(msh, msh->clst)) {
+			free(msh->clst);
+		}
+		munmap(msh->map, msh->map_size);
+		msh->map = NULL;
+	} else {
+		free(msh->vrtx);
+		free(msh->indx);
+		for (u32 i = 0; i < msh->lod_count; ++i) {
+			free(msh->lod[i].indx);
+		}
+		free(msh->clst);
+		free(msh->pvrtx);
+		free(msh->pcolor);
+		free(msh->pindx);
+	}
+	_gfxMeshEdgesFree(msh);
+	msh->vrtx = NULL;
+	msh->indx = NULL;
+	msh->pvrtx = NULL;
+	msh->pcolor = NULL;
+	msh->pindx = NULL;
+	msh->clst = NULL;
+	msh->clst_count = 0;
+	msh->lod_count = 0;
 }
 
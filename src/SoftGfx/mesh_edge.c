@@ -0,0 +1,119 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * mesh_edge.c : Unique edges of the mesh triangles, for the wireframe
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <SoftGfx/mesh.h>
+
+
+/*
+ * Unique edges (pairs of vertex indices) of count indices read from indx or
+ * from indx16 when it is not NULL. Edges are bucketed by their lower vertex,
+ * so the repeated ones are dropped in linear time. Returns the edge count,
+ * and in verts the vertices they use in order (NULL if they use them all).
+ */
+static u32
+_meshEdges(u32 **out, u32 **verts, u32 *vert_count, u32 vrtx_count, const u32 *indx, const u16 *indx16, u32 count)
+{
+	u32 *ofs = (u32*) calloc(vrtx_count + 1, sizeof(u32));
+	u32 *other = (u32*) malloc((count + 1) * sizeof(u32));
+	u32 *mark = (u32*) calloc(vrtx_count, sizeof(u32));
+	u32 *edge = (u32*) malloc(((2 * count) + 2) * sizeof(u32));
+	u32 edge_count = 0;
+
+	/*Count the triangle edges of each lower vertex*/
+	for (u32 i = 0; i < count; i += 3) {
+		for (u32 k = 0; k < 3; ++k) {
+			u32 a = (indx16 ? indx16[i+k] : indx[i+k]);
+			u32 b = (indx16 ? indx16[i+((k+1)%3)] : indx[i+((k+1)%3)]);
+			if (a != b) {
+				ofs[(a < b ? a : b) + 1]++;
+			}
+		}
+	}
+	for (u32 v = 0; v < vrtx_count; ++v) {
+		ofs[v+1] += ofs[v];
+	}
+	/*Fill the buckets, ofs[v] ends at the start of the next one*/
+	for (u32 i = 0; i < count; i += 3) {
+		for (u32 k = 0; k < 3; ++k) {
+			u32 a = (indx16 ? indx16[i+k] : indx[i+k]);
+			u32 b = (indx16 ? indx16[i+((k+1)%3)] : indx[i+((k+1)%3)]);
+			if (a != b) {
+				other[ofs[(a < b ? a : b)]++] = (a < b ? b : a);
+			}
+		}
+	}
+	/*Keep the first pair of each bucket with the same upper vertex*/
+	u32 start = 0;
+	for (u32 v = 0; v < vrtx_count; ++v) {
+		for (u32 j = start; j < ofs[v]; ++j) {
+			if (mark[other[j]] != v + 1) {
+				mark[other[j]] = v + 1;
+				edge[edge_count * 2] = v;
+				edge[(edge_count * 2) + 1] = other[j];
+				edge_count++;
+			}
+		}
+		start = ofs[v];
+	}
+	/*Vertices used, so the LODs only project their own*/
+	memset(mark, 0, vrtx_count * sizeof(u32));
+	*vert_count = 0;
+	for (u32 i = 0; i < 2 * edge_count; ++i) {
+		*vert_count += (mark[edge[i]] == 0);
+		mark[edge[i]] = 1;
+	}
+	*verts = NULL;
+	if (*vert_count < vrtx_count) {
+		*verts = (u32*) malloc((*vert_count + 1) * sizeof(u32));
+		for (u32 v = 0, n = 0; v < vrtx_count; ++v) {
+			if (mark[v]) {
+				(*verts)[n++] = v;
+			}
+		}
+	}
+	free(mark);
+	free(other);
+	free(ofs);
+	*out = (u32*) realloc(edge, ((2 * edge_count) + 2) * sizeof(u32));
+	return edge_count;
+}
+
+
+/*Frees the edges, they are rebuilt by the next wireframe draw*/
+void
+_gfxMeshEdgesFree(Mesh *msh)
+{
+	for (u32 i = 0; i <= GFX_MESH_MAX_LODS; ++i) {
+		free(msh->edge[i]);
+		free(msh->edge_vert[i]);
+		msh->edge[i] = NULL;
+		msh->edge_vert[i] = NULL;
+		msh->edge_count[i] = msh->edge_vert_count[i] = 0;
+	}
+}
+
+
+/*
+ * Builds the unique edges of the full detail triangles and of each LOD (the
+ * first wireframe draw of the mesh does it if they are missing)
+ */
+void
+gfxMeshEdgesBuild(Mesh *msh)
+{
+	_gfxMeshEdgesFree(msh);
+	if (msh->vrtx_count == 0) {
+		return;
+	}
+	u32 count = msh->indx_count - (msh->indx_count % 3);
+	msh->edge_count[0] = _meshEdges(msh->edge, msh->edge_vert, msh->edge_vert_count, msh->vrtx_count,
+									msh->indx, msh->pindx, count);
+	for (u32 i = 0; i < msh->lod_count; ++i) {
+		count = msh->lod[i].indx_count - (msh->lod[i].indx_count % 3);
+		msh->edge_count[i+1] = _meshEdges(msh->edge + i + 1, msh->edge_vert + i + 1, msh->edge_vert_count + i + 1,
+										  msh->vrtx_count, msh->lod[i].indx, NULL, count);
+	}
+}
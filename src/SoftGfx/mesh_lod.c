@@ -0,0 +1,349 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * mesh_lod.c : Mesh simplification (quadric error metric) for levels of detail
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SoftGfx/mesh.h>
+#include <SoftGfx/vm_math.h>
+
+
+/*Each level keeps this fraction of the previous level triangles*/
+#define LOD_RATIO			0.5f
+/*Stop building levels below this number of triangles*/
+#define LOD_MIN_TRIS		32
+/*Max number of collapse passes per level*/
+#define LOD_MAX_PASSES		32
+
+
+extern void _gfxMeshEdgesFree(Mesh *msh);
+
+
+/*Symmetric 4x4 quadric (plane distance error) with its accumulated weight*/
+typedef struct Quadric_tag {
+	f64 a00, a01, a02, a11, a12, a22;
+	f64 b0, b1, b2;
+	f64 c;
+	f64 w;
+} Quadric;
+
+/*Edge collapse candidate, v0 moves to v1*/
+typedef struct Collapse_tag {
+	u32 v0;
+	u32 v1;
+	f32 error;
+} Collapse;
+
+
+static void
+_quadricAdd(Quadric *q, const Quadric *r)
+{
+	q->a00 += r->a00; q->a01 += r->a01; q->a02 += r->a02;
+	q->a11 += r->a11; q->a12 += r->a12; q->a22 += r->a22;
+	q->b0 += r->b0; q->b1 += r->b1; q->b2 += r->b2;
+	q->c += r->c;
+	q->w += r->w;
+}
+
+/*Returns the mean squared distance of p to the planes of the quadric*/
+static f64
+_quadricError(const Quadric *q, const vec3 p)
+{
+	f64 x = p[0], y = p[1], z = p[2];
+	f64 e = (q->a00 * x * x) + (q->a11 * y * y) + (q->a22 * z * z) +
+			2.0 * ((q->a01 * x * y) + (q->a02 * x * z) + (q->a12 * y * z)) +
+			2.0 * ((q->b0 * x) + (q->b1 * y) + (q->b2 * z)) + q->c;
+	e = (e > 0.0 ? e : 0.0);
+	return (q->w > 0.0 ? e / q->w : e);
+}
+
+/*Adds the area weighted plane of the triangle to the quadrics of its vertices*/
+static void
+_quadricAddTri(Quadric *q, const Vert *vrtx, const u32 *tri)
+{
+	vec3 e0, e1, n;
+	vec3_sub(e0, vrtx[tri[1]].pos, vrtx[tri[0]].pos);
+	vec3_sub(e1, vrtx[tri[2]].pos, vrtx[tri[0]].pos);
+	vec3_cross(n, e0, e1);
+	f64 len = sqrt(vec3_dot(n, n));
+	if (len == 0.0) {
+		return;
+	}
+	f64 w = len * 0.5;
+	f64 nx = n[0] / len, ny = n[1] / len, nz = n[2] / len;
+	f64 d = -((nx * vrtx[tri[0]].pos[0]) + (ny * vrtx[tri[0]].pos[1]) + (nz * vrtx[tri[0]].pos[2]));
+	Quadric fq = {
+		w * nx * nx, w * nx * ny, w * nx * nz,
+		w * ny * ny, w * ny * nz, w * nz * nz,
+		w * nx * d, w * ny * d, w * nz * d,
+		w * d * d, w
+	};
+	_quadricAdd(q + tri[0], &fq);
+	_quadricAdd(q + tri[1], &fq);
+	_quadricAdd(q + tri[2], &fq);
+}
+
+
+static int
+_collapseCmp(const void *a, const void *b)
+{
+	f32 ea = ((const Collapse*) a)->error;
+	f32 eb = ((const Collapse*) b)->error;
+	return (ea > eb) - (ea < eb);
+}
+
+static int
+_edgeCmp(const void *a, const void *b)
+{
+	u64 ea = *(const u64*) a, eb = *(const u64*) b;
+	return (ea > eb) - (ea < eb);
+}
+
+/*Vertex position and index, sorted to find vertices sharing a position*/
+typedef struct PosIndx_tag {
+	vec3	pos;
+	u32		i;
+} PosIndx;
+
+static int
+_posIndxCmp(const void *a, const void *b)
+{
+	const f32 *pa = ((const PosIndx*) a)->pos;
+	const f32 *pb = ((const PosIndx*) b)->pos;
+	for (u32 k = 0; k < 3; ++k) {
+		if (pa[k] != pb[k]) {
+			return (pa[k] > pb[k]) - (pa[k] < pb[k]);
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Locks vertices that can not be collapsed: attribute seams (several Verts
+ * sharing a position) and open borders (edges used by a single triangle)
+ */
+static void
+_lodLockVerts(u8 *locked, const Mesh *msh)
+{
+	u32 n = msh->vrtx_count;
+	PosIndx *order = (PosIndx*) malloc(n * sizeof(PosIndx));
+
+	for (u32 i = 0; i < n; ++i) {
+		memcpy(order[i].pos, msh->vrtx[i].pos, sizeof(vec3));
+		order[i].i = i;
+	}
+	qsort(order, n, sizeof(PosIndx), _posIndxCmp);
+	for (u32 i = 1; i < n; ++i) {
+		if (vec3_eq(order[i].pos, order[i-1].pos)) {
+			locked[order[i].i] = 1;
+			locked[order[i-1].i] = 1;
+		}
+	}
+	free(order);
+
+	/*Border edges: a directed edge without its opposite*/
+	u32 count = msh->indx_count - (msh->indx_count % 3);
+	u64 *edges = (u64*) malloc(count * sizeof(u64));
+	for (u32 i = 0; i < count; ++i) {
+		u32 a = msh->indx[i];
+		u32 b = msh->indx[(i % 3 == 2) ? i - 2 : i + 1];
+		edges[i] = ((u64) (a < b ? a : b) << 32) | (a < b ? b : a);
+	}
+	/*Sort undirected edges and lock those seen only once*/
+	qsort(edges, count, sizeof(u64), _edgeCmp);
+	for (u32 i = 0; i < count;) {
+		u32 j = i + 1;
+		while (j < count && edges[j] == edges[i]) {
+			++j;
+		}
+		if (j - i == 1) {
+			locked[edges[i] >> 32] = 1;
+			locked[edges[i] & 0xFFFFFFFFu] = 1;
+		}
+		i = j;
+	}
+	free(edges);
+}
+
+
+/*Checks that moving v0 to v1 does not flip any triangle around v0*/
+static bint
+_lodFlips(const Vert *vrtx, const u32 *indx, const u32 *adj, u32 adj_n, u32 v0, u32 v1)
+{
+	for (u32 j = 0; j < adj_n; ++j) {
+		const u32 *tri = indx + (adj[j] * 3);
+		if (tri[0] == v1 || tri[1] == v1 || tri[2] == v1) {
+			continue;
+		}
+		vec3 p[3], e0, e1, n0, n1;
+		for (u32 k = 0; k < 3; ++k) {
+			memcpy(p[k], vrtx[tri[k]].pos, sizeof(vec3));
+		}
+		vec3_cross(n0, vec3_sub(e0, p[1], p[0]), vec3_sub(e1, p[2], p[0]));
+		for (u32 k = 0; k < 3; ++k) {
+			if (tri[k] == v0) {
+				memcpy(p[k], vrtx[v1].pos, sizeof(vec3));
+			}
+		}
+		vec3_cross(n1, vec3_sub(e0, p[1], p[0]), vec3_sub(e1, p[2], p[0]));
+		if (vec3_dot(n0, n1) <= 0.0f) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+/*
+ * Simplifies indx (in place) by greedy edge collapse passes until it has at
+ * most target triangles, returns the new index count and updates max_error
+ */
+static u32
+_lodSimplify(const Mesh *msh, u32 *indx, u32 count, u32 target, Quadric *q,
+			 const u8 *locked, f32 *max_error)
+{
+	u32 n = msh->vrtx_count;
+	u32 *remap = (u32*) malloc(n * sizeof(u32));
+	u8 *touched = (u8*) malloc(n);
+	u32 *adj_ofs = (u32*) malloc((n + 1) * sizeof(u32));
+	u32 *adj = (u32*) malloc(count * sizeof(u32));
+	Collapse *cl = (Collapse*) malloc(count * sizeof(Collapse));
+
+	for (u32 pass = 0; pass < LOD_MAX_PASSES && count / 3 > target; ++pass) {
+		/*Vertex to triangle adjacency*/
+		memset(adj_ofs, 0, (n + 1) * sizeof(u32));
+		for (u32 i = 0; i < count; ++i) {
+			adj_ofs[indx[i] + 1]++;
+		}
+		for (u32 v = 0; v < n; ++v) {
+			adj_ofs[v + 1] += adj_ofs[v];
+		}
+		for (u32 i = 0; i < count; ++i) {
+			adj[adj_ofs[indx[i]]++] = i / 3;
+		}
+		for (u32 v = n; v > 0; --v) {
+			adj_ofs[v] = adj_ofs[v - 1];
+		}
+		adj_ofs[0] = 0;
+
+		/*Collect collapse candidates sorted by error*/
+		u32 cl_count = 0;
+		for (u32 i = 0; i < count; ++i) {
+			u32 v0 = indx[i];
+			u32 v1 = indx[(i % 3 == 2) ? i - 2 : i + 1];
+			if (locked[v0] || v0 == v1) {
+				continue;
+			}
+			Quadric qs = q[v0];
+			_quadricAdd(&qs, q + v1);
+			cl[cl_count].v0 = v0;
+			cl[cl_count].v1 = v1;
+			cl[cl_count].error = (f32) _quadricError(&qs, msh->vrtx[v1].pos);
+			++cl_count;
+		}
+		if (cl_count == 0) {
+			break;
+		}
+		qsort(cl, cl_count, sizeof(Collapse), _collapseCmp);
+
+		/*Apply independent collapses, each removes about two triangles*/
+		for (u32 v = 0; v < n; ++v) {
+			remap[v] = v;
+		}
+		memset(touched, 0, n);
+		u32 needed = (count / 3) - target, removed = 0, applied = 0;
+		for (u32 c = 0; c < cl_count && removed < needed; ++c) {
+			u32 v0 = cl[c].v0, v1 = cl[c].v1;
+			u32 *a = adj + adj_ofs[v0], an = adj_ofs[v0 + 1] - adj_ofs[v0];
+			if (touched[v0] || touched[v1] ||
+				_lodFlips(msh->vrtx, indx, a, an, v0, v1)) {
+				continue;
+			}
+			/*Lock the whole neighborhood for the rest of the pass*/
+			for (u32 j = 0; j < an; ++j) {
+				const u32 *tri = indx + (a[j] * 3);
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+			}
+			touched[v1] = 1;
+			remap[v0] = v1;
+			_quadricAdd(q + v1, q + v0);
+			f32 err = sqrtf(cl[c].error);
+			*max_error = (err > *max_error ? err : *max_error);
+			removed += 2;
+			applied++;
+		}
+		if (applied == 0) {
+			break;
+		}
+
+		/*Rewrite indices dropping degenerate triangles*/
+		u32 out = 0;
+		for (u32 i = 0; i < count; i += 3) {
+			u32 a = remap[indx[i]], b = remap[indx[i+1]], c = remap[indx[i+2]];
+			if (a != b && b != c && a != c) {
+				indx[out] = a;
+				indx[out+1] = b;
+				indx[out+2] = c;
+				out += 3;
+			}
+		}
+		count = out;
+	}
+
+	free(remap);
+	free(touched);
+	free(adj_ofs);
+	free(adj);
+	free(cl);
+	return count;
+}
+
+
+/*Builds the chain of simplified levels of detail of the mesh*/
+void
+gfxMeshLodBuild(Mesh *msh)
+{
+	/*Packed meshes can not be processed*/
+	if (msh->vrtx == NULL) {
+		return;
+	}
+	u32 count = msh->indx_count - (msh->indx_count % 3);
+	if (count / 3 <= LOD_MIN_TRIS || msh->vrtx_count == 0) {
+		return;
+	}
+	_gfxMeshEdgesFree(msh);
+	Quadric *q = (Quadric*) calloc(msh->vrtx_count, sizeof(Quadric));
+	u8 *locked = (u8*) calloc(msh->vrtx_count, sizeof(u8));
+	u32 *indx = (u32*) malloc(count * sizeof(u32));
+	f32 error = 0.0f;
+
+	memcpy(indx, msh->indx, count * sizeof(u32));
+	for (u32 i = 0; i < count; i += 3) {
+		_quadricAddTri(q, msh->vrtx, indx + i);
+	}
+	_lodLockVerts(locked, msh);
+
+	/*Keep simplifying the same buffer, snapshot it at each level*/
+	msh->lod_count = 0;
+	while (msh->lod_count < GFX_MESH_MAX_LODS && count / 3 > LOD_MIN_TRIS) {
+		u32 target = (u32) ((f32) (count / 3) * LOD_RATIO);
+		u32 new_count = _lodSimplify(msh, indx, count, target, q, locked, &error);
+		/*Stop when the simplifier gets stuck*/
+		if (new_count == 0 || new_count > (count * 3) / 4) {
+			break;
+		}
+		count = new_count;
+		MeshLod *lod = msh->lod + msh->lod_count++;
+		lod->indx = (u32*) malloc(count * sizeof(u32));
+		lod->indx_count = count;
+		lod->error = error;
+		memcpy(lod->indx, indx, count * sizeof(u32));
+	}
+
+	free(q);
+	free(locked);
+	free(indx);
+}
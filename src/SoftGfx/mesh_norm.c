@@ -0,0 +1,300 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * mesh_norm.c : Parallel vertex normal and tangent generation
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SoftGfx/mesh.h>
+#include <SoftGfx/vm_math.h>
+#include <SoftGfx/job.h>
+
+
+/*Vertices per job when writing the results*/
+#define NORM_VERT_CHUNK		(1u << 14)
+
+/*Targets per slice, each slice is accumulated by a single job*/
+#define NORM_SLICE_SHIFT	14
+#define NORM_SLICE			(1u << NORM_SLICE_SHIFT)
+
+/*Triangle ranges per thread when bucketing the corners, and their min size*/
+#define NORM_CHUNKS			4
+#define NORM_CHUNK_MIN		1024
+
+
+/*Triangle corners bucketed by the slice of the targets they add to*/
+typedef struct NormBuckets_tag {
+	bint	by_target;	//slices of the normal targets, else of the vertices
+	u32		slice_count;
+	u32*	hist;		//corners per triangle range and slice, then their first position
+	u32*	start;		//first corner of each slice, slice_count + 1
+	u32*	corner;		//triangle * 3 + corner, indx_count
+} NormBuckets;
+
+/*Shared state of the normal generation jobs*/
+typedef struct NormCtx_tag {
+	Mesh*			msh;
+	const u32*		pos_id;		//normal target of each vertex (NULL = the vertex)
+	u32				pos_count;	//number of normal targets
+	u32				flags;
+	vec4*			tangents;	//optional tangent output
+	u32				tri_count;
+	u32				chunk_count;//triangle ranges of the bucketing
+	NormBuckets*	cur;		//buckets being built
+	NormBuckets		nb;			//by normal target
+	NormBuckets		tb;			//by vertex for the tangents, if pos_id is set
+	f32*			norm;		//normals, 3 floats per target
+	f32*			tang;		//tangent directions, 6 floats (s and t) per vertex
+} NormCtx;
+
+
+static inline u32
+_normTarget(const NormCtx *ctx, u32 v)
+{
+	return (ctx->pos_id ? ctx->pos_id[v] : v);
+}
+
+
+static inline u32
+_normSlice(const NormCtx *ctx, const NormBuckets *b, u32 v)
+{
+	return (b->by_target ? _normTarget(ctx, v) : v) >> NORM_SLICE_SHIFT;
+}
+
+
+/*Counts the corners of a range of triangles in each slice*/
+static void
+_normCountJob(void *data, u32 chunk)
+{
+	NormCtx *ctx = (NormCtx*) data;
+	NormBuckets *b = ctx->cur;
+	const u32 *indx = ctx->msh->indx;
+	u32 *hist = b->hist + ((size_t) chunk * b->slice_count);
+	u32 i_begin = (u32) (((u64) ctx->tri_count * chunk) / ctx->chunk_count) * 3;
+	u32 i_end = (u32) (((u64) ctx->tri_count * (chunk + 1)) / ctx->chunk_count) * 3;
+	for (u32 i = i_begin; i < i_end; ++i) {
+		hist[_normSlice(ctx, b, indx[i])]++;
+	}
+}
+
+
+/*Writes the corners of a range of triangles to their slices, in triangle order*/
+static void
+_normScatterJob(void *data, u32 chunk)
+{
+	NormCtx *ctx = (NormCtx*) data;
+	NormBuckets *b = ctx->cur;
+	const u32 *indx = ctx->msh->indx;
+	u32 *ofs = b->hist + ((size_t) chunk * b->slice_count);
+	u32 i_begin = (u32) (((u64) ctx->tri_count * chunk) / ctx->chunk_count) * 3;
+	u32 i_end = (u32) (((u64) ctx->tri_count * (chunk + 1)) / ctx->chunk_count) * 3;
+	for (u32 i = i_begin; i < i_end; ++i) {
+		b->corner[ofs[_normSlice(ctx, b, indx[i])]++] = i;
+	}
+}
+
+
+/*
+ * Buckets the corners of all the triangles by slice: a count per triangle
+ * range in parallel, their offsets, then the scatter in parallel
+ */
+static void
+_normBucket(NormCtx *ctx, NormBuckets *b, bint by_target, u32 count)
+{
+	b->by_target = by_target;
+	b->slice_count = (count + NORM_SLICE - 1) >> NORM_SLICE_SHIFT;
+	b->hist = (u32*) calloc((size_t) ctx->chunk_count * b->slice_count, sizeof(u32));
+	b->start = (u32*) malloc((b->slice_count + 1) * sizeof(u32));
+	b->corner = (u32*) malloc(((size_t) ctx->tri_count * 3 + 1) * sizeof(u32));
+	ctx->cur = b;
+	gfxJobParallel(_normCountJob, ctx, ctx->chunk_count);
+	u32 pos = 0;
+	for (u32 s = 0; s < b->slice_count; ++s) {
+		b->start[s] = pos;
+		for (u32 c = 0; c < ctx->chunk_count; ++c) {
+			u32 *h = b->hist + ((size_t) c * b->slice_count) + s;
+			u32 n = *h;
+			*h = pos;
+			pos += n;
+		}
+	}
+	b->start[b->slice_count] = pos;
+	gfxJobParallel(_normScatterJob, ctx, ctx->chunk_count);
+}
+
+
+static void
+_normBucketsFree(NormBuckets *b)
+{
+	free(b->hist);
+	free(b->start);
+	free(b->corner);
+}
+
+
+/*
+ * Adds the weighted face normals of the corners of a slice to its targets
+ * and normalizes them. No other job writes to them, and the corners come in
+ * triangle order so the sums do not depend on the thread count.
+ */
+static void
+_normAccumJob(void *data, u32 slice)
+{
+	NormCtx *ctx = (NormCtx*) data;
+	const Vert *vrtx = ctx->msh->vrtx;
+	const u32 *indx = ctx->msh->indx;
+	const NormBuckets *b = &ctx->nb;
+
+	for (u32 j = b->start[slice]; j < b->start[slice + 1]; ++j) {
+		const u32 *tri = indx + (b->corner[j] - (b->corner[j] % 3));
+		const u32 k = b->corner[j] % 3;
+		const f32 *p[3] = {vrtx[tri[0]].pos, vrtx[tri[1]].pos, vrtx[tri[2]].pos};
+		vec3 e1, e2, n;
+		vec3_sub(e1, p[1], p[0]);
+		vec3_sub(e2, p[2], p[0]);
+		vec3_cross(n, e1, e2);
+		/*Area weight is the length of the cross product itself*/
+		if (ctx->flags & GFX_NORMALS_ANGLE) {
+			/*Angle between the two edges leaving the corner*/
+			vec3 d0, d1;
+			vec3_normalize(n);
+			vec3_sub(d0, p[(k + 1) % 3], p[k]);
+			vec3_sub(d1, p[(k + 2) % 3], p[k]);
+			vec3_normalize(d0);
+			vec3_normalize(d1);
+			f32 c = vec3_dot(d0, d1);
+			vec3_smul(n, acosf(c < -1.0f ? -1.0f : (c > 1.0f ? 1.0f : c)), n);
+		}
+		f32 *acc = ctx->norm + ((size_t) _normTarget(ctx, tri[k]) * 3);
+		vec3_add(acc, acc, n);
+	}
+	u32 end = ((slice + 1) << NORM_SLICE_SHIFT);
+	end = (end < ctx->pos_count ? end : ctx->pos_count);
+	for (u32 i = slice << NORM_SLICE_SHIFT; i < end; ++i) {
+		vec3_normalize(ctx->norm + ((size_t) i * 3));
+	}
+}
+
+
+/*Adds the texture space directions of the corners of a slice of vertices*/
+static void
+_normTangentJob(void *data, u32 slice)
+{
+	NormCtx *ctx = (NormCtx*) data;
+	const Vert *vrtx = ctx->msh->vrtx;
+	const u32 *indx = ctx->msh->indx;
+	const NormBuckets *b = (ctx->pos_id ? &ctx->tb : &ctx->nb);
+
+	for (u32 j = b->start[slice]; j < b->start[slice + 1]; ++j) {
+		const u32 *tri = indx + (b->corner[j] - (b->corner[j] % 3));
+		const f32 *p0 = vrtx[tri[0]].pos, *p1 = vrtx[tri[1]].pos, *p2 = vrtx[tri[2]].pos;
+		const f32 *t0 = vrtx[tri[0]].tex, *t1 = vrtx[tri[1]].tex, *t2 = vrtx[tri[2]].tex;
+		f32 du1 = t1[0] - t0[0], dv1 = t1[1] - t0[1];
+		f32 du2 = t2[0] - t0[0], dv2 = t2[1] - t0[1];
+		f32 det = (du1 * dv2) - (du2 * dv1);
+		if (det == 0.0f) {
+			continue;
+		}
+		vec3 e1, e2;
+		vec3_sub(e1, p1, p0);
+		vec3_sub(e2, p2, p0);
+		f32 r = 1.0f / det;
+		vec3 sdir = {((e1[0] * dv2) - (e2[0] * dv1)) * r,
+					 ((e1[1] * dv2) - (e2[1] * dv1)) * r,
+					 ((e1[2] * dv2) - (e2[2] * dv1)) * r};
+		vec3 tdir = {((e2[0] * du1) - (e1[0] * du2)) * r,
+					 ((e2[1] * du1) - (e1[1] * du2)) * r,
+					 ((e2[2] * du1) - (e1[2] * du2)) * r};
+		f32 *acc = ctx->tang + ((size_t) tri[b->corner[j] % 3] * 6);
+		vec3_add(acc, acc, sdir);
+		vec3_add(acc + 3, acc + 3, tdir);
+	}
+}
+
+
+/*Writes the normals (and tangents) to the vertices*/
+static void
+_normWriteJob(void *data, u32 index)
+{
+	NormCtx *ctx = (NormCtx*) data;
+	Vert *vrtx = ctx->msh->vrtx;
+	u32 begin = index * NORM_VERT_CHUNK;
+	u32 end = (begin + NORM_VERT_CHUNK < ctx->msh->vrtx_count ? begin + NORM_VERT_CHUNK : ctx->msh->vrtx_count);
+
+	for (u32 v = begin; v < end; ++v) {
+		memcpy(vrtx[v].norm, ctx->norm + ((size_t) _normTarget(ctx, v) * 3), sizeof(vec3));
+	}
+	if (ctx->tangents == NULL) {
+		return;
+	}
+	for (u32 v = begin; v < end; ++v) {
+		const f32 *n = vrtx[v].norm;
+		const f32 *s = ctx->tang + ((size_t) v * 6);
+		f32 *t = ctx->tangents[v];
+		vec3 tmp, bit;
+		/*Gram-Schmidt orthogonalize against the normal, w is the handedness*/
+		vec3_sub(t, s, vec3_smul(tmp, vec3_dot(n, s), n));
+		vec3_normalize(t);
+		vec3_cross(bit, n, t);
+		t[3] = (vec3_dot(bit, s + 3) < 0.0f ? -1.0f : 1.0f);
+	}
+}
+
+
+/*
+ * Generates the vertex normals of the mesh, face normals are accumulated
+ * into the target given by pos_id (so vertices split by texture seams share
+ * their normal). The targets are split in fixed slices owned by one job
+ * each, the triangle corners are first bucketed by the slice they add to,
+ * so the scratch memory is one index per corner whatever the thread count.
+ */
+void
+_gfxMeshNormalsGen(Mesh *msh, const u32 *pos_id, u32 pos_count, u32 flags, vec4 *tangents)
+{
+	NormCtx ctx;
+	if (msh->vrtx == NULL || msh->indx == NULL || msh->vrtx_count == 0) {
+		return;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.msh = msh;
+	ctx.pos_id = pos_id;
+	ctx.pos_count = (pos_id ? pos_count : msh->vrtx_count);
+	ctx.flags = flags;
+	ctx.tangents = tangents;
+	ctx.tri_count = msh->indx_count / 3;
+	ctx.chunk_count = gfxJobThreads() * NORM_CHUNKS;
+	/*Small meshes are not worth splitting*/
+	if (ctx.tri_count < ctx.chunk_count * NORM_CHUNK_MIN) {
+		ctx.chunk_count = ctx.tri_count / NORM_CHUNK_MIN + 1;
+	}
+	ctx.norm = (f32*) calloc((size_t) ctx.pos_count * 3 + 1, sizeof(f32));
+	ctx.tang = (tangents ? (f32*) calloc((size_t) msh->vrtx_count * 6 + 1, sizeof(f32)) : NULL);
+
+	_normBucket(&ctx, &ctx.nb, TRUE, ctx.pos_count);
+	gfxJobParallel(_normAccumJob, &ctx, ctx.nb.slice_count);
+	if (tangents) {
+		/*Without pos_id the vertices are the targets, and the same buckets are used*/
+		if (pos_id) {
+			_normBucket(&ctx, &ctx.tb, FALSE, msh->vrtx_count);
+		}
+		gfxJobParallel(_normTangentJob, &ctx, (pos_id ? ctx.tb.slice_count : ctx.nb.slice_count));
+	}
+	gfxJobParallel(_normWriteJob, &ctx, (msh->vrtx_count + NORM_VERT_CHUNK - 1) / NORM_VERT_CHUNK);
+
+	_normBucketsFree(&ctx.nb);
+	_normBucketsFree(&ctx.tb);
+	free(ctx.norm);
+	free(ctx.tang);
+}
+
+
+/*
+ * Recomputes the vertex normals from the faces (GFX_NORMALS_* weighting) and
+ * optionally the tangents (xyz and handedness in w) into a vrtx_count array
+ */
+void
+gfxMeshNormals(Mesh *msh, u32 flags, vec4 *tangents)
+{
+	_gfxMeshNormalsGen(msh, NULL, 0, flags, tangents);
+}
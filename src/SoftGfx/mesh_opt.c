@@ -0,0 +1,353 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * mesh_opt.c : Mesh index and vertex reordering
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <math.h>
+#include <SoftGfx/mesh.h>
+#include <SoftGfx/vm_math.h>
+
+
+/* Simulated post-transform cache sizes */
+#define OPT_CACHE_SIZE		32
+#define OPT_FIFO_SIZE		16
+#define OPT_MAX_VALENCE		64
+
+/*Forsyth scoring constants*/
+#define OPT_LAST_TRI_SCORE	0.75f
+#define OPT_DECAY_POWER		1.5f
+#define OPT_VALENCE_SCALE	2.0f
+#define OPT_VALENCE_POWER	0.5f
+
+
+extern void _gfxMeshEdgesFree(Mesh *msh);
+
+
+static f32 cache_score[OPT_CACHE_SIZE];
+static f32 valence_score[OPT_MAX_VALENCE];
+static pthread_once_t score_once = PTHREAD_ONCE_INIT;
+
+
+/*Fills the score tables (run once, meshes may be optimized from several threads)*/
+static void
+_optScoreInit(void)
+{
+	for (u32 i = 0; i < OPT_CACHE_SIZE; ++i) {
+		if (i < 3) {
+			cache_score[i] = OPT_LAST_TRI_SCORE;
+		} else {
+			f32 s = 1.0f - ((f32) (i - 3) / (f32) (OPT_CACHE_SIZE - 3));
+			cache_score[i] = powf(s, OPT_DECAY_POWER);
+		}
+	}
+	for (u32 i = 1; i < OPT_MAX_VALENCE; ++i) {
+		valence_score[i] = OPT_VALENCE_SCALE * powf((f32) i, -OPT_VALENCE_POWER);
+	}
+}
+
+
+/*Score of a vertex given its cache position (-1 = not in cache) and remaining triangles*/
+static inline f32
+_optVertScore(s32 cache_pos, u32 remaining)
+{
+	if (remaining == 0) {
+		return -1.0f;
+	}
+	f32 score = (cache_pos < 0 ? 0.0f : cache_score[cache_pos]);
+	return score + valence_score[remaining < OPT_MAX_VALENCE ? remaining : OPT_MAX_VALENCE - 1];
+}
+
+
+/*
+ * Reorders triangles for post-transform vertex cache hits (Tom Forsyth's
+ * linear-speed algorithm), writes the new order of triangles in dst
+ */
+static void
+_optVertexCache(u32 *dst, const u32 *indx, u32 tri_count, u32 vrtx_count)
+{
+	u32 *remaining = (u32*) calloc(vrtx_count, sizeof(u32));
+	u32 *adj_ofs = (u32*) calloc(vrtx_count + 1, sizeof(u32));
+	u32 *adj = (u32*) malloc(tri_count * 3 * sizeof(u32));
+	s32 *cache_pos = (s32*) malloc(vrtx_count * sizeof(s32));
+	f32 *vscore = (f32*) malloc(vrtx_count * sizeof(f32));
+	f32 *tscore = (f32*) malloc(tri_count * sizeof(f32));
+	u8 *emitted = (u8*) calloc(tri_count, sizeof(u8));
+	u32 cache[OPT_CACHE_SIZE + 3];
+	u32 cache_count = 0;
+
+	pthread_once(&score_once, _optScoreInit);
+	/*Build vertex to triangle adjacency*/
+	for (u32 i = 0; i < tri_count * 3; ++i) {
+		remaining[indx[i]]++;
+	}
+	for (u32 v = 0; v < vrtx_count; ++v) {
+		adj_ofs[v + 1] = adj_ofs[v] + remaining[v];
+		cache_pos[v] = -1;
+	}
+	for (u32 i = 0; i < tri_count * 3; ++i) {
+		u32 v = indx[i];
+		adj[adj_ofs[v + 1] - remaining[v]] = i / 3;
+		remaining[v]--;
+	}
+	for (u32 i = 0; i < tri_count * 3; ++i) {
+		remaining[indx[i]]++;
+	}
+	for (u32 v = 0; v < vrtx_count; ++v) {
+		vscore[v] = _optVertScore(-1, remaining[v]);
+	}
+	for (u32 t = 0; t < tri_count; ++t) {
+		tscore[t] = vscore[indx[t*3]] + vscore[indx[t*3+1]] + vscore[indx[t*3+2]];
+	}
+
+	/*Emit triangles, always choosing the best one touching the cache*/
+	s32 best = 0;
+	u32 cursor = 0;
+	for (u32 out = 0; out < tri_count; ++out) {
+		if (best < 0) {
+			/*Nothing in the cache has triangles left, take the next one in order*/
+			while (emitted[cursor]) {
+				++cursor;
+			}
+			best = cursor;
+		}
+		const u32 *tri = indx + (best * 3);
+		dst[out] = best;
+		emitted[best] = 1;
+
+		/*Move the triangle vertices to the front of the LRU cache*/
+		u32 new_cache[OPT_CACHE_SIZE + 3];
+		u32 new_count = 3;
+		new_cache[0] = tri[0];
+		new_cache[1] = tri[1];
+		new_cache[2] = tri[2];
+		for (u32 k = 0; k < 3; ++k) {
+			u32 v = tri[k];
+			/*Remove triangle from vertex adjacency*/
+			u32 *a = adj + adj_ofs[v];
+			u32 n = remaining[v];
+			for (u32 j = 0; j < n; ++j) {
+				if (a[j] == (u32) best) {
+					a[j] = a[n - 1];
+					break;
+				}
+			}
+			remaining[v]--;
+		}
+		for (u32 i = 0; i < cache_count; ++i) {
+			u32 v = cache[i];
+			if (v != tri[0] && v != tri[1] && v != tri[2]) {
+				new_cache[new_count++] = v;
+			}
+		}
+		/*Update scores for vertices in cache (and those falling out)*/
+		for (u32 i = 0; i < new_count; ++i) {
+			u32 v = new_cache[i];
+			cache_pos[v] = (i < OPT_CACHE_SIZE ? (s32) i : -1);
+			f32 ns = _optVertScore(cache_pos[v], remaining[v]);
+			f32 diff = ns - vscore[v];
+			vscore[v] = ns;
+			for (u32 j = 0; j < remaining[v]; ++j) {
+				tscore[adj[adj_ofs[v] + j]] += diff;
+			}
+		}
+		cache_count = (new_count < OPT_CACHE_SIZE ? new_count : OPT_CACHE_SIZE);
+		memcpy(cache, new_cache, cache_count * sizeof(u32));
+
+		/*Find the best triangle adjacent to the cache*/
+		f32 best_score = -1.0f;
+		best = -1;
+		for (u32 i = 0; i < cache_count; ++i) {
+			u32 v = cache[i];
+			for (u32 j = 0; j < remaining[v]; ++j) {
+				u32 t = adj[adj_ofs[v] + j];
+				if (tscore[t] > best_score) {
+					best_score = tscore[t];
+					best = t;
+				}
+			}
+		}
+	}
+
+	free(remaining);
+	free(adj_ofs);
+	free(adj);
+	free(cache_pos);
+	free(vscore);
+	free(tscore);
+	free(emitted);
+}
+
+
+/*Struct used for sorting clusters of triangles*/
+typedef struct OptCluster_tag {
+	u32 begin;
+	u32 end;
+	f32 sort;
+} OptCluster;
+
+static int
+_optClusterCmp(const void *a, const void *b)
+{
+	f32 sa = ((const OptCluster*) a)->sort;
+	f32 sb = ((const OptCluster*) b)->sort;
+	return (sa < sb) - (sa > sb);
+}
+
+
+/*
+ * Splits the cache optimized order in clusters where the simulated FIFO cache
+ * gets flushed and sorts the clusters so outward facing ones are drawn first
+ * (view independent overdraw reduction, Sander et al.)
+ */
+static void
+_optOverdraw(u32 *order, const Mesh *msh, u32 tri_count)
+{
+	u32 *stamp = (u32*) calloc(msh->vrtx_count, sizeof(u32));
+	OptCluster *cl = (OptCluster*) malloc(tri_count * sizeof(OptCluster));
+	u32 *tmp = (u32*) malloc(tri_count * sizeof(u32));
+	u32 cl_count = 0, time = OPT_FIFO_SIZE + 1;
+	vec3 center = {0.0f, 0.0f, 0.0f};
+
+	/*Split at triangles that miss the cache on all three vertices*/
+	for (u32 i = 0; i < tri_count; ++i) {
+		const u32 *tri = msh->indx + (order[i] * 3);
+		u32 misses = 0;
+		for (u32 k = 0; k < 3; ++k) {
+			if (time - stamp[tri[k]] > OPT_FIFO_SIZE) {
+				stamp[tri[k]] = time++;
+				misses++;
+			}
+		}
+		if (misses == 3 || i == 0) {
+			if (cl_count) {
+				cl[cl_count - 1].end = i;
+			}
+			cl[cl_count++].begin = i;
+		}
+	}
+	cl[cl_count - 1].end = tri_count;
+
+	for (u32 v = 0; v < msh->vrtx_count; ++v) {
+		vec3_add(center, center, msh->vrtx[v].pos);
+	}
+	vec3_smul(center, 1.0f / (f32) msh->vrtx_count, center);
+
+	/*Sort metric: how much the cluster faces away from the mesh center*/
+	for (u32 c = 0; c < cl_count; ++c) {
+		vec3 cc = {0.0f, 0.0f, 0.0f}, cn = {0.0f, 0.0f, 0.0f};
+		f32 area_sum = 0.0f;
+		for (u32 i = cl[c].begin; i < cl[c].end; ++i) {
+			const u32 *tri = msh->indx + (order[i] * 3);
+			vec3 e0, e1, n, tc;
+			vec3_sub(e0, msh->vrtx[tri[1]].pos, msh->vrtx[tri[0]].pos);
+			vec3_sub(e1, msh->vrtx[tri[2]].pos, msh->vrtx[tri[0]].pos);
+			vec3_cross(n, e0, e1);
+			f32 area = sqrtf(vec3_dot(n, n));
+			vec3_add(tc, msh->vrtx[tri[0]].pos, msh->vrtx[tri[1]].pos);
+			vec3_add(tc, tc, msh->vrtx[tri[2]].pos);
+			vec3_add(cc, cc, vec3_smul(tc, area / 3.0f, tc));
+			vec3_add(cn, cn, n);
+			area_sum += area;
+		}
+		if (area_sum > 0.0f) {
+			vec3_smul(cc, 1.0f / area_sum, cc);
+		}
+		vec3_normalize(cn);
+		cl[c].sort = vec3_dot(vec3_sub(cc, cc, center), cn);
+	}
+	qsort(cl, cl_count, sizeof(OptCluster), _optClusterCmp);
+
+	u32 n = 0;
+	for (u32 c = 0; c < cl_count; ++c) {
+		for (u32 i = cl[c].begin; i < cl[c].end; ++i) {
+			tmp[n++] = order[i];
+		}
+	}
+	memcpy(order, tmp, tri_count * sizeof(u32));
+
+	free(stamp);
+	free(cl);
+	free(tmp);
+}
+
+
+/*Reorders the vertices in order of first use by the index buffer (LODs are remapped too)*/
+static void
+_optVertexFetch(Mesh *msh)
+{
+	u32 *remap = (u32*) malloc(msh->vrtx_count * sizeof(u32));
+	Vert *vrtx = (Vert*) malloc(msh->vrtx_count * sizeof(Vert));
+	u32 next = 0;
+
+	memset(remap, 0xFF, msh->vrtx_count * sizeof(u32));
+	for (u32 i = 0; i < msh->indx_count; ++i) {
+		u32 v = msh->indx[i];
+		if (remap[v] == 0xFFFFFFFFu) {
+			vrtx[next] = msh->vrtx[v];
+			remap[v] = next++;
+		}
+		msh->indx[i] = remap[v];
+	}
+	/*LODs only use vertices of the full mesh*/
+	for (u32 l = 0; l < msh->lod_count; ++l) {
+		for (u32 i = 0; i < msh->lod[l].indx_count; ++i) {
+			msh->lod[l].indx[i] = remap[msh->lod[l].indx[i]];
+		}
+	}
+	/*Keep unreferenced vertices at the end*/
+	for (u32 v = 0; v < msh->vrtx_count; ++v) {
+		if (remap[v] == 0xFFFFFFFFu) {
+			vrtx[next++] = msh->vrtx[v];
+		}
+	}
+	memcpy(msh->vrtx, vrtx, msh->vrtx_count * sizeof(Vert));
+	free(remap);
+	free(vrtx);
+}
+
+
+/*Reorders triangles for vertex cache and overdraw, and vertices for fetch locality*/
+void
+gfxMeshOptimize(Mesh *msh)
+{
+	/*Packed meshes can not be processed*/
+	if (msh->vrtx == NULL) {
+		return;
+	}
+	u32 tri_count = msh->indx_count / 3;
+	if (tri_count == 0 || msh->vrtx_count == 0) {
+		return;
+	}
+	_gfxMeshEdgesFree(msh);
+	u32 *order = (u32*) malloc(tri_count * sizeof(u32));
+	u32 *indx = (u32*) malloc(tri_count * 3 * sizeof(u32));
+
+	_optVertexCache(order, msh->indx, tri_count, msh->vrtx_count);
+	_optOverdraw(order, msh, tri_count);
+	for (u32 i = 0; i < tri_count; ++i) {
+		indx[i*3] = msh->indx[order[i]*3];
+		indx[i*3+1] = msh->indx[order[i]*3+1];
+		indx[i*3+2] = msh->indx[order[i]*3+2];
+	}
+	memcpy(msh->indx, indx, tri_count * 3 * sizeof(u32));
+	/*LODs only get the vertex cache pass*/
+	for (u32 l = 0; l < msh->lod_count; ++l) {
+		u32 lod_tris = msh->lod[l].indx_count / 3;
+		const u32 *src = msh->lod[l].indx;
+		_optVertexCache(order, src, lod_tris, msh->vrtx_count);
+		for (u32 i = 0; i < lod_tris; ++i) {
+			indx[i*3] = src[order[i]*3];
+			indx[i*3+1] = src[order[i]*3+1];
+			indx[i*3+2] = src[order[i]*3+2];
+		}
+		memcpy(msh->lod[l].indx, indx, lod_tris * 3 * sizeof(u32));
+	}
+	_optVertexFetch(msh);
+	gfxMeshBoundsUpdate(msh);
+
+	free(order);
+	free(indx);
+}
@@ -0,0 +1,135 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * mesh_pack.c : Quantized vertex format for meshes
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SoftGfx/mesh.h>
+#include <SoftGfx/vm_math.h>
+
+
+/*Converts a float to half float (round to nearest)*/
+static u16
+_floatToHalf(f32 f)
+{
+	union { f32 f; u32 u; } v;
+	v.f = f;
+	u32 sign = (v.u >> 16) & 0x8000u;
+	s32 exp = (s32) ((v.u >> 23) & 0xFFu) - 127 + 15;
+	u32 man = v.u & 0x7FFFFFu;
+
+	if (((v.u >> 23) & 0xFFu) == 0xFFu) {
+		return sign | 0x7C00u | (man ? 0x200u : 0u);
+	}
+	if (exp >= 31) {
+		return sign | 0x7C00u;
+	}
+	/*Denormals*/
+	if (exp <= 0) {
+		if (exp < -10) {
+			return sign;
+		}
+		man |= 0x800000u;
+		u32 shift = 14 - exp;
+		u32 h = man >> shift;
+		h += (man >> (shift - 1)) & 1u;
+		return sign | h;
+	}
+	/*A carry from rounding moves to the exponent as it should*/
+	u32 h = sign | ((u32) exp << 10) | (man >> 13);
+	h += (man >> 12) & 1u;
+	return (u16) h;
+}
+
+
+/*Maps f in [-1, 1] to snorm16*/
+static inline s16
+_snorm16(f32 f)
+{
+	f = (f < -1.0f ? -1.0f : (f > 1.0f ? 1.0f : f));
+	return (s16) lrintf(f * 32767.0f);
+}
+
+
+/*Octahedral encoding of a unit normal*/
+static void
+_octEncode(s16 out[2], const vec3 n)
+{
+	f32 l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	if (l1 == 0.0f) {
+		out[0] = out[1] = 0;
+		return;
+	}
+	f32 x = n[0] / l1, y = n[1] / l1;
+	if (n[2] < 0.0f) {
+		f32 ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	out[0] = _snorm16(x);
+	out[1] = _snorm16(y);
+}
+
+
+/*
+ * Replaces the float vertices of the mesh with quantized ones: positions in
+ * unorm16 relative to the bounding box, octahedral normals, half float texture
+ * coordinates, RGBA8 colors only when not all white and 16 bit indices when
+ * possible. Must be called after any other mesh processing (mapped meshes
+ * are skipped, load them with GFX_MESH_PACK to bake the packed data instead).
+ */
+void
+gfxMeshPack(Mesh *msh)
+{
+	vec3 ext;
+	bint has_color = FALSE;
+
+	if (msh->vrtx == NULL || msh->pvrtx != NULL || msh->map != NULL) {
+		return;
+	}
+	vec3_sub(ext, msh->bmax, msh->bmin);
+	msh->pvrtx = (PackedVert*) malloc(msh->vrtx_count * sizeof(PackedVert));
+	for (u32 i = 0; i < msh->vrtx_count; ++i) {
+		const Vert *v = msh->vrtx + i;
+		PackedVert *pv = msh->pvrtx + i;
+		for (u32 k = 0; k < 3; ++k) {
+			f32 t = (ext[k] > 0.0f ? (v->pos[k] - msh->bmin[k]) / ext[k] : 0.0f);
+			pv->pos[k] = (u16) lrintf(t * 65535.0f);
+		}
+		pv->pad = 0;
+		_octEncode(pv->norm, v->norm);
+		pv->tex[0] = _floatToHalf(v->tex[0]);
+		pv->tex[1] = _floatToHalf(v->tex[1]);
+		has_color |= (v->color[0] != 1.0f || v->color[1] != 1.0f || v->color[2] != 1.0f ||
+					  v->color[3] != 1.0f);
+	}
+	if (has_color) {
+		msh->pcolor = (u32*) malloc(msh->vrtx_count * sizeof(u32));
+		for (u32 i = 0; i < msh->vrtx_count; ++i) {
+			vec4 c;
+			memcpy(c, msh->vrtx[i].color, sizeof(vec4));
+			vec3_clamp(c, 0.0f, 1.0f);
+			c[3] = (c[3] > 0.0f ? (c[3] < 1.0f ? c[3] : 1.0f) : 0.0f);
+			msh->pcolor[i] = ((u32) lrintf(c[0] * 255.0f)) |
+							 ((u32) lrintf(c[1] * 255.0f) << 8) |
+							 ((u32) lrintf(c[2] * 255.0f) << 16) |
+							 ((u32) lrintf(c[3] * 255.0f) << 24);
+		}
+	}
+	if (msh->vrtx_count <= 0x10000u) {
+		msh->pindx = (u16*) malloc(msh->indx_count * sizeof(u16));
+		for (u32 i = 0; i < msh->indx_count; ++i) {
+			msh->pindx[i] = (u16) msh->indx[i];
+		}
+	}
+
+	/*Drop the float data*/
+	free(msh->vrtx);
+	msh->vrtx = NULL;
+	if (msh->pindx) {
+		free(msh->indx);
+		msh->indx = NULL;
+	}
+}
@@ -0,0 +1,478 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * post.c : Image space passes, fused in one sweep over bands of rows
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SoftGfx/post.h>
+#include <SoftGfx/job.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/*Rows of the display done by each job*/
+#define POST_BAND			32
+
+/*FXAA, the taps reach half the span so the bands read HALO rows around them*/
+#define FXAA_SPAN			4.0f
+#define FXAA_HALO			2
+/*Contrast below which pixels are left alone, in 8 bit luma*/
+#define FXAA_EDGE_MIN		16
+#define FXAA_REDUCE_MIN		(255.0f / 128.0f)
+#define FXAA_REDUCE_MUL		(1.0f / 8.0f)
+
+typedef struct PostPass_t {
+	u32	type;
+	f32	threshold;		//FXAA contrast relative to the brightest luma
+	u8	lut[256];		//tone map of each channel
+	u32	color;			//fog
+	f32	start;
+	f32	inv_range;
+	f32	zdist[4];		//view distance from depth, (z*[0] + [1]) / (z*[2] + [3])
+} PostPass;
+
+static struct {
+	PostPass pass[GFX_POST_MAX];
+	u32 count;
+	u32 serial;			//bumped on every change of the chain
+	u32 fxaa;			//index of the FXAA pass, count if there is none
+	bint depth;			//a pass reads the depth
+	/*Scratch of each band, its rows and the ones around it*/
+	u32 *rows;
+	f32 *depth_rows;
+	u8 *luma;
+	u32 stride;
+	u32 luma_stride;
+	u32 size;
+	/*Display of the current run*/
+	u32 *dst;
+	u32 width;
+	u32 height;
+	u32 vp[4];
+} post = {0x0};
+
+extern void _gfxRowGet(u32 y, u32 x0, u32 x1, u32 *pix, f32 *depth);
+
+
+/*Appends a pass, none past GFX_POST_MAX*/
+static PostPass*
+_postAdd(u32 type)
+{
+	if (post.count == GFX_POST_MAX) {
+		return NULL;
+	}
+	PostPass *p = post.pass + post.count++;
+	memset(p, 0, sizeof(*p));
+	p->type = type;
+	post.serial++;
+	return p;
+}
+
+
+/*Removes all the passes*/
+void
+gfxPostClear(void)
+{
+	post.count = 0;
+	post.serial++;
+}
+
+
+/*Passes in the chain*/
+u32
+gfxPostCount(void)
+{
+	return post.count;
+}
+
+
+/*
+ * Appends an FXAA pass, smoothing pixels whose luma contrast with their
+ * diagonal neighbors is above threshold times the brightest of them (1/8 is
+ * a good start). Only one FXAA pass is run, the first one.
+ */
+void
+gfxPostFxaa(f32 threshold)
+{
+	PostPass *p = _postAdd(GFX_POST_FXAA);
+	if (p != NULL) {
+		p->threshold = threshold;
+	}
+}
+
+
+/*
+ * Appends an exponential tone map scaled so white stays white, followed by
+ * the gamma encoding (exposure 0 keeps the colors, gamma 1 is linear).
+ */
+void
+gfxPostTonemap(f32 exposure, f32 gamma)
+{
+	PostPass *p = _postAdd(GFX_POST_TONEMAP);
+	if (p == NULL) {
+		return;
+	}
+	const f32 inv_gamma = 1.0f / (gamma > 0.0f ? gamma : 1.0f);
+	const f32 white = (exposure > 0.0f ? 1.0f / (1.0f - expf(-exposure)) : 1.0f);
+	for (u32 i = 0; i < 256; ++i) {
+		f32 c = (f32) i * (1.0f / 255.0f);
+		c = (exposure > 0.0f ? (1.0f - expf(-exposure * c)) * white : c);
+		p->lut[i] = (u8) (powf(c, inv_gamma) * 255.0f + 0.5f);
+	}
+}
+
+
+/*
+ * Appends a linear fog from the view distance start to end, read from the
+ * depth with the projection the scene is drawn with.
+ */
+void
+gfxPostFog(const vec3 color, f32 start, f32 end, mat4 proj)
+{
+	mat4 inv;
+	PostPass *p = _postAdd(GFX_POST_FOG);
+	if (p == NULL) {
+		return;
+	}
+	for (u32 k = 0; k < 3; ++k) {
+		f32 c = (color[k] > 0.0f ? (color[k] < 1.0f ? color[k] : 1.0f) : 0.0f);
+		p->color |= (u32) (c * 255.0f) << (k * 8);
+	}
+	p->start = start;
+	p->inv_range = (end > start ? 1.0f / (end - start) : 1e30f);
+	/*The view z of a pixel is (z*inv[10] + inv[14]) / (z*inv[11] + inv[15]), the distance is -z*/
+	mat4_identity(inv);
+	mat4_inverse(inv, proj);
+	p->zdist[0] = -inv[10];
+	p->zdist[1] = -inv[14];
+	p->zdist[2] = inv[11];
+	p->zdist[3] = inv[15];
+}
+
+
+/*Serial of the chain, so the display knows when to run it again*/
+u32
+_gfxPostSerial(void)
+{
+	return post.serial;
+}
+
+
+/*Lerp of two pixels, all the channels at once with an 8 bit weight in [0, 256]*/
+static inline u32
+_postPixLerp(u32 a, u32 b, u32 w)
+{
+	u32 rb = ((((a & 0x00FF00FFu) * (256 - w)) + ((b & 0x00FF00FFu) * w)) >> 8) & 0x00FF00FFu;
+	u32 ag = ((((a >> 8) & 0x00FF00FFu) * (256 - w)) + (((b >> 8) & 0x00FF00FFu) * w)) & 0xFF00FF00u;
+	return rb | ag;
+}
+
+/*Rounded down average of two pixels*/
+static inline u32
+_postPixAvg(u32 a, u32 b)
+{
+	return (a & b) + (((a ^ b) & 0xFEFEFEFEu) >> 1);
+}
+
+static inline u32
+_postLumaPix(u32 c)
+{
+	return (((c & 0xFF) * 77) + (((c >> 8) & 0xFF) * 150) + (((c >> 16) & 0xFF) * 29)) >> 8;
+}
+
+
+/*Blends a row with the fog color by the view distance of each pixel*/
+static void
+_postFogRow(const PostPass *p, u32 *row, const f32 *depth, u32 n)
+{
+	u32 i = 0;
+#ifdef __SSE2__
+	const __m128 za = _mm_set1_ps(p->zdist[0]), zb = _mm_set1_ps(p->zdist[1]);
+	const __m128 zc = _mm_set1_ps(p->zdist[2]), zd = _mm_set1_ps(p->zdist[3]);
+	const __m128 start = _mm_set1_ps(p->start), scale = _mm_set1_ps(p->inv_range * 256.0f);
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(256);
+	const __m128i fog = _mm_unpacklo_epi8(_mm_set1_epi32((s32) p->color), zero);
+	for (; i + 4 <= n; i += 4) {
+		__m128 z = _mm_loadu_ps(depth + i);
+		__m128 dist = _mm_div_ps(_mm_add_ps(_mm_mul_ps(z, za), zb), _mm_add_ps(_mm_mul_ps(z, zc), zd));
+		/*NaN distances give no fog*/
+		__m128 f = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(dist, start), scale), _mm_setzero_ps());
+		f = _mm_min_ps(f, _mm_set1_ps(256.0f));
+		__m128i w = _mm_packs_epi32(_mm_cvttps_epi32(f), zero);
+		w = _mm_unpacklo_epi16(w, w);
+		__m128i w_lo = _mm_unpacklo_epi32(w, w), w_hi = _mm_unpackhi_epi32(w, w);
+		__m128i px = _mm_loadu_si128((const __m128i*) (row + i));
+		__m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, _mm_sub_epi16(one, w_lo)), _mm_mullo_epi16(fog, w_lo));
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, _mm_sub_epi16(one, w_hi)), _mm_mullo_epi16(fog, w_hi));
+		px = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+		_mm_storeu_si128((__m128i*) (row + i), px);
+	}
+#endif
+	for (; i < n; ++i) {
+		f32 dist = ((depth[i] * p->zdist[0]) + p->zdist[1]) / ((depth[i] * p->zdist[2]) + p->zdist[3]);
+		f32 f = (dist - p->start) * p->inv_range * 256.0f;
+		f = (f > 0.0f ? (f < 256.0f ? f : 256.0f) : 0.0f);
+		row[i] = _postPixLerp(row[i], p->color, (u32) f);
+	}
+}
+
+
+/*Maps each channel of a row through the tone map table*/
+static void
+_postTonemapRow(const PostPass *p, u32 *row, u32 n)
+{
+	const u8 *lut = p->lut;
+	for (u32 i = 0; i < n; ++i) {
+		const u32 c = row[i];
+		row[i] = (u32) lut[c & 0xFF] | ((u32) lut[(c >> 8) & 0xFF] << 8) |
+				 ((u32) lut[(c >> 16) & 0xFF] << 16) | (c & 0xFF000000u);
+	}
+}
+
+
+/*Runs a per pixel pass on a row*/
+static void
+_postPointRow(const PostPass *p, u32 *row, const f32 *depth, u32 n)
+{
+	switch (p->type) {
+	case GFX_POST_TONEMAP: {
+		_postTonemapRow(p, row, n);
+	} break;
+	case GFX_POST_FOG: {
+		_postFogRow(p, row, depth, n);
+	} break;
+	}
+}
+
+
+/*Luma of a row, stored from luma[0] with a copy of the edge pixels at luma[-1] and luma[n]*/
+static void
+_postLumaRow(u8 *luma, const u32 *row, u32 n)
+{
+	u32 i = 0;
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	const __m128i kr = _mm_set1_epi32(77), kg = _mm_set1_epi32(150), kb = _mm_set1_epi32(29);
+	for (; i + 4 <= n; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i*) (row + i));
+		__m128i r = _mm_and_si128(px, mask);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+		/*The products fit in the low 16 bits of each lane*/
+		__m128i l = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(r, kr), _mm_mullo_epi16(g, kg)), _mm_mullo_epi16(b, kb));
+		l = _mm_srli_epi32(l, 8);
+		l = _mm_packs_epi32(l, l);
+		l = _mm_packus_epi16(l, l);
+		s32 v = _mm_cvtsi128_si32(l);
+		memcpy(luma + i, &v, 4);
+	}
+#endif
+	for (; i < n; ++i) {
+		luma[i] = (u8) _postLumaPix(row[i]);
+	}
+	luma[-1] = luma[0];
+	luma[n] = luma[n - 1];
+}
+
+
+/*Bilinear sample of the band rows at the pixel center coordinates (x, y), clamped to them*/
+static u32
+_postSample(const u32 *rows, u32 w, u32 nrows, f32 x, f32 y)
+{
+	const f32 fx = floorf(x), fy = floorf(y);
+	const u32 wx = (u32) ((x - fx) * 256.0f), wy = (u32) ((y - fy) * 256.0f);
+	s32 x0 = (s32) fx, y0 = (s32) fy;
+	s32 x1 = x0 + 1, y1 = y0 + 1;
+	x0 = (x0 < 0 ? 0 : (x0 >= (s32) w ? (s32) w - 1 : x0));
+	x1 = (x1 < 0 ? 0 : (x1 >= (s32) w ? (s32) w - 1 : x1));
+	y0 = (y0 < 0 ? 0 : (y0 >= (s32) nrows ? (s32) nrows - 1 : y0));
+	y1 = (y1 < 0 ? 0 : (y1 >= (s32) nrows ? (s32) nrows - 1 : y1));
+	const u32 *r0 = rows + ((u32) y0 * post.stride), *r1 = rows + ((u32) y1 * post.stride);
+	return _postPixLerp(_postPixLerp(r0[x0], r0[x1], wx), _postPixLerp(r1[x0], r1[x1], wx), wy);
+}
+
+
+/*
+ * FXAA of one pixel (the console variant): blurs along the edge direction
+ * found from the diagonal lumas, with two taps or four when the wider blur
+ * stays in the luma range of the neighborhood.
+ */
+static u32
+_postFxaaPixel(const PostPass *p, const u32 *rows, const u8 *luma, u32 x, u32 r, u32 w, u32 nrows)
+{
+	const u8 *ln = luma + ((r > 0 ? r - 1 : 0) * post.luma_stride);
+	const u8 *ls = luma + ((r + 1 < nrows ? r + 1 : r) * post.luma_stride);
+	const f32 nw = ln[(s32) x - 1], ne = ln[x + 1], sw = ls[(s32) x - 1], se = ls[x + 1];
+	const f32 m = luma[(r * post.luma_stride) + x];
+	const f32 lmin = fminf(m, fminf(fminf(nw, ne), fminf(sw, se)));
+	const f32 lmax = fmaxf(m, fmaxf(fmaxf(nw, ne), fmaxf(sw, se)));
+	if (lmax - lmin < fmaxf((f32) FXAA_EDGE_MIN, lmax * p->threshold)) {
+		return rows[(r * post.stride) + x];
+	}
+	f32 dx = -((nw + ne) - (sw + se));
+	f32 dy = (nw + sw) - (ne + se);
+	const f32 reduce = fmaxf((nw + ne + sw + se) * (0.25f * FXAA_REDUCE_MUL), FXAA_REDUCE_MIN);
+	const f32 rcp = 1.0f / (fminf(fabsf(dx), fabsf(dy)) + reduce);
+	dx = fminf(fmaxf(dx * rcp, -FXAA_SPAN), FXAA_SPAN);
+	dy = fminf(fmaxf(dy * rcp, -FXAA_SPAN), FXAA_SPAN);
+
+	const f32 fx = (f32) x, fy = (f32) r;
+	const u32 a = _postPixAvg(_postSample(rows, w, nrows, fx - dx * (1.0f / 6.0f), fy - dy * (1.0f / 6.0f)),
+							  _postSample(rows, w, nrows, fx + dx * (1.0f / 6.0f), fy + dy * (1.0f / 6.0f)));
+	const u32 b = _postPixAvg(a, _postPixAvg(_postSample(rows, w, nrows, fx - dx * 0.5f, fy - dy * 0.5f),
+											 _postSample(rows, w, nrows, fx + dx * 0.5f, fy + dy * 0.5f)));
+	const f32 lb = (f32) _postLumaPix(b);
+	return (lb < lmin || lb > lmax ? a : b);
+}
+
+
+/*
+ * FXAA of row r of the band into out. Blocks of 16 pixels are first tested
+ * for contrast together, so flat areas are just copied.
+ */
+static void
+_postFxaaRow(const PostPass *p, u32 *out, const u32 *rows, const u8 *luma, u32 r, u32 w, u32 nrows)
+{
+	const u32 *row = rows + (r * post.stride);
+	const u8 *ln = luma + ((r > 0 ? r - 1 : 0) * post.luma_stride);
+	const u8 *lm = luma + (r * post.luma_stride);
+	const u8 *ls = luma + ((r + 1 < nrows ? r + 1 : r) * post.luma_stride);
+	for (u32 x = 0; x < w; x += 16) {
+		const u32 n = (w - x < 16 ? w - x : 16);
+		u32 edges = 0;
+#ifdef __SSE2__
+		__m128i nw = _mm_loadu_si128((const __m128i*) (ln + x - 1));
+		__m128i ne = _mm_loadu_si128((const __m128i*) (ln + x + 1));
+		__m128i sw = _mm_loadu_si128((const __m128i*) (ls + x - 1));
+		__m128i se = _mm_loadu_si128((const __m128i*) (ls + x + 1));
+		__m128i m = _mm_loadu_si128((const __m128i*) (lm + x));
+		__m128i hi = _mm_max_epu8(_mm_max_epu8(nw, ne), _mm_max_epu8(_mm_max_epu8(sw, se), m));
+		__m128i lo = _mm_min_epu8(_mm_min_epu8(nw, ne), _mm_min_epu8(_mm_min_epu8(sw, se), m));
+		__m128i over = _mm_subs_epu8(_mm_subs_epu8(hi, lo), _mm_set1_epi8(FXAA_EDGE_MIN - 1));
+		edges = ~(u32) _mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128())) & 0xFFFFu;
+#else
+		for (u32 i = 0; i < n; ++i) {
+			const u32 j = x + i;
+			u32 hi = lm[j], lo = lm[j];
+			const u32 l[4] = {ln[j - 1], ln[j + 1], ls[j - 1], ls[j + 1]};
+			for (u32 k = 0; k < 4; ++k) {
+				hi = (l[k] > hi ? l[k] : hi);
+				lo = (l[k] < lo ? l[k] : lo);
+			}
+			edges |= (u32) (hi - lo >= FXAA_EDGE_MIN) << i;
+		}
+#endif
+		edges &= (1u << n) - 1;
+		memcpy(out + x, row + x, n * sizeof(u32));
+		for (u32 i = 0; edges; ++i, edges >>= 1) {
+			if (edges & 1) {
+				out[x + i] = _postFxaaPixel(p, rows, luma, x + i, r, w, nrows);
+			}
+		}
+	}
+}
+
+
+/*
+ * Runs the chain on a band of display rows. The passes before FXAA are run
+ * as the rows (and the ones around the band FXAA reads) are loaded, the ones
+ * after it on the FXAA output, so all of them are done in one sweep.
+ */
+static void
+_postBand(void *data, u32 band)
+{
+	const u32 y0 = band * POST_BAND;
+	const u32 y1 = (y0 + POST_BAND < post.height ? y0 + POST_BAND : post.height);
+	const u32 vx0 = post.vp[0], vy0 = post.vp[1], vx1 = post.vp[2], vy1 = post.vp[3];
+	const u32 w = vx1 - vx0;
+	const u32 band_rows = POST_BAND + (2 * FXAA_HALO);
+	const bint fxaa = post.fxaa < post.count;
+	(void) data;
+	f32 *depth = (post.depth ? post.depth_rows + (band * band_rows * post.stride) : NULL);
+
+	/*Rows of the band in the viewport, and the ones read around them*/
+	const u32 in0 = (y0 > vy0 ? y0 : vy0), in1 = (y1 < vy1 ? y1 : vy1);
+	u32 s0 = in0, s1 = in1;
+	if (fxaa && in0 < in1) {
+		s0 = (in0 > vy0 + FXAA_HALO ? in0 - FXAA_HALO : vy0);
+		s1 = (in1 + FXAA_HALO < vy1 ? in1 + FXAA_HALO : vy1);
+		u32 *rows = post.rows + (band * band_rows * post.stride);
+		u8 *luma = post.luma + (band * band_rows * post.luma_stride) + 1;
+		for (u32 y = s0; y < s1; ++y) {
+			u32 *row = rows + ((y - s0) * post.stride);
+			f32 *d = (depth ? depth + ((y - s0) * post.stride) : NULL);
+			_gfxRowGet(y, vx0, vx1, row, d);
+			for (u32 i = 0; i < post.fxaa; ++i) {
+				_postPointRow(post.pass + i, row, d, w);
+			}
+			_postLumaRow(luma + ((y - s0) * post.luma_stride), row, w);
+		}
+	}
+	for (u32 y = y0; y < y1; ++y) {
+		u32 *out = post.dst + (y * post.width);
+		if (y < in0 || y >= in1 || w == 0) {
+			_gfxRowGet(y, 0, post.width, out, NULL);
+			continue;
+		}
+		if (vx0 > 0) {
+			_gfxRowGet(y, 0, vx0, out, NULL);
+		}
+		if (vx1 < post.width) {
+			_gfxRowGet(y, vx1, post.width, out + vx1, NULL);
+		}
+		out += vx0;
+		f32 *d = (depth ? depth + ((y - s0) * post.stride) : NULL);
+		if (fxaa) {
+			const u32 *rows = post.rows + (band * band_rows * post.stride);
+			const u8 *luma = post.luma + (band * band_rows * post.luma_stride) + 1;
+			_postFxaaRow(post.pass + post.fxaa, out, rows, luma, y - s0, w, s1 - s0);
+		} else {
+			_gfxRowGet(y, vx0, vx1, out, d);
+		}
+		for (u32 i = (fxaa ? post.fxaa + 1 : 0); i < post.count; ++i) {
+			if (post.pass[i].type != GFX_POST_FXAA) {
+				_postPointRow(post.pass + i, out, d, w);
+			}
+		}
+	}
+}
+
+
+/*
+ * Runs the chain over the viewport [x0, x1) x [y0, y1) of the display into
+ * dst (width x height in rows), the rest of the display is copied as it is.
+ */
+void
+_gfxPostRun(u32 *dst, u32 width, u32 height, const u32 vp[4])
+{
+	const u32 bands = (height + POST_BAND - 1) / POST_BAND;
+	const u32 band_rows = POST_BAND + (2 * FXAA_HALO);
+	post.fxaa = post.count;
+	post.depth = FALSE;
+	for (u32 i = 0; i < post.count; ++i) {
+		post.fxaa = (post.pass[i].type == GFX_POST_FXAA && post.fxaa == post.count ? i : post.fxaa);
+		post.depth |= (post.pass[i].type == GFX_POST_FOG);
+	}
+	post.stride = width;
+	/*Room for the 16 pixel luma loads past the row and its edge copies*/
+	post.luma_stride = ((width + 15) & ~15u) + 32;
+	const u32 size = bands * band_rows;
+	if (size > post.size || width != post.width) {
+		free(post.rows);
+		free(post.depth_rows);
+		free(post.luma);
+		post.rows = (u32*) malloc(size * post.stride * sizeof(u32));
+		post.depth_rows = (f32*) malloc(size * post.stride * sizeof(f32));
+		post.luma = (u8*) calloc(size, post.luma_stride);
+		post.size = size;
+	}
+	post.dst = dst;
+	post.width = width;
+	post.height = height;
+	memcpy(post.vp, vp, sizeof(post.vp));
+	gfxJobParallel(_postBand, NULL, bands);
+}
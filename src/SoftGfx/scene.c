@@ -0,0 +1,415 @@
+/*
+ * SoftGfx - 1.0 - public domain
+ * scene.c : Mesh container with a bounding volume hierarchy for culling
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SoftGfx/gfx.h>
+#include <SoftGfx/scene.h>
+
+
+#define SCENE_NO_NODE		0xFFFFFFFFu
+#define SCENE_MIN_SIZE		64
+#define SCENE_SAH_BINS		16
+#define SCENE_STACK_SIZE	64
+
+
+extern void _gfxFrustumPlanes(vec4 planes[6], mat4 proj);
+
+
+/*Surface area of a box (SAH cost)*/
+static inline f32
+_boxArea(const vec3 bmin, const vec3 bmax)
+{
+	f32 dx = bmax[0] - bmin[0], dy = bmax[1] - bmin[1], dz = bmax[2] - bmin[2];
+	return (dx * dy) + (dy * dz) + (dz * dx);
+}
+
+
+static inline void
+_boxEmpty(vec3 bmin, vec3 bmax)
+{
+	bmin[0] = bmin[1] = bmin[2] = INFINITY;
+	bmax[0] = bmax[1] = bmax[2] = -INFINITY;
+}
+
+
+static inline void
+_boxGrow(vec3 bmin, vec3 bmax, const vec3 omin, const vec3 omax)
+{
+	for (u32 k = 0; k < 3; ++k) {
+		bmin[k] = (omin[k] < bmin[k] ? omin[k] : bmin[k]);
+		bmax[k] = (omax[k] > bmax[k] ? omax[k] : bmax[k]);
+	}
+}
+
+
+/*World box of an object, the mesh box transformed by the model matrix*/
+static void
+_sceneObjBounds(SceneObj *obj)
+{
+	const Mesh *msh = obj->msh;
+	const f32 *m = msh->model;
+	vec3 c, e;
+
+	for (u32 k = 0; k < 3; ++k) {
+		c[k] = (msh->bmin[k] + msh->bmax[k]) * 0.5f;
+		e[k] = (msh->bmax[k] - msh->bmin[k]) * 0.5f;
+	}
+	for (u32 i = 0; i < 3; ++i) {
+		f32 wc = m[12 + i], we = 0.0f;
+		for (u32 j = 0; j < 3; ++j) {
+			wc += m[(j * 4) + i] * c[j];
+			we += fabsf(m[(j * 4) + i]) * e[j];
+		}
+		obj->bmin[i] = wc - we;
+		obj->bmax[i] = wc + we;
+	}
+}
+
+
+/*Recomputes the box of a node from its objects or children*/
+static void
+_sceneNodeBounds(Scene *scn, SceneNode *node, vec3 bmin, vec3 bmax)
+{
+	_boxEmpty(bmin, bmax);
+	if (node->count > 0) {
+		for (u32 i = 0; i < node->count; ++i) {
+			SceneObj *obj = scn->obj + scn->obj_indx[node->first + i];
+			_boxGrow(bmin, bmax, obj->bmin, obj->bmax);
+		}
+	} else {
+		SceneNode *l = scn->node + node->first, *r = l + 1;
+		_boxGrow(bmin, bmax, l->bmin, l->bmax);
+		_boxGrow(bmin, bmax, r->bmin, r->bmax);
+	}
+}
+
+
+/*Sets up an empty scene*/
+void
+gfxSceneInit(Scene *scn)
+{
+	memset(scn, 0, sizeof(*scn));
+	gfxDrawListInit(&scn->draws);
+}
+
+
+/*Frees the scene memory (not the meshes)*/
+void
+gfxSceneFree(Scene *scn)
+{
+	free(scn->obj);
+	free(scn->node);
+	free(scn->obj_indx);
+	free(scn->visible);
+	gfxDrawListFree(&scn->draws);
+	memset(scn, 0, sizeof(*scn));
+}
+
+
+/*Adds a mesh drawn with its model matrix and texture, returns its id*/
+u32
+gfxSceneAdd(Scene *scn, Mesh *msh, Tex *tex)
+{
+	if (scn->obj_count == scn->obj_size) {
+		scn->obj_size = (scn->obj_size ? scn->obj_size << 1 : SCENE_MIN_SIZE);
+		scn->obj = (SceneObj*) realloc(scn->obj, scn->obj_size * sizeof(SceneObj));
+		scn->obj_indx = (u32*) realloc(scn->obj_indx, scn->obj_size * sizeof(u32));
+		scn->visible = (u32*) realloc(scn->visible, scn->obj_size * sizeof(u32));
+		scn->node = (SceneNode*) realloc(scn->node, 2 * scn->obj_size * sizeof(SceneNode));
+	}
+	SceneObj *obj = scn->obj + scn->obj_count;
+	obj->msh = msh;
+	obj->tex = tex;
+	obj->leaf = SCENE_NO_NODE;
+	_sceneObjBounds(obj);
+	scn->dirty = TRUE;
+	return scn->obj_count++;
+}
+
+
+/*Splits the objects of a node with the binned surface area heuristic*/
+static void
+_sceneBuildNode(Scene *scn, u32 n, u32 begin, u32 end)
+{
+	SceneNode *node = scn->node + n;
+	u32 *indx = scn->obj_indx;
+	vec3 cmin, cmax;
+
+	node->first = begin;
+	node->count = end - begin;
+	_sceneNodeBounds(scn, node, node->bmin, node->bmax);
+	for (u32 i = begin; i < end; ++i) {
+		scn->obj[indx[i]].leaf = n;
+	}
+	if (node->count <= GFX_SCENE_LEAF_SIZE) {
+		return;
+	}
+
+	/*Bin the centroids along the largest axis*/
+	_boxEmpty(cmin, cmax);
+	for (u32 i = begin; i < end; ++i) {
+		SceneObj *obj = scn->obj + indx[i];
+		vec3 c;
+		for (u32 k = 0; k < 3; ++k) {
+			c[k] = (obj->bmin[k] + obj->bmax[k]) * 0.5f;
+		}
+		_boxGrow(cmin, cmax, c, c);
+	}
+	u32 axis = 0;
+	for (u32 k = 1; k < 3; ++k) {
+		axis = (cmax[k] - cmin[k] > cmax[axis] - cmin[axis] ? k : axis);
+	}
+	f32 ext = cmax[axis] - cmin[axis];
+	u32 mid = begin + ((end - begin) / 2);
+
+	if (ext > 0.0f) {
+		vec3 bin_min[SCENE_SAH_BINS], bin_max[SCENE_SAH_BINS];
+		u32 bin_count[SCENE_SAH_BINS] = {0};
+		f32 right_cost[SCENE_SAH_BINS];
+		f32 scale = (f32) SCENE_SAH_BINS / ext;
+
+		for (u32 b = 0; b < SCENE_SAH_BINS; ++b) {
+			_boxEmpty(bin_min[b], bin_max[b]);
+		}
+		for (u32 i = begin; i < end; ++i) {
+			SceneObj *obj = scn->obj + indx[i];
+			f32 c = (obj->bmin[axis] + obj->bmax[axis]) * 0.5f;
+			u32 b = (u32) ((c - cmin[axis]) * scale);
+			b = (b >= SCENE_SAH_BINS ? SCENE_SAH_BINS - 1 : b);
+			bin_count[b]++;
+			_boxGrow(bin_min[b], bin_max[b], obj->bmin, obj->bmax);
+		}
+		/*Sweep from the right, then from the left to find the cheapest split*/
+		vec3 smin, smax;
+		u32 scount = 0;
+		_boxEmpty(smin, smax);
+		for (u32 b = SCENE_SAH_BINS - 1; b > 0; --b) {
+			_boxGrow(smin, smax, bin_min[b], bin_max[b]);
+			scount += bin_count[b];
+			right_cost[b] = (scount ? _boxArea(smin, smax) * scount : 0.0f);
+		}
+		f32 best_cost = INFINITY;
+		u32 best = 0;
+		scount = 0;
+		_boxEmpty(smin, smax);
+		for (u32 b = 0; b < SCENE_SAH_BINS - 1; ++b) {
+			_boxGrow(smin, smax, bin_min[b], bin_max[b]);
+			scount += bin_count[b];
+			f32 cost = (scount ? _boxArea(smin, smax) * scount : 0.0f) + right_cost[b + 1];
+			if (scount > 0 && scount < node->count && cost < best_cost) {
+				best_cost = cost;
+				best = b;
+			}
+		}
+		/*Partition by bin, keeping the middle split if no bin boundary works*/
+		if (best_cost < INFINITY) {
+			u32 i = begin, j = end;
+			while (i < j) {
+				SceneObj *obj = scn->obj + indx[i];
+				f32 c = (obj->bmin[axis] + obj->bmax[axis]) * 0.5f;
+				u32 b = (u32) ((c - cmin[axis]) * scale);
+				b = (b >= SCENE_SAH_BINS ? SCENE_SAH_BINS - 1 : b);
+				if (b <= best) {
+					++i;
+				} else {
+					u32 tmp = indx[i];
+					indx[i] = indx[--j];
+					indx[j] = tmp;
+				}
+			}
+			mid = i;
+		}
+	}
+
+	u32 child = scn->node_count;
+	scn->node_count += 2;
+	node->first = child;
+	node->count = 0;
+	scn->node[child].parent = n;
+	scn->node[child + 1].parent = n;
+	_sceneBuildNode(scn, child, begin, mid);
+	_sceneBuildNode(scn, child + 1, mid, end);
+}
+
+
+/*Rebuilds the whole hierarchy (also done by gfxSceneCull after adding objects)*/
+void
+gfxSceneBuild(Scene *scn)
+{
+	scn->node_count = 0;
+	scn->dirty = FALSE;
+	if (scn->obj_count == 0) {
+		return;
+	}
+	for (u32 i = 0; i < scn->obj_count; ++i) {
+		scn->obj_indx[i] = i;
+		_sceneObjBounds(scn->obj + i);
+	}
+	scn->node_count = 1;
+	scn->node[0].parent = SCENE_NO_NODE;
+	_sceneBuildNode(scn, 0, 0, scn->obj_count);
+}
+
+
+/*
+ * Updates the bounds of an object after its model matrix changed, refitting
+ * its ancestors up to the first one that does not change
+ */
+void
+gfxSceneUpdate(Scene *scn, u32 id)
+{
+	SceneObj *obj = scn->obj + id;
+	_sceneObjBounds(obj);
+	if (scn->dirty) {
+		return;
+	}
+	u32 n = obj->leaf;
+	while (n != SCENE_NO_NODE) {
+		SceneNode *node = scn->node + n;
+		vec3 bmin, bmax;
+		_sceneNodeBounds(scn, node, bmin, bmax);
+		if (vec3_eq(bmin, node->bmin) && vec3_eq(bmax, node->bmax)) {
+			break;
+		}
+		memcpy(node->bmin, bmin, sizeof(vec3));
+		memcpy(node->bmax, bmax, sizeof(vec3));
+		n = node->parent;
+	}
+}
+
+
+/*
+ * Refits every node after many objects moved (children are always stored
+ * after their parent). Call gfxSceneBuild instead if the tree got too loose.
+ */
+void
+gfxSceneRefit(Scene *scn)
+{
+	for (u32 i = 0; i < scn->obj_count; ++i) {
+		_sceneObjBounds(scn->obj + i);
+	}
+	for (u32 n = scn->node_count; n-- > 0;) {
+		SceneNode *node = scn->node + n;
+		_sceneNodeBounds(scn, node, node->bmin, node->bmax);
+	}
+}
+
+
+/*Adds all the objects under a node to the visible list*/
+static void
+_sceneAddAll(Scene *scn, u32 n)
+{
+	SceneNode *node = scn->node + n;
+	if (node->count > 0) {
+		for (u32 i = 0; i < node->count; ++i) {
+			scn->visible[scn->visible_count++] = scn->obj_indx[node->first + i];
+		}
+		return;
+	}
+	_sceneAddAll(scn, node->first);
+	_sceneAddAll(scn, node->first + 1);
+}
+
+
+/*
+ * Tests a box against the planes in mask, the planes the box is completely
+ * inside of are removed from the mask
+ */
+static bint
+_sceneBoxCulled(vec4 planes[6], u32 *mask, const vec3 bmin, const vec3 bmax)
+{
+	for (u32 p = 0; p < 6; ++p) {
+		if (!(*mask & (1u << p))) {
+			continue;
+		}
+		f32 d = planes[p][3], r = 0.0f;
+		for (u32 k = 0; k < 3; ++k) {
+			d += planes[p][k] * (bmin[k] + bmax[k]) * 0.5f;
+			r += fabsf(planes[p][k]) * (bmax[k] - bmin[k]) * 0.5f;
+		}
+		if (d + r < 0.0f) {
+			return TRUE;
+		}
+		if (d - r >= 0.0f) {
+			*mask &= ~(1u << p);
+		}
+	}
+	return FALSE;
+}
+
+
+/*
+ * Finds the objects whose box intersects the view frustum, walking down the
+ * hierarchy and only testing the planes the parent box was not fully inside.
+ * Returns the number of visible objects and their ids in *ids.
+ */
+u32
+gfxSceneCull(Scene *scn, mat4 proj, mat4 view, const u32 **ids)
+{
+	struct { u32 node; u32 mask; } stack[SCENE_STACK_SIZE];
+	vec4 planes[6];
+	mat4 clip;
+	u32 top = 0;
+
+	if (scn->dirty) {
+		gfxSceneBuild(scn);
+	}
+	scn->visible_count = 0;
+	*ids = scn->visible;
+	if (scn->node_count == 0) {
+		return 0;
+	}
+	/*World space planes*/
+	mat4_mul(clip, proj, view);
+	_gfxFrustumPlanes(planes, clip);
+
+	stack[top].node = 0;
+	stack[top++].mask = 0x3F;
+	while (top > 0) {
+		--top;
+		u32 n = stack[top].node, mask = stack[top].mask;
+		SceneNode *node = scn->node + n;
+		if (_sceneBoxCulled(planes, &mask, node->bmin, node->bmax)) {
+			continue;
+		}
+		/*Completely inside, no more tests below this node*/
+		if (mask == 0) {
+			_sceneAddAll(scn, n);
+		} else if (node->count > 0) {
+			for (u32 i = 0; i < node->count; ++i) {
+				u32 id = scn->obj_indx[node->first + i], obj_mask = mask;
+				if (!_sceneBoxCulled(planes, &obj_mask, scn->obj[id].bmin, scn->obj[id].bmax)) {
+					scn->visible[scn->visible_count++] = id;
+				}
+			}
+		} else if (top + 2 <= SCENE_STACK_SIZE) {
+			stack[top].node = node->first;
+			stack[top++].mask = mask;
+			stack[top].node = node->first + 1;
+			stack[top++].mask = mask;
+		} else {
+			_sceneAddAll(scn, n);
+		}
+	}
+	return scn->visible_count;
+}
+
+
+/*Draws the visible objects through the scene draw list (sorted front to back)*/
+void
+gfxSceneDraw(Scene *scn, mat4 proj, mat4 view)
+{
+	const u32 *ids;
+	u32 count = gfxSceneCull(scn, proj, view, &ids);
+
+	gfxDrawListClear(&scn->draws);
+	for (u32 i = 0; i < count; ++i) {
+		SceneObj *obj = scn->obj + ids[i];
+		gfxDrawListAdd(&scn->draws, obj->msh, obj->msh->model, obj->tex);
+	}
+	gfxDrawListSubmit(&scn->draws, proj, view);
+}
@@ -8,6 +8,7 @@
 #include <SoftGfx/vm_math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 
@@ -68,11 +69,52 @@ gfxTexLoadBMP(const char *filename)
 
 
 
-/*Samples the i-th texture*/
+/*Arguments of a background texture load*/
+typedef struct TexLoadJob_tag {
+	Tex**	tex;
+	char	filename[];
+} TexLoadJob;
+
+static void
+_texLoadJob(void *data, u32 index)
+{
+	TexLoadJob *ld = (TexLoadJob*) data;
+	(void) index;
+	*ld->tex = gfxTexLoadBMP(ld->filename);
+	free(ld);
+}
+
+
+/*Starts loading a BMP texture on the job threads, *tex is set before gfxJobDone is TRUE*/
+Job*
+gfxTexLoadBMPAsync(Tex **tex, const char *filename)
+{
+	size_t len = strlen(filename) + 1;
+	TexLoadJob *ld = (TexLoadJob*) malloc(sizeof(TexLoadJob) + len);
+	*tex = NULL;
+	ld->tex = tex;
+	memcpy(ld->filename, filename, len);
+	return gfxJobAsync(_texLoadJob, ld);
+}
+
+
+
+/*Texel at byte offset iuv, BGR(A) in the file. Textures without alpha are opaque*/
+static inline void
+_texFetch(vec4 out, const Tex *tex, u32 iuv)
+{
+	out[2] = ((f32) tex->data[iuv]) / 255.0f;
+	out[1] = ((f32) tex->data[iuv + 1]) / 255.0f;
+	out[0] = ((f32) tex->data[iuv + 2]) / 255.0f;
+	out[3] = (tex->bpp == 4 ? ((f32) tex->data[iuv + 3]) / 255.0f : 1.0f);
+}
+
+
+/*Samples the i-th texture, the alpha comes from 32 bpp textures*/
 void
-_gfxSampleTex(vec3 sample_out, Tex *tex, vec2 uv)
+_gfxSampleTex(vec4 sample_out, Tex *tex, vec2 uv)
 {
-	vec3 c0, c1, c2, c3;
+	vec4 c0, c1, c2, c3;
 
 	f64 ifu, ifv;
 	f64 fu = modf((f64) uv[0] * (tex->w - 1), &ifu);
@@ -81,30 +123,20 @@ _gfxSampleTex(vec3 sample_out, Tex *tex, vec2 uv)
 	u32 iv = ((u32)ifv) % tex->h;
 
 	u32 iuv = (iu * tex->bpp) + (iv * tex->bpp * tex->w);
-	c0[2] = ((f32) tex->data[iuv]) / 255.0f;
-	c0[1] = ((f32) tex->data[iuv + 1]) / 255.0f;
-	c0[0] = ((f32) tex->data[iuv + 2]) / 255.0f;
-
+	_texFetch(c0, tex, iuv);
 	iuv += tex->bpp;
-	c1[2] = ((f32) tex->data[iuv]) / 255.0f;
-	c1[1] = ((f32) tex->data[iuv + 1]) / 255.0f;
-	c1[0] = ((f32) tex->data[iuv + 2]) / 255.0f;
-
+	_texFetch(c1, tex, iuv);
 	iuv += tex->bpp * (tex->w - 1);
-	c2[2] = ((f32) tex->data[iuv]) / 255.0f;
-	c2[1] = ((f32) tex->data[iuv + 1]) / 255.0f;
-	c2[0] = ((f32) tex->data[iuv + 2]) / 255.0f;
-
+	_texFetch(c2, tex, iuv);
 	iuv += tex->bpp;
-	c3[2] = ((f32) tex->data[iuv]) / 255.0f;
-	c3[1] = ((f32) tex->data[iuv + 1]) / 255.0f;
-	c3[0] = ((f32) tex->data[iuv + 2]) / 255.0f;
+	_texFetch(c3, tex, iuv);
 
 	vec3_lerp(c0, c0, c2, fv);
 	vec3_lerp(c1, c1, c3, fv);
 	vec3_lerp(sample_out, c0, c1, fu);
-
-	vec3_lerp(sample_out, c0, c1, fu);
+	c0[3] = c0[3] + ((f32) fv * (c2[3] - c0[3]));
+	c1[3] = c1[3] + ((f32) fv * (c3[3] - c1[3]));
+	sample_out[3] = c0[3] + ((f32) fu * (c1[3] - c0[3]));
 }
 
 
@@ -6,6 +6,9 @@
 #include <string.h>
 #include <math.h>
 #include <SoftGfx/vm_math.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 /* Returns the addition of vector v and u */
 f32*
@@ -243,6 +246,23 @@ mat4_identity(mat4 m)
 void
 mat4_mul(mat4 dest, const mat4 m1, const mat4 m2)
 {
+#ifdef __SSE__
+	/*Each column of dest is a combination of the columns of m1, same order of operations as below*/
+	const __m128 c0 = _mm_loadu_ps(m1), c1 = _mm_loadu_ps(m1 + 4),
+				 c2 = _mm_loadu_ps(m1 + 8), c3 = _mm_loadu_ps(m1 + 12);
+	__m128 r[4];
+	for (u32 j = 0; j < 4; ++j) {
+		const f32 *b = m2 + (j * 4);
+		r[j] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(c0, _mm_set1_ps(b[0])), _mm_mul_ps(c1, _mm_set1_ps(b[1]))),
+				_mm_mul_ps(c2, _mm_set1_ps(b[2]))), _mm_mul_ps(c3, _mm_set1_ps(b[3])));
+	}
+	/*Stored at the end, dest may be m1 or m2*/
+	_mm_storeu_ps(dest, r[0]);
+	_mm_storeu_ps(dest + 4, r[1]);
+	_mm_storeu_ps(dest + 8, r[2]);
+	_mm_storeu_ps(dest + 12, r[3]);
+#else
 	const f32
 		b00 = m1[0], b01 = m1[4], b02 = m1[8],  b03 = m1[12],
 		b10 = m1[1], b11 = m1[5], b12 = m1[9],  b13 = m1[13],
@@ -273,6 +293,7 @@ mat4_mul(mat4 dest, const mat4 m1, const mat4 m2)
 	dest[13] = a03*b10 + a13*b11 + a23*b12 + a33*b13;
 	dest[14] = a03*b20 + a13*b21 + a23*b22 + a33*b23;
 	dest[15] = a03*b30 + a13*b31 + a23*b32 + a33*b33;
+#endif
 }
 
 
@@ -307,6 +328,40 @@ mat4_normalMatrix(mat3 dest, const mat4 m)
 }
 
 
+/* Inverse of m (cofactor expansion), dest is unchanged if m is singular. */
+void
+mat4_inverse(mat4 dest, const mat4 m)
+{
+	mat4 inv;
+	inv[0]  =  m[5]*m[10]*m[15] - m[5]*m[11]*m[14] - m[9]*m[6]*m[15] + m[9]*m[7]*m[14] + m[13]*m[6]*m[11] - m[13]*m[7]*m[10];
+	inv[4]  = -m[4]*m[10]*m[15] + m[4]*m[11]*m[14] + m[8]*m[6]*m[15] - m[8]*m[7]*m[14] - m[12]*m[6]*m[11] + m[12]*m[7]*m[10];
+	inv[8]  =  m[4]*m[9]*m[15]  - m[4]*m[11]*m[13] - m[8]*m[5]*m[15] + m[8]*m[7]*m[13] + m[12]*m[5]*m[11] - m[12]*m[7]*m[9];
+	inv[12] = -m[4]*m[9]*m[14]  + m[4]*m[10]*m[13] + m[8]*m[5]*m[14] - m[8]*m[6]*m[13] - m[12]*m[5]*m[10] + m[12]*m[6]*m[9];
+	inv[1]  = -m[1]*m[10]*m[15] + m[1]*m[11]*m[14] + m[9]*m[2]*m[15] - m[9]*m[3]*m[14] - m[13]*m[2]*m[11] + m[13]*m[3]*m[10];
+	inv[5]  =  m[0]*m[10]*m[15] - m[0]*m[11]*m[14] - m[8]*m[2]*m[15] + m[8]*m[3]*m[14] + m[12]*m[2]*m[11] - m[12]*m[3]*m[10];
+	inv[9]  = -m[0]*m[9]*m[15]  + m[0]*m[11]*m[13] + m[8]*m[1]*m[15] - m[8]*m[3]*m[13] - m[12]*m[1]*m[11] + m[12]*m[3]*m[9];
+	inv[13] =  m[0]*m[9]*m[14]  - m[0]*m[10]*m[13] - m[8]*m[1]*m[14] + m[8]*m[2]*m[13] + m[12]*m[1]*m[10] - m[12]*m[2]*m[9];
+	inv[2]  =  m[1]*m[6]*m[15]  - m[1]*m[7]*m[14]  - m[5]*m[2]*m[15] + m[5]*m[3]*m[14] + m[13]*m[2]*m[7]  - m[13]*m[3]*m[6];
+	inv[6]  = -m[0]*m[6]*m[15]  + m[0]*m[7]*m[14]  + m[4]*m[2]*m[15] - m[4]*m[3]*m[14] - m[12]*m[2]*m[7]  + m[12]*m[3]*m[6];
+	inv[10] =  m[0]*m[5]*m[15]  - m[0]*m[7]*m[13]  - m[4]*m[1]*m[15] + m[4]*m[3]*m[13] + m[12]*m[1]*m[7]  - m[12]*m[3]*m[5];
+	inv[14] = -m[0]*m[5]*m[14]  + m[0]*m[6]*m[13]  + m[4]*m[1]*m[14] - m[4]*m[2]*m[13] - m[12]*m[1]*m[6]  + m[12]*m[2]*m[5];
+	inv[3]  = -m[1]*m[6]*m[11]  + m[1]*m[7]*m[10]  + m[5]*m[2]*m[11] - m[5]*m[3]*m[10] - m[9]*m[2]*m[7]   + m[9]*m[3]*m[6];
+	inv[7]  =  m[0]*m[6]*m[11]  - m[0]*m[7]*m[10]  - m[4]*m[2]*m[11] + m[4]*m[3]*m[10] + m[8]*m[2]*m[7]   - m[8]*m[3]*m[6];
+	inv[11] = -m[0]*m[5]*m[11]  + m[0]*m[7]*m[9]   + m[4]*m[1]*m[11] - m[4]*m[3]*m[9]  - m[8]*m[1]*m[7]   + m[8]*m[3]*m[5];
+	inv[15] =  m[0]*m[5]*m[10]  - m[0]*m[6]*m[9]   - m[4]*m[1]*m[10] + m[4]*m[2]*m[9]  + m[8]*m[1]*m[6]   - m[8]*m[2]*m[5];
+
+	f32 d = m[0]*inv[0] + m[1]*inv[4] + m[2]*inv[8] + m[3]*inv[12];
+	/* check if inverse exists */
+	if (!d) {
+		return;
+	}
+	d = 1.0f / d;
+	for (u32 i = 0; i < 16; ++i) {
+		dest[i] = inv[i] * d;
+	}
+}
+
+
 /* Applies traslation to m. */
 void
 mat4_translate(mat4 m, vec3 v)
@@ -399,3 +454,205 @@ mat4_perspective(mat4 m, f32 fovy, f32 aspect, f32 znear, f32 zfar)
 
 
 
+
+
+//==============================================================================
+// BATCH FUNCTIONS
+//==============================================================================
+/*
+ * Array versions of the functions above. SoA functions take one array per
+ * component, AoS ones arrays of vec4 (16 byte aligned for the best speed).
+ * Destination arrays can be the same as the source ones. With SSE four
+ * elements are done at once, the remainder (and builds without SSE) use
+ * the scalar code.
+ */
+
+/* Transforms count points by m (w = 1, no homogenization) */
+void
+vec3_mat4MulSoA(f32 *dx, f32 *dy, f32 *dz, const mat4 m,
+				const f32 *x, const f32 *y, const f32 *z, u32 count)
+{
+	u32 i = 0;
+#ifdef __SSE__
+	const __m128 m0 = _mm_set1_ps(m[0]), m4 = _mm_set1_ps(m[4]), m8 = _mm_set1_ps(m[8]),   m12 = _mm_set1_ps(m[12]),
+				 m1 = _mm_set1_ps(m[1]), m5 = _mm_set1_ps(m[5]), m9 = _mm_set1_ps(m[9]),   m13 = _mm_set1_ps(m[13]),
+				 m2 = _mm_set1_ps(m[2]), m6 = _mm_set1_ps(m[6]), m10 = _mm_set1_ps(m[10]), m14 = _mm_set1_ps(m[14]);
+	for (; i + 4 <= count; i += 4) {
+		__m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+		_mm_storeu_ps(dx + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m4, py)), _mm_mul_ps(m8, pz)), m12));
+		_mm_storeu_ps(dy + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, px), _mm_mul_ps(m5, py)), _mm_mul_ps(m9, pz)), m13));
+		_mm_storeu_ps(dz + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, px), _mm_mul_ps(m6, py)), _mm_mul_ps(m10, pz)), m14));
+	}
+#endif
+	for (; i < count; ++i) {
+		f32 px = x[i], py = y[i], pz = z[i];
+		dx[i] = (m[0] * px) + (m[4] * py) + (m[8] * pz) + m[12];
+		dy[i] = (m[1] * px) + (m[5] * py) + (m[9] * pz) + m[13];
+		dz[i] = (m[2] * px) + (m[6] * py) + (m[10] * pz) + m[14];
+	}
+}
+
+
+/* Multiplies count vectors by the 3x3 matrix m (normals by the normal matrix) */
+void
+vec3_matMulSoA(f32 *dx, f32 *dy, f32 *dz, const mat3 m,
+			   const f32 *x, const f32 *y, const f32 *z, u32 count)
+{
+	u32 i = 0;
+#ifdef __SSE__
+	const __m128 m0 = _mm_set1_ps(m[0]), m3 = _mm_set1_ps(m[3]), m6 = _mm_set1_ps(m[6]),
+				 m1 = _mm_set1_ps(m[1]), m4 = _mm_set1_ps(m[4]), m7 = _mm_set1_ps(m[7]),
+				 m2 = _mm_set1_ps(m[2]), m5 = _mm_set1_ps(m[5]), m8 = _mm_set1_ps(m[8]);
+	for (; i + 4 <= count; i += 4) {
+		__m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+		_mm_storeu_ps(dx + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m3, py)), _mm_mul_ps(m6, pz)));
+		_mm_storeu_ps(dy + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, px), _mm_mul_ps(m4, py)), _mm_mul_ps(m7, pz)));
+		_mm_storeu_ps(dz + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, px), _mm_mul_ps(m5, py)), _mm_mul_ps(m8, pz)));
+	}
+#endif
+	for (; i < count; ++i) {
+		f32 px = x[i], py = y[i], pz = z[i];
+		dx[i] = (m[0] * px) + (m[3] * py) + (m[6] * pz);
+		dy[i] = (m[1] * px) + (m[4] * py) + (m[7] * pz);
+		dz[i] = (m[2] * px) + (m[5] * py) + (m[8] * pz);
+	}
+}
+
+
+/* Normalizes count vectors (zero vectors are left as they are) */
+void
+vec3_normalizeSoA(f32 *x, f32 *y, f32 *z, u32 count)
+{
+	u32 i = 0;
+#ifdef __SSE__
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+		__m128 mag = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+		__m128 valid = _mm_cmpgt_ps(mag, zero);
+		__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(mag));
+		inv = _mm_or_ps(_mm_and_ps(valid, inv), _mm_andnot_ps(valid, one));
+		_mm_storeu_ps(x + i, _mm_mul_ps(vx, inv));
+		_mm_storeu_ps(y + i, _mm_mul_ps(vy, inv));
+		_mm_storeu_ps(z + i, _mm_mul_ps(vz, inv));
+	}
+#endif
+	for (; i < count; ++i) {
+		vec3 v = {x[i], y[i], z[i]};
+		vec3_normalize(v);
+		x[i] = v[0];
+		y[i] = v[1];
+		z[i] = v[2];
+	}
+}
+
+
+/* Dot products of count pairs of vectors */
+void
+vec3_dotSoA(f32 *dest, const f32 *ax, const f32 *ay, const f32 *az,
+			const f32 *bx, const f32 *by, const f32 *bz, u32 count)
+{
+	u32 i = 0;
+#ifdef __SSE__
+	for (; i + 4 <= count; i += 4) {
+		__m128 d = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_loadu_ps(ax + i), _mm_loadu_ps(bx + i)),
+			_mm_mul_ps(_mm_loadu_ps(ay + i), _mm_loadu_ps(by + i))),
+			_mm_mul_ps(_mm_loadu_ps(az + i), _mm_loadu_ps(bz + i)));
+		_mm_storeu_ps(dest + i, d);
+	}
+#endif
+	for (; i < count; ++i) {
+		dest[i] = (ax[i] * bx[i]) + (ay[i] * by[i]) + (az[i] * bz[i]);
+	}
+}
+
+
+/*
+ * Projects count points by m and homogenizes them, dw gets 1 / w (what the
+ * rasterizer uses for perspective correction)
+ */
+void
+vec3_projectSoA(f32 *dx, f32 *dy, f32 *dz, f32 *dw, const mat4 m,
+				const f32 *x, const f32 *y, const f32 *z, u32 count)
+{
+	u32 i = 0;
+#ifdef __SSE__
+	const __m128 m0 = _mm_set1_ps(m[0]), m4 = _mm_set1_ps(m[4]), m8 = _mm_set1_ps(m[8]),   m12 = _mm_set1_ps(m[12]),
+				 m1 = _mm_set1_ps(m[1]), m5 = _mm_set1_ps(m[5]), m9 = _mm_set1_ps(m[9]),   m13 = _mm_set1_ps(m[13]),
+				 m2 = _mm_set1_ps(m[2]), m6 = _mm_set1_ps(m[6]), m10 = _mm_set1_ps(m[10]), m14 = _mm_set1_ps(m[14]),
+				 m3 = _mm_set1_ps(m[3]), m7 = _mm_set1_ps(m[7]), m11 = _mm_set1_ps(m[11]), m15 = _mm_set1_ps(m[15]);
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+		__m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m3, px), _mm_mul_ps(m7, py)), _mm_mul_ps(m11, pz)), m15);
+		__m128 inv = _mm_div_ps(one, w);
+		_mm_storeu_ps(dx + i, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m4, py)), _mm_mul_ps(m8, pz)), m12), inv));
+		_mm_storeu_ps(dy + i, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, px), _mm_mul_ps(m5, py)), _mm_mul_ps(m9, pz)), m13), inv));
+		_mm_storeu_ps(dz + i, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, px), _mm_mul_ps(m6, py)), _mm_mul_ps(m10, pz)), m14), inv));
+		_mm_storeu_ps(dw + i, inv);
+	}
+#endif
+	for (; i < count; ++i) {
+		vec3 p = {x[i], y[i], z[i]}, sp;
+		f32 inv = 1.0f / vec3_mat4MulStandard(sp, m, p);
+		dx[i] = sp[0] * inv;
+		dy[i] = sp[1] * inv;
+		dz[i] = sp[2] * inv;
+		dw[i] = inv;
+	}
+}
+
+
+/* Multiplies count vec4 by m (no homogenization) */
+void
+vec4_mat4MulArr(vec4 *dest, const mat4 m, const vec4 *src, u32 count)
+{
+#ifdef __SSE__
+	const __m128 c0 = _mm_loadu_ps(m), c1 = _mm_loadu_ps(m + 4),
+				 c2 = _mm_loadu_ps(m + 8), c3 = _mm_loadu_ps(m + 12);
+	for (u32 i = 0; i < count; ++i) {
+		const f32 *p = src[i];
+		__m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(c0, _mm_set1_ps(p[0])), _mm_mul_ps(c1, _mm_set1_ps(p[1]))),
+			_mm_mul_ps(c2, _mm_set1_ps(p[2]))), _mm_mul_ps(c3, _mm_set1_ps(p[3])));
+		_mm_storeu_ps(dest[i], r);
+	}
+#else
+	for (u32 i = 0; i < count; ++i) {
+		f32 px = src[i][0], py = src[i][1], pz = src[i][2], pw = src[i][3];
+		for (u32 k = 0; k < 4; ++k) {
+			dest[i][k] = (m[k] * px) + (m[4 + k] * py) + (m[8 + k] * pz) + (m[12 + k] * pw);
+		}
+	}
+#endif
+}
+
+
+/* Projects count points (w is ignored) by m, dest gets xyz / w and 1 / w */
+void
+vec4_projectArr(vec4 *dest, const mat4 m, const vec4 *src, u32 count)
+{
+#ifdef __SSE__
+	const __m128 c0 = _mm_loadu_ps(m), c1 = _mm_loadu_ps(m + 4),
+				 c2 = _mm_loadu_ps(m + 8), c3 = _mm_loadu_ps(m + 12);
+	for (u32 i = 0; i < count; ++i) {
+		const f32 *p = src[i];
+		__m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(c0, _mm_set1_ps(p[0])), _mm_mul_ps(c1, _mm_set1_ps(p[1]))),
+			_mm_mul_ps(c2, _mm_set1_ps(p[2]))), c3);
+		__m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3)));
+		_mm_storeu_ps(dest[i], _mm_mul_ps(r, inv));
+		dest[i][3] = _mm_cvtss_f32(inv);
+	}
+#else
+	for (u32 i = 0; i < count; ++i) {
+		vec3 p = {src[i][0], src[i][1], src[i][2]}, sp;
+		f32 inv = 1.0f / vec3_mat4MulStandard(sp, m, p);
+		dest[i][0] = sp[0] * inv;
+		dest[i][1] = sp[1] * inv;
+		dest[i][2] = sp[2] * inv;
+		dest[i][3] = inv;
+	}
+#endif
+}
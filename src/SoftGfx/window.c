@@ -25,11 +25,27 @@ extern void appKeyboard(SDL_Scancode key, u32 state);
 /* Functions for the display */
 extern void gfxDisplayQuit(void);
 extern u32* gfxDisplayGet(void);
+extern u32* gfxDisplayPresent(void);
 extern void gfxDisplayInit(u32 width, u32 height, u32 win_width, u32 win_height);
 
 static SDL_Renderer *renderer;
 static SDL_Window *window;
 
+/*Frame times, dumped to the file in SOFTGFX_FRAME_CSV if set, F1 shows them*/
+static FrameStats stats;
+static bint stats_overlay;
+
+
+/*Milliseconds since the counter value, moving it to now*/
+static f32
+_windowLap(u64 *counter)
+{
+	u64 now = SDL_GetPerformanceCounter();
+	f32 ms = (f32) (now - *counter) * 1000.0f / (f32) SDL_GetPerformanceFrequency();
+	*counter = now;
+	return ms;
+}
+
 
 int
 main(int argc, char **argv)
@@ -50,6 +66,8 @@ main(int argc, char **argv)
 	gfxDisplayInit(DISP_W, DISP_H, DISP_W, DISP_H);
 	gfxClearColor(0x00u, 0x00u, 0x00u);
 
+	gfxFrameStatsInit(&stats, getenv("SOFTGFX_FRAME_CSV"));
+
 	/* Call the users functions */
 	appSetup();
 	appDraw();
@@ -64,10 +82,15 @@ main(int argc, char **argv)
 				case SDL_QUIT: {
 					appQuit();
 					gfxDisplayQuit();
+					gfxFrameStatsPrint(&stats, stdout);
+					gfxFrameStatsFree(&stats);
 					exit(0);
 				} break;
 
 				case SDL_KEYDOWN: {
+					if (ev.key.keysym.scancode == SDL_SCANCODE_F1) {
+						stats_overlay = !stats_overlay;
+					}
 					appKeyboard(ev.key.keysym.scancode, ev.key.state);
 				} break;
 
@@ -80,16 +103,30 @@ main(int argc, char **argv)
 			}
 		}
 
-		SDL_SetRenderDrawColor(renderer, 20, 20, 20, 255);
-		SDL_RenderClear(renderer);
-		int *pix, pitch;
-		SDL_LockTexture(main_tex, NULL, (void**) &pix, &pitch);
+		f32 ms[GFX_STAT_COUNT];
+		u64 lap = SDL_GetPerformanceCounter();
 		appUpdate();
+		ms[GFX_STAT_UPDATE] = _windowLap(&lap);
 		appDraw();
-		memcpy(pix, gfxDisplayGet(), pitch * DISP_H);
+		ms[GFX_STAT_DRAW] = _windowLap(&lap);
+
+		int *pix, pitch;
+		SDL_LockTexture(main_tex, NULL, (void**) &pix, &pitch);
+		memcpy(pix, gfxDisplayPresent(), pitch * DISP_H);
+		if (stats_overlay) {
+			gfxFrameStatsOverlay(&stats, (u32*) pix, pitch / sizeof(u32), DISP_W, DISP_H);
+		}
 		SDL_UnlockTexture(main_tex);
+		ms[GFX_STAT_COPY] = _windowLap(&lap);
+
+		SDL_SetRenderDrawColor(renderer, 20, 20, 20, 255);
+		SDL_RenderClear(renderer);
 		SDL_RenderCopy(renderer, main_tex, NULL, &screen_dst);
 		SDL_RenderPresent(renderer);
+		ms[GFX_STAT_PRESENT] = _windowLap(&lap);
+		gfxFrameStatsAdd(&stats, ms);
+		/*The dynamic resolution adapts to the whole frame, the post chain and upscale run in the copy*/
+		gfxFrameTime(ms[GFX_STAT_UPDATE] + ms[GFX_STAT_DRAW] + ms[GFX_STAT_COPY] + ms[GFX_STAT_PRESENT]);
 	}
 	return 0;
 }
@@ -61,6 +61,9 @@ struct AppState_t {
 	/*Current projection matrix*/
 	Mesh mesh[2];
 	Tex  *texture[2];
+	/*Pending background loads (NULL when done)*/
+	Job  *mesh_load[2];
+	Job  *tex_load[2];
 	/* Both camera views */
 	mat4 proj;
 	mat4 cam[3];
@@ -74,12 +77,18 @@ struct AppState_t {
 	bint mesh_mode;
 	bint tex_mode;
 	bint mtrl_mode;
+	bint msaa;
+	bint fxaa;
+	u32 wireframe;
 
 	u32	light_act;
 	u32	light_mode;
 	u32	camera_mat;
 
 	u32 keys;
+
+	/*Redraws only what changed from the last frame*/
+	DrawList draws;
 } state;
 
 
@@ -135,13 +144,35 @@ appKeyboard(SDL_Scancode key, u32 event)
 			/*Toggle used texture*/
 			case SDL_SCANCODE_T:{
 				state.tex_mode = (state.tex_mode + 1) & 1;
-				g_tex = state.texture[state.tex_mode];
+				g_tex = (state.tex_load[state.tex_mode] == NULL ? state.texture[state.tex_mode] : NULL);
 			} break;
 			/*Toggle used material*/
 			case SDL_SCANCODE_K:{
 				state.mtrl_mode = (state.mtrl_mode + 1) & 1;
-				state.mesh[0].mtrl = mtrl_set[state.mtrl_mode];
-				state.mesh[1].mtrl = mtrl_set[state.mtrl_mode];
+				/*Meshes still loading get it from appLoadPoll when they are done*/
+				for (u32 i = 0; i < 2; ++i) {
+					if (state.mesh_load[i] == NULL) {
+						state.mesh[i].mtrl = mtrl_set[state.mtrl_mode];
+					}
+				}
+			} break;
+			/*Toggle 4x MSAA*/
+			case SDL_SCANCODE_A:{
+				state.msaa = !state.msaa;
+				gfxSet(GFX_MSAA, (state.msaa ? 4 : 1));
+			} break;
+			/*Toggle the FXAA post-process pass*/
+			case SDL_SCANCODE_F:{
+				state.fxaa = !state.fxaa;
+				gfxPostClear();
+				if (state.fxaa) {
+					gfxPostFxaa(0.125f);
+				}
+			} break;
+			/*Cycle the wireframe modes*/
+			case SDL_SCANCODE_W:{
+				state.wireframe = (state.wireframe + 1) % 3;
+				gfxSet(GFX_WIREFRAME, state.wireframe);
 			} break;
 			default: break;
 		}
@@ -165,6 +196,30 @@ appUpdate()
 }
 
 
+/* Checks the background loads, returns TRUE when all of them are done */
+bint
+appLoadPoll(void)
+{
+	bint done = TRUE;
+	for (u32 i = 0; i < 2; ++i) {
+		if (state.mesh_load[i] != NULL && gfxJobDone(state.mesh_load[i])) {
+			gfxJobWait(state.mesh_load[i]);
+			state.mesh_load[i] = NULL;
+			state.mesh[i].mtrl = mtrl_set[state.mtrl_mode];
+			printf("MESH READ DONE: %s\n", (i == 0 ? "res/mesh/bunny.obj" : "res/mesh/statue.obj"));
+		}
+		if (state.tex_load[i] != NULL && gfxJobDone(state.tex_load[i])) {
+			gfxJobWait(state.tex_load[i]);
+			state.tex_load[i] = NULL;
+			printf("TEXTURE READ: %s\n", (i == 0 ? "res/textures/wood.bmp" : "res/textures/stone.bmp"));
+		}
+		done &= (state.mesh_load[i] == NULL && state.tex_load[i] == NULL);
+	}
+	g_tex = (state.tex_load[state.tex_mode] == NULL ? state.texture[state.tex_mode] : NULL);
+	return done;
+}
+
+
 /* Draws to screen */
 int
 appDraw()
@@ -174,17 +229,22 @@ appDraw()
 	/*Since the scale is off, we must scale the models*/
 	vec3 scl[2] =	{{0.04f, 0.04f, 0.04f}, 	// bunny
 					{0.02f, 0.02f, 0.02f}};		// statue
-	/*Clear display*/
-	gfxClear();
-	/*Create model matrix */
-	mat4_identity(g_mesh->model);
-	mat4_rotate(g_mesh->model, up_x, state.angle_y);
-	mat4_rotate(g_mesh->model, up_y, state.angle_x);
-	mat4_scale(g_mesh->model, scl[state.mesh_mode]);
+	/*The list clears the display, only where the frame changed*/
+	gfxDrawListClear(&state.draws);
+	/*The mesh may still be loading*/
+	appLoadPoll();
+	if (state.mesh_load[state.mesh_mode] == NULL) {
+		/*Create model matrix */
+		mat4_identity(g_mesh->model);
+		mat4_rotate(g_mesh->model, up_x, state.angle_y);
+		mat4_rotate(g_mesh->model, up_y, state.angle_x);
+		mat4_scale(g_mesh->model, scl[state.mesh_mode]);
+		gfxDrawListAdd(&state.draws, g_mesh, g_mesh->model, g_tex);
+	}
 	/*Set lights*/
 	gfxLightViewUpdate(state.cam[state.camera_mat]);
 	/*Draw the box*/
-	gfxDrawMesh(g_mesh, state.proj, state.cam[state.camera_mat], g_tex);
+	gfxDrawListSubmit(&state.draws, state.proj, state.cam[state.camera_mat]);
 	return 1;
 }
 
@@ -192,11 +252,22 @@ appDraw()
 void
 appQuit(void)
 {
+	/*Finish the pending loads before freeing*/
+	for (u32 i = 0; i < 2; ++i) {
+		if (state.mesh_load[i] != NULL) {
+			gfxJobWait(state.mesh_load[i]);
+		}
+		if (state.tex_load[i] != NULL) {
+			gfxJobWait(state.tex_load[i]);
+		}
+	}
 	/*Free mesh memory*/
+	gfxDrawListFree(&state.draws);
 	gfxMeshFree(state.mesh);
 	gfxMeshFree(state.mesh+1);
 	gfxTexFree(state.texture[0]);
 	gfxTexFree(state.texture[1]);
+	gfxJobQuit();
 }
 
 /* Application initializer function */
@@ -239,21 +310,19 @@ appSetup(void)
 	gfxLightViewUpdate(state.cam[state.camera_mat]);
 	gfxSet(GFX_DEPTH_TEST, TRUE);
 	gfxSet(GFX_LIGHTING_MODE, GFX_LIGHT_PHONG);
+	/*Drop the resolution to hold 60 Hz*/
+	gfxSet(GFX_FRAME_BUDGET, 14000);
+	gfxDrawListInit(&state.draws);
+	state.draws.incremental = TRUE;
 
-	/*Initialize the meshes that we can display*/
+	/*Start loading the meshes and textures, drawing starts as they finish*/
 	printf("START MESH READ: res/mesh/bunny.obj...\n");
-	gfxMeshLoad(state.mesh, "res/mesh/bunny.obj");
-	printf("MESH READ DONE.\n");
+	state.mesh_load[0] = gfxMeshLoadAsync(state.mesh, "res/mesh/bunny.obj", GFX_MESH_OPTIMIZE | GFX_MESH_LOD);
 	printf("START MESH READ: res/mesh/statue.obj...\n");
-	gfxMeshLoad(state.mesh+1, "res/mesh/statue.obj");
-	printf("MESH READ DONE.\n");
-	state.mesh[0].mtrl = mtrl_set[state.mtrl_mode];
-	state.mesh[1].mtrl = mtrl_set[state.mtrl_mode];
+	state.mesh_load[1] = gfxMeshLoadAsync(state.mesh+1, "res/mesh/statue.obj", GFX_MESH_OPTIMIZE | GFX_MESH_LOD);
 	g_mesh = state.mesh;
 
-	state.texture[0] = gfxTexLoadBMP("res/textures/wood.bmp");
-	printf("TEXTURE READ: res/textures/wood.bmp\n");
-	state.texture[1] = gfxTexLoadBMP("res/textures/stone.bmp");
-	printf("TEXTURE READ: res/textures/stone.bmp\n");
-	g_tex = state.texture[0];
+	state.tex_load[0] = gfxTexLoadBMPAsync(state.texture, "res/textures/wood.bmp");
+	state.tex_load[1] = gfxTexLoadBMPAsync(state.texture+1, "res/textures/stone.bmp");
+	g_tex = NULL;
 }